@@ -6,9 +6,12 @@
 
 #include "cbase/c_buffer.h"
 #include "csocket/c_address.h"
+#include "csocket/private/c_atomic.h"
 
 #ifdef PLATFORM_PC
 #    include <cstdio>
+#    include <cstring>
+#    include <io.h>        // For _commit()
 #    include <winsock2.h>  // For socket(), connect(), send(), and recv()
 #    include <ws2tcpip.h>
 typedef int  socklen_t;
@@ -23,177 +26,812 @@ typedef char raw_type;  // Type used for raw data on this platform
 #    include <sys/socket.h>  // For socket(), connect(), send(), and recv()
 #    include <sys/types.h>   // For data types
 #    include <unistd.h>      // For close()
+#    include <fcntl.h>       // For open()
+#    include <sys/mman.h>    // For mmap()
+#    include <sys/stat.h>    // For fstat()
 typedef void raw_type;  // Type used for raw data on this platform
 #endif
 
 #include <errno.h>  // For errno
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    include <emmintrin.h>
+#    define CSOCKET_REGISTRY_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    include <arm_neon.h>
+#    define CSOCKET_REGISTRY_NEON
+#endif
+
 namespace ncore
 {
     typedef nhash::skein256 addr_hasher_t;
 
-    struct address_t
+    // The registry is a Swiss table, the slots are split in groups of 16 and every
+    // slot has a control byte that is EMPTY, DELETED or 7 bits of the hash of its ID.
+    // A lookup compares the 16 control bytes of a group in one go and only looks at
+    // the IDs of the slots that match. The entries are stored inline.
+    namespace nregistry
     {
-        data_t<32> m_id;  // Connection ID
-        data_t<32> m_ep;  // End-Point information (e.g. 88.128.64.32:5488, IP:Port)
-        address_t *m_next;
-    };
+        enum
+        {
+            GROUP_SIZE     = 16,
+            MIGRATE_GROUPS = 2,   // groups that are moved to the new table on every add and rem while it grows
+            READER_STRIPES = 16,  // readers of the concurrent registry are counted on this many cache lines
+            STRIPE_STRIDE  = 16,  // u32's per cache line
+        };
+
+        const byte CTRL_EMPTY   = 0x80;
+        const byte CTRL_DELETED = 0xFE;
+
+        struct entry_t
+        {
+            address_id_t m_id;
+            address_id_t m_ep;
+        };
+
+        struct table_t
+        {
+            u32           m_groups;       // a power of two
+            u32           m_count;
+            u32           m_growth_left;  // empty slots that can still be used before the table is too full
+            byte         *m_ctrl;         // m_groups * GROUP_SIZE control bytes
+            entry_t      *m_entries;
+            u32 volatile *m_seq;          // concurrent table only, sequence per group that is odd while the group is written
+            void         *m_map;          // the control bytes and entries are a private mapping of a snapshot
+            u64           m_map_size;
+        };
+
+        // A snapshot file is this header followed by the control bytes and the entries
+        // of a table, it contains no pointers so it can be mapped and used as it is.
+        const u32 SNAPSHOT_MAGIC   = 0x47525343;  // 'CSRG'
+        const u32 SNAPSHOT_VERSION = 1;
+
+        struct snapshot_header_t
+        {
+            u32 m_magic;
+            u32 m_version;
+            u32 m_group_size;
+            u32 m_entry_size;
+            u32 m_groups;
+            u32 m_count;
+            u32 m_growth_left;
+            u32 m_reserved[9];  // the control bytes start at a 64 byte boundary
+        };
+
+        static inline u32 s_first(u32 mask)
+        {
+#if defined(_MSC_VER)
+            unsigned long i;
+            _BitScanForward(&i, mask);
+            return (u32)i;
+#else
+            return (u32)__builtin_ctz(mask);
+#endif
+        }
+
+        // Bit i of a mask is set for slot i of a group
+#if defined(CSOCKET_REGISTRY_SSE2)
+        static inline u32 s_match(byte const *ctrl, byte h2) { return (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((__m128i const*)ctrl), _mm_set1_epi8((char)h2))); }
+        static inline u32 s_match_free(byte const *ctrl) { return (u32)_mm_movemask_epi8(_mm_load_si128((__m128i const*)ctrl)); }
+#elif defined(CSOCKET_REGISTRY_NEON)
+        // The comparison is narrowed to a nibble per slot and then to a bit per slot
+        static inline u32 s_nibbles_to_mask(uint8x16_t eq)
+        {
+            u64 m = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            m     = m & 0x1111111111111111ull;
+            m     = (m | (m >> 3)) & 0x0303030303030303ull;
+            m     = (m | (m >> 6)) & 0x000F000F000F000Full;
+            m     = (m | (m >> 12)) & 0x000000FF000000FFull;
+            m     = (m | (m >> 24)) & 0xFFFF;
+            return (u32)m;
+        }
+        static inline u32 s_match(byte const *ctrl, byte h2) { return s_nibbles_to_mask(vceqq_u8(vld1q_u8(ctrl), vdupq_n_u8(h2))); }
+        static inline u32 s_match_free(byte const *ctrl) { return s_nibbles_to_mask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(ctrl)), vdupq_n_s8(0))); }
+#else
+        // The high bit of every byte is gathered into the low 8 bits
+        static inline u32 s_gather(u64 m) { return (u32)((((m >> 7) & 0x0101010101010101ull) * 0x0102040810204080ull) >> 56); }
+        static inline u32 s_match8(byte const *ctrl, byte h2)
+        {
+            u64 x;
+            g_memcpy(&x, ctrl, sizeof(x));
+            x ^= 0x0101010101010101ull * h2;
+            u64 const zero = (x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull;
+
+            // The zero byte trick can flag a byte above a real match, check them one by one
+            u32 mask = s_gather(zero);
+            u32 m    = mask;
+            while (m != 0)
+            {
+                u32 const i = s_first(m);
+                if (ctrl[i] != h2)
+                    mask &= ~(1u << i);
+                m &= m - 1;
+            }
+            return mask;
+        }
+        static inline u32 s_free8(byte const *ctrl)
+        {
+            u64 x;
+            g_memcpy(&x, ctrl, sizeof(x));
+            return s_gather(x & 0x8080808080808080ull);
+        }
+        static inline u32 s_match(byte const *ctrl, byte h2) { return s_match8(ctrl, h2) | (s_match8(ctrl + 8, h2) << 8); }
+        static inline u32 s_match_free(byte const *ctrl) { return s_free8(ctrl) | (s_free8(ctrl + 8) << 8); }
+#endif
+        static inline u32 s_match_empty(byte const *ctrl) { return s_match(ctrl, CTRL_EMPTY); }
+
+        // IDs are hashes themselves, their bits are mixed once more to be safe
+        static inline u64 s_hash(address_id_t const &id)
+        {
+            u64 h = 0;
+            for (s32 i = 0; i < 8; ++i)
+                h |= (u64)id[8 + i] << (i * 8);
+            h *= 0x9E3779B97F4A7C15ull;
+            return h ^ (h >> 32);
+        }
+        static inline u32  s_h1(u64 hash) { return (u32)(hash >> 7); }
+        static inline byte s_h2(u64 hash) { return (byte)(hash & 0x7F); }
+
+        // A table that is at most 7/8 full
+        static u32 s_groups_for(u32 count)
+        {
+            u64 const slots  = ((u64)count * 8 + 6) / 7;
+            u32       groups = 1;
+            while ((u64)groups * GROUP_SIZE < slots)
+                groups <<= 1;
+            return groups;
+        }
+
+        // A concurrent table starts with the sequences of its groups
+        static void s_init(alloc_t *allocator, table_t *table, u32 groups, bool concurrent)
+        {
+            u32 const slots      = groups * GROUP_SIZE;
+            u32 const seq_size   = concurrent ? (groups * sizeof(u32) + GROUP_SIZE - 1) & ~(u32)(GROUP_SIZE - 1) : 0;
+            byte     *mem        = (byte *)allocator->allocate(seq_size + slots + slots * sizeof(entry_t), GROUP_SIZE);
+            table->m_groups      = groups;
+            table->m_count       = 0;
+            table->m_growth_left = slots - slots / 8;
+            table->m_seq         = concurrent ? (u32 volatile *)mem : nullptr;
+            table->m_map         = nullptr;
+            table->m_map_size    = 0;
+            table->m_ctrl        = mem + seq_size;
+            table->m_entries     = (entry_t *)(mem + seq_size + slots);
+            g_memset(mem, 0, seq_size);
+            g_memset(table->m_ctrl, CTRL_EMPTY, slots);
+        }
+
+        static void s_unmap(void *map, u64 size)
+        {
+#ifdef PLATFORM_PC
+            ::UnmapViewOfFile(map);
+#else
+            ::munmap(map, (size_t)size);
+#endif
+        }
+
+        static void s_exit(alloc_t *allocator, table_t *table)
+        {
+            if (table->m_map != nullptr)
+            {
+                // The sequences of a mapped table are allocated on their own
+                s_unmap(table->m_map, table->m_map_size);
+                if (table->m_seq != nullptr)
+                    allocator->deallocate((void *)table->m_seq);
+            }
+            else if (table->m_seq != nullptr)
+                allocator->deallocate((void *)table->m_seq);
+            else if (table->m_ctrl != nullptr)
+                allocator->deallocate(table->m_ctrl);
+            table->m_groups      = 0;
+            table->m_count       = 0;
+            table->m_growth_left = 0;
+            table->m_ctrl        = nullptr;
+            table->m_entries     = nullptr;
+            table->m_seq         = nullptr;
+            table->m_map         = nullptr;
+            table->m_map_size    = 0;
+        }
+
+        // The data of @file is on disk before it replaces a snapshot
+        static bool s_sync(FILE *file)
+        {
+#ifdef PLATFORM_PC
+            return ::_commit(::_fileno(file)) == 0;
+#else
+            return ::fsync(::fileno(file)) == 0;
+#endif
+        }
+
+        static bool s_replace(char const *from, char const *to)
+        {
+#ifdef PLATFORM_PC
+            return ::MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            return ::rename(from, to) == 0;
+#endif
+        }
+
+        // The snapshot is written next to @path and renamed over it when it is complete, a
+        // registry that has @path mapped keeps the file it opened.
+        static bool s_save(table_t const *table, char const *path)
+        {
+            snapshot_header_t header;
+            g_memset(&header, 0, sizeof(header));
+            header.m_magic       = SNAPSHOT_MAGIC;
+            header.m_version     = SNAPSHOT_VERSION;
+            header.m_group_size  = GROUP_SIZE;
+            header.m_entry_size  = sizeof(entry_t);
+            header.m_groups      = table->m_groups;
+            header.m_count       = table->m_count;
+            header.m_growth_left = table->m_growth_left;
+
+            char         tmp_path[1024];
+            size_t const len = ::strlen(path);
+            if (len + sizeof(".tmp") > sizeof(tmp_path))
+                return false;
+            g_memcpy(tmp_path, path, len);
+            g_memcpy(tmp_path + len, ".tmp", sizeof(".tmp"));
+
+            FILE *file = ::fopen(tmp_path, "wb");
+            if (file == nullptr)
+                return false;
+            size_t const slots = (size_t)table->m_groups * GROUP_SIZE;
+            bool         ok    = ::fwrite(&header, sizeof(header), 1, file) == 1 && ::fwrite(table->m_ctrl, 1, slots, file) == slots && ::fwrite(table->m_entries, sizeof(entry_t), slots, file) == slots;
+            ok                 = ok && ::fflush(file) == 0 && s_sync(file);
+            ok                 = (::fclose(file) == 0) && ok;
+            ok                 = ok && s_replace(tmp_path, path);
+            if (!ok)
+                ::remove(tmp_path);
+            return ok;
+        }
+
+        // Maps a snapshot copy-on-write, changes to the table never reach the file. The
+        // header has to agree with the control bytes, an insert relies on the growth that
+        // is left. The pages of the entries are read when they are first used.
+        static bool s_map(alloc_t *allocator, table_t *table, char const *path, bool concurrent)
+        {
+            void *map  = nullptr;
+            u64   size = 0;
+#ifdef PLATFORM_PC
+            HANDLE file = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            LARGE_INTEGER file_size;
+            HANDLE        mapping = NULL;
+            if (::GetFileSizeEx(file, &file_size) && file_size.QuadPart >= (LONGLONG)sizeof(snapshot_header_t))
+                mapping = ::CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+            if (mapping != NULL)
+            {
+                map  = ::MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+                size = (u64)file_size.QuadPart;
+                ::CloseHandle(mapping);
+            }
+            ::CloseHandle(file);
+#else
+            int const fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                return false;
+            struct stat st;
+            if (::fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(snapshot_header_t))
+            {
+                map  = ::mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+                size = (u64)st.st_size;
+                if (map == MAP_FAILED)
+                    map = nullptr;
+            }
+            ::close(fd);
+#endif
+            if (map == nullptr)
+                return false;
+
+            snapshot_header_t const *header = (snapshot_header_t const *)map;
+            u64 const                slots  = (u64)header->m_groups * GROUP_SIZE;
+            bool const valid = header->m_magic == SNAPSHOT_MAGIC && header->m_version == SNAPSHOT_VERSION && header->m_group_size == GROUP_SIZE && header->m_entry_size == sizeof(entry_t) && header->m_groups != 0 &&
+                               (header->m_groups & (header->m_groups - 1)) == 0 && size == sizeof(snapshot_header_t) + slots + slots * sizeof(entry_t) && header->m_count <= slots && header->m_growth_left <= slots - slots / 8;
+            u64 empty   = 0;
+            u64 deleted = 0;
+            u64 used    = 0;
+            if (valid)
+            {
+                byte const *ctrl = (byte const *)map + sizeof(snapshot_header_t);
+                for (u64 i = 0; i < slots; ++i)
+                {
+                    empty += (ctrl[i] == CTRL_EMPTY) ? 1 : 0;
+                    deleted += (ctrl[i] == CTRL_DELETED) ? 1 : 0;
+                    used += (ctrl[i] < CTRL_EMPTY) ? 1 : 0;
+                }
+            }
+            if (!valid || empty + deleted + used != slots || used != header->m_count || empty < slots / 8 || header->m_growth_left != empty - slots / 8)
+            {
+                s_unmap(map, size);
+                return false;
+            }
+
+            table->m_groups      = header->m_groups;
+            table->m_count       = header->m_count;
+            table->m_growth_left = header->m_growth_left;
+            table->m_ctrl        = (byte *)map + sizeof(snapshot_header_t);
+            table->m_entries     = (entry_t *)(table->m_ctrl + slots);
+            table->m_seq         = nullptr;
+            table->m_map         = map;
+            table->m_map_size    = size;
+            if (concurrent)
+            {
+                table->m_seq = (u32 volatile *)allocator->allocate(table->m_groups * sizeof(u32), sizeof(u32));
+                g_memset((void *)table->m_seq, 0, table->m_groups * sizeof(u32));
+            }
+            return true;
+        }
+
+        // A group of a concurrent table is changed between these two, readers that
+        // overlap with it see an odd or a different sequence and read the group again
+        static inline void s_write_begin(table_t *table, u32 slot)
+        {
+            if (table->m_seq == nullptr)
+                return;
+            u32 volatile *seq = &table->m_seq[slot / GROUP_SIZE];
+            natomic::store_release(seq, *seq + 1);
+            natomic::fence_release();
+        }
+        static inline void s_write_end(table_t *table, u32 slot)
+        {
+            if (table->m_seq == nullptr)
+                return;
+            u32 volatile *seq = &table->m_seq[slot / GROUP_SIZE];
+            natomic::store_release(seq, *seq + 1);
+        }
+
+        // Returns the slot of @id or -1, the groups are probed in triangular order which
+        // visits every group once. A group with an empty slot ends the search.
+        static s32 s_find(table_t const *table, address_id_t const &id, u64 hash)
+        {
+            if (table->m_ctrl == nullptr)
+                return -1;
+            u32 const  mask = table->m_groups - 1;
+            byte const h2   = s_h2(hash);
+            u32        g    = s_h1(hash) & mask;
+            for (u32 step = 1; step <= table->m_groups; ++step)
+            {
+                byte const *ctrl  = table->m_ctrl + g * GROUP_SIZE;
+                u32         match = s_match(ctrl, h2);
+                while (match != 0)
+                {
+                    u32 const slot = g * GROUP_SIZE + s_first(match);
+                    if (table->m_entries[slot].m_id.compare(id) == 0)
+                        return (s32)slot;
+                    match &= match - 1;
+                }
+                if (s_match_empty(ctrl) != 0)
+                    break;
+                g = (g + step) & mask;
+            }
+            return -1;
+        }
+
+        // @id is not in the table and there is growth left
+        static void s_insert(table_t *table, address_id_t const &id, address_id_t const &ep, u64 hash)
+        {
+            u32 const mask = table->m_groups - 1;
+            u32       g    = s_h1(hash) & mask;
+            u32       free;
+            for (u32 step = 1;; ++step)
+            {
+                free = s_match_free(table->m_ctrl + g * GROUP_SIZE);
+                if (free != 0)
+                    break;
+                g = (g + step) & mask;
+            }
+
+            u32 const slot = g * GROUP_SIZE + s_first(free);
+            if (table->m_ctrl[slot] == CTRL_EMPTY)
+                table->m_growth_left -= 1;
+            s_write_begin(table, slot);
+            table->m_ctrl[slot]         = s_h2(hash);
+            table->m_entries[slot].m_id = id;
+            table->m_entries[slot].m_ep = ep;
+            s_write_end(table, slot);
+            table->m_count += 1;
+        }
+
+        // A slot in a group that still has an empty slot can be empty again, no search
+        // goes past that group. Otherwise it becomes a tombstone.
+        static void s_erase(table_t *table, u32 slot)
+        {
+            byte *ctrl = table->m_ctrl + (slot & ~(u32)(GROUP_SIZE - 1));
+            s_write_begin(table, slot);
+            if (s_match_empty(ctrl) != 0)
+            {
+                table->m_ctrl[slot] = CTRL_EMPTY;
+                table->m_growth_left += 1;
+            }
+            else
+            {
+                table->m_ctrl[slot] = CTRL_DELETED;
+            }
+            s_write_end(table, slot);
+            table->m_count -= 1;
+        }
+
+        // s_find() for readers of a concurrent table, a group is only trusted when its
+        // sequence was even and did not change while it was read
+        static bool s_read(table_t const *table, address_id_t const &id, u64 hash, address_id_t &ep)
+        {
+            u32 const  mask = table->m_groups - 1;
+            byte const h2   = s_h2(hash);
+            u32        g    = s_h1(hash) & mask;
+            for (u32 step = 1; step <= table->m_groups; ++step)
+            {
+                byte const  *ctrl  = table->m_ctrl + g * GROUP_SIZE;
+                bool         found = false;
+                bool         last  = false;
+                address_id_t value;
+                u32          seq;
+                do
+                {
+                    seq = natomic::load_acquire(&table->m_seq[g]);
+                    if ((seq & 1) != 0)
+                        continue;
+
+                    found     = false;
+                    u32 match = s_match(ctrl, h2);
+                    while (match != 0 && !found)
+                    {
+                        entry_t const &e = table->m_entries[g * GROUP_SIZE + s_first(match)];
+                        if (e.m_id.compare(id) == 0)
+                        {
+                            value = e.m_ep;
+                            found = true;
+                        }
+                        match &= match - 1;
+                    }
+                    last = s_match_empty(ctrl) != 0;
+                    natomic::fence_acquire();
+                } while ((seq & 1) != 0 || natomic::load_acquire(&table->m_seq[g]) != seq);
+
+                if (found)
+                {
+                    ep = value;
+                    return true;
+                }
+                if (last)
+                    break;
+                g = (g + step) & mask;
+            }
+            return false;
+        }
+    }  // namespace nregistry
 
     class address_registry_imp_t : public address_registry_t
     {
     protected:
         friend class address_registry_t;
 
-        alloc_t    *m_allocator;
-        u32         m_count;
-        u32         m_size;
-        u32         m_mask;
-        address_t **m_hashtable;
+        alloc_t           *m_allocator;
+        nregistry::table_t m_table;
+        nregistry::table_t m_old;      // while growing, the entries that still have to be moved to m_table
+        u32                m_migrate;  // next group of m_old that is moved
 
     public:
         address_registry_imp_t()
             : m_allocator(nullptr)
-            , m_count(0)
-            , m_size(0)
-            , m_mask(0)
-            , m_hashtable(nullptr)
+            , m_migrate(0)
         {
+            g_memset(&m_table, 0, sizeof(m_table));
+            g_memset(&m_old, 0, sizeof(m_old));
         }
 
         DCORE_CLASS_PLACEMENT_NEW_DELETE
 
-        void init(alloc_t *allocator)
+        void init(alloc_t *allocator, u32 max_addresses)
         {
             m_allocator = allocator;
-            m_count     = 0;
-            m_size      = 4096;
-            m_mask      = (m_size - 1);
-            m_hashtable = (address_t **)m_allocator->allocate(m_size * sizeof(void *), sizeof(void *));
+            m_migrate   = 0;
+            nregistry::s_init(m_allocator, &m_table, nregistry::s_groups_for(max_addresses), false);
+        }
+
+        bool open(alloc_t *allocator, char const *path)
+        {
+            m_allocator = allocator;
+            m_migrate   = 0;
+            return nregistry::s_map(m_allocator, &m_table, path, false);
+        }
+
+        void exit()
+        {
+            nregistry::s_exit(m_allocator, &m_old);
+            nregistry::s_exit(m_allocator, &m_table);
+        }
+
+        virtual void release()
+        {
+            alloc_t *allocator = m_allocator;
+            exit();
+            g_deallocate(allocator, this);
         }
 
         virtual bool add(address_id_t const &addr_id, address_id_t const &addr_ep)
         {
-            address_t *h = find_by_hash(addr_id);
-            if (h == nullptr)
-            {
-                // We don't have this ID registered
-                h       = (address_t *)m_allocator->allocate(sizeof(address_t), sizeof(void *));
-                h->m_id = addr_id;
-                h->m_ep = addr_ep;
-                add(h);
-                return true;
-            }
-            return false;
+            u64 const hash = nregistry::s_hash(addr_id);
+            if (nregistry::s_find(&m_table, addr_id, hash) >= 0 || nregistry::s_find(&m_old, addr_id, hash) >= 0)
+                return false;
+
+            migrate(nregistry::MIGRATE_GROUPS);
+            if (m_table.m_growth_left == 0)
+                grow();
+            nregistry::s_insert(&m_table, addr_id, addr_ep, hash);
+            return true;
         }
 
         virtual bool get(address_id_t const &addr_id, address_id_t &addr_ep)
         {
-            address_t *h = find_by_hash(addr_id);
-            if (h != nullptr)
+            u64 const                 hash  = nregistry::s_hash(addr_id);
+            nregistry::table_t const *table = &m_table;
+            s32                       slot  = nregistry::s_find(table, addr_id, hash);
+            if (slot < 0)
             {
-                addr_ep = h->m_ep;
+                table = &m_old;
+                slot  = nregistry::s_find(table, addr_id, hash);
+                if (slot < 0)
+                    return false;
             }
-            return (h != nullptr);
+            addr_ep = table->m_entries[slot].m_ep;
+            return true;
         }
 
         virtual bool rem(address_id_t const &addr_id)
         {
-            address_t *h = find_by_hash(addr_id);
-            if (h != nullptr)
+            u64 const           hash  = nregistry::s_hash(addr_id);
+            nregistry::table_t *table = &m_table;
+            s32                 slot  = nregistry::s_find(table, addr_id, hash);
+            if (slot < 0)
             {
-                remove(h);
-                destroy(h);
-                return true;
+                table = &m_old;
+                slot  = nregistry::s_find(table, addr_id, hash);
+                if (slot < 0)
+                    return false;
             }
-            return false;
+            nregistry::s_erase(table, (u32)slot);
+            migrate(nregistry::MIGRATE_GROUPS);
+            return true;
+        }
+
+        virtual bool save(char const *path)
+        {
+            // A snapshot is a single table
+            migrate(m_old.m_groups);
+            return nregistry::s_save(&m_table, path);
         }
 
     protected:
-        u32 hash_to_index(address_id_t const &hash) const
+        // The table is replaced by one that is twice as large, or by one of the same size
+        // when it is mostly tombstones. The entries are moved a few groups at a time so
+        // that no single add has to rehash the whole table.
+        void grow()
         {
-            u32 i = (u32)(hash[8]) | (u32)(hash[9] << 8) | (u32)(hash[10] << 16) | (u32)(hash[11] << 24);
-            i     = i & m_mask;
-            return i;
+            migrate(m_old.m_groups);
+
+            u32 const slots  = m_table.m_groups * nregistry::GROUP_SIZE;
+            u32 const groups = (m_table.m_count >= slots * 7 / 16) ? m_table.m_groups * 2 : m_table.m_groups;
+            m_old            = m_table;
+            m_migrate        = 0;
+            nregistry::s_init(m_allocator, &m_table, groups, false);
         }
 
-        address_t *find_by_hash(address_id_t const &hash)
+        void migrate(u32 num_groups)
         {
-            u32 const  i = hash_to_index(hash);
-            address_t *e = m_hashtable[i];
-            while (e != nullptr)
+            if (m_old.m_ctrl == nullptr)
+                return;
+
+            while (num_groups > 0 && m_migrate < m_old.m_groups)
             {
-                if (e->m_id.size() == hash.size() && e->m_id.compare(hash) == 0)
-                    break;
-                e = e->m_next;
+                u32 const first = m_migrate * nregistry::GROUP_SIZE;
+                u32       used  = ~nregistry::s_match_free(m_old.m_ctrl + first) & 0xFFFF;
+                while (used != 0)
+                {
+                    nregistry::entry_t const &e = m_old.m_entries[first + nregistry::s_first(used)];
+                    nregistry::s_insert(&m_table, e.m_id, e.m_ep, nregistry::s_hash(e.m_id));
+                    m_old.m_count -= 1;
+                    used &= used - 1;
+                }
+
+                // Searches in the old table continue past a group that has been moved
+                g_memset(m_old.m_ctrl + first, nregistry::CTRL_DELETED, nregistry::GROUP_SIZE);
+                m_migrate += 1;
+                num_groups -= 1;
             }
-            return e;
+
+            if (m_migrate == m_old.m_groups)
+            {
+                nregistry::s_exit(m_allocator, &m_old);
+                m_migrate = 0;
+            }
+        }
+    };
+
+    // The same table for one writer and any number of readers, the groups are guarded
+    // by a sequence lock. A reader spins while the writer is changing the group it
+    // reads and reads it again when it overlapped with a change to it.
+    // The table grows in one go instead of incrementally, the new table is published
+    // and the old one is freed once the readers that might still use it are done.
+    // Readers announce themselves in the current epoch on one of a few cache lines
+    // that is picked by the ID, so that they do not all write to the same line.
+    class address_registry_mt_imp_t : public address_registry_t
+    {
+    protected:
+        friend class address_registry_t;
+
+        alloc_t                     *m_allocator;
+        nregistry::table_t *volatile m_table;
+        u32 volatile                 m_epoch;
+        u32 volatile                 m_readers[2 * nregistry::READER_STRIPES * nregistry::STRIPE_STRIDE];
+
+    public:
+        address_registry_mt_imp_t()
+            : m_allocator(nullptr)
+            , m_table(nullptr)
+            , m_epoch(0)
+        {
+            g_memset((void *)m_readers, 0, sizeof(m_readers));
         }
 
-        void add(address_t *h)
+        DCORE_CLASS_PLACEMENT_NEW_DELETE
+
+        void init(alloc_t *allocator, u32 max_addresses)
         {
-            u32 const   i = hash_to_index(h->m_id);
-            address_t **p = &m_hashtable[i];
-            address_t  *e = m_hashtable[i];
-            while (e != nullptr)
+            m_allocator               = allocator;
+            nregistry::table_t *table = g_allocate<nregistry::table_t>(m_allocator);
+            nregistry::s_init(m_allocator, table, nregistry::s_groups_for(max_addresses), true);
+            m_table = table;
+        }
+
+        bool open(alloc_t *allocator, char const *path)
+        {
+            m_allocator               = allocator;
+            nregistry::table_t *table = g_allocate<nregistry::table_t>(m_allocator);
+            if (!nregistry::s_map(m_allocator, table, path, true))
             {
-                s32 r = e->m_id.compare(h->m_id);
-                if (r == -1)
-                {
-                    break;
-                }
-                p = &e->m_next;
-                e = e->m_next;
+                g_deallocate(m_allocator, table);
+                return false;
+            }
+            m_table = table;
+            return true;
+        }
+
+        virtual void release()
+        {
+            alloc_t *allocator = m_allocator;
+            nregistry::s_exit(allocator, m_table);
+            g_deallocate(allocator, m_table);
+            g_deallocate(allocator, this);
+        }
+
+        virtual bool add(address_id_t const &addr_id, address_id_t const &addr_ep)
+        {
+            u64 const hash = nregistry::s_hash(addr_id);
+            if (nregistry::s_find(m_table, addr_id, hash) >= 0)
+                return false;
+
+            if (m_table->m_growth_left == 0)
+                grow();
+            nregistry::s_insert(m_table, addr_id, addr_ep, hash);
+            return true;
+        }
+
+        virtual bool get(address_id_t const &addr_id, address_id_t &addr_ep)
+        {
+            u64 const     hash    = nregistry::s_hash(addr_id);
+            u32 volatile *readers = enter(hash);
+            bool const    found   = nregistry::s_read(natomic::load_acquire(&m_table), addr_id, hash, addr_ep);
+            natomic::fetch_add(readers, (u32)-1);
+            return found;
+        }
+
+        virtual bool rem(address_id_t const &addr_id)
+        {
+            s32 const slot = nregistry::s_find(m_table, addr_id, nregistry::s_hash(addr_id));
+            if (slot < 0)
+                return false;
+            nregistry::s_erase(m_table, (u32)slot);
+            return true;
+        }
+
+        virtual bool save(char const *path) { return nregistry::s_save(m_table, path); }
+
+    protected:
+        // Returns the counter of the epoch that the reader is now part of
+        u32 volatile *enter(u64 hash)
+        {
+            u32 const stripe = (u32)(hash >> 40) & (nregistry::READER_STRIPES - 1);
+            for (;;)
+            {
+                u32 const     epoch   = natomic::load_acquire(&m_epoch);
+                u32 volatile *readers = &m_readers[((epoch & 1) * nregistry::READER_STRIPES + stripe) * nregistry::STRIPE_STRIDE];
+                natomic::fetch_add(readers, 1);
+                natomic::fence();
+                if (natomic::load_acquire(&m_epoch) == epoch)
+                    return readers;
+                natomic::fetch_add(readers, (u32)-1);
             }
-            *p        = h;
-            h->m_next = e;
         }
 
-        void remove(address_t *h)
+        void grow()
         {
-            u32 const   i = hash_to_index(h->m_id);
-            address_t **p = &m_hashtable[i];
-            address_t  *e = m_hashtable[i];
-            while (e != nullptr)
+            nregistry::table_t *old    = m_table;
+            u32 const           slots  = old->m_groups * nregistry::GROUP_SIZE;
+            u32 const           groups = (old->m_count >= slots * 7 / 16) ? old->m_groups * 2 : old->m_groups;
+
+            // Nobody can see the new table yet, it is filled without the sequences
+            nregistry::table_t *table = g_allocate<nregistry::table_t>(m_allocator);
+            nregistry::s_init(m_allocator, table, groups, true);
+            u32 volatile *seq = table->m_seq;
+            table->m_seq      = nullptr;
+            for (u32 first = 0; first < slots; first += nregistry::GROUP_SIZE)
             {
-                s32 r = e->m_id.compare(h->m_id);
-                if (r == 0)
+                u32 used = ~nregistry::s_match_free(old->m_ctrl + first) & 0xFFFF;
+                while (used != 0)
                 {
-                    *p = e->m_next;
-                    e  = e->m_next;
-                    break;
+                    nregistry::entry_t const &e = old->m_entries[first + nregistry::s_first(used)];
+                    nregistry::s_insert(table, e.m_id, e.m_ep, nregistry::s_hash(e.m_id));
+                    used &= used - 1;
                 }
-                p = &e->m_next;
-                e = e->m_next;
             }
-            h->m_next = nullptr;
-        }
+            table->m_seq = seq;
+            natomic::store_release(&m_table, table);
 
-        void destroy(address_t *h) { m_allocator->deallocate(h); }
+            // Readers that arrive from now on are counted in the next epoch and see the new
+            // table, the old one can go once the readers of the current epoch have left
+            u32 const epoch = m_epoch;
+            natomic::store_release(&m_epoch, epoch + 1);
+            natomic::fence();
+            for (u32 i = 0; i < nregistry::READER_STRIPES; ++i)
+            {
+                while (natomic::load_acquire(&m_readers[((epoch & 1) * nregistry::READER_STRIPES + i) * nregistry::STRIPE_STRIDE]) != 0) {}
+            }
+            nregistry::s_exit(m_allocator, old);
+            g_deallocate(m_allocator, old);
+        }
     };
 
     bool address_registry_t::create(alloc_t *alloc, u32 max_addresses, address_registry_t *&addresses)
     {
         address_registry_imp_t *addr_imp = g_allocate<address_registry_imp_t>(alloc);
-        addr_imp->init(alloc);
+        addr_imp->init(alloc, max_addresses);
+        addresses = addr_imp;
+        return true;
+    }
+
+    bool address_registry_t::create_concurrent(alloc_t *alloc, u32 max_addresses, address_registry_t *&addresses)
+    {
+        address_registry_mt_imp_t *addr_imp = g_allocate<address_registry_mt_imp_t>(alloc);
+        addr_imp->init(alloc, max_addresses);
         addresses = addr_imp;
         return true;
     }
 
-    void address_registry_t::destroy(address_registry_t *addr)
+    bool address_registry_t::open_snapshot(alloc_t *alloc, char const *path, address_registry_t *&addresses)
     {
-        address_registry_imp_t *imp = (address_registry_imp_t *)addr;
-        for (u32 i = 0; i < imp->m_size; i++)
+        address_registry_imp_t *addr_imp = g_allocate<address_registry_imp_t>(alloc);
+        if (!addr_imp->open(alloc, path))
         {
-            address_t *e = imp->m_hashtable[i];
-            while (e != nullptr)
-            {
-                address_t *n = e->m_next;
-                imp->m_allocator->deallocate(e);
-                e = n;
-            }
+            g_deallocate(alloc, addr_imp);
+            return false;
         }
-        imp->m_allocator->deallocate(imp->m_hashtable);
-        imp->m_allocator->deallocate(imp);
-    };
+        addresses = addr_imp;
+        return true;
+    }
+
+    bool address_registry_t::open_snapshot_concurrent(alloc_t *alloc, char const *path, address_registry_t *&addresses)
+    {
+        address_registry_mt_imp_t *addr_imp = g_allocate<address_registry_mt_imp_t>(alloc);
+        if (!addr_imp->open(alloc, path))
+        {
+            g_deallocate(alloc, addr_imp);
+            return false;
+        }
+        addresses = addr_imp;
+        return true;
+    }
+
+    void address_registry_t::destroy(address_registry_t *addr) { addr->release(); };
 
 }  // namespace ncore
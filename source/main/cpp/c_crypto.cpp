@@ -0,0 +1,608 @@
+#include "ccore/c_target.h"
+#include "cbase/c_memory.h"
+
+#include "csocket/private/c_crypto.h"
+
+#ifdef PLATFORM_PC
+#    include <windows.h>
+#    define RtlGenRandom SystemFunction036
+extern "C" BOOLEAN NTAPI RtlGenRandom(PVOID RandomBuffer, ULONG RandomBufferLength);
+#    pragma comment(lib, "advapi32.lib")
+#else
+#    include <fcntl.h>   // For open()
+#    include <unistd.h>  // For read() and close()
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    include <emmintrin.h>
+#    define CSOCKET_CHACHA_SSE2
+#endif
+
+namespace ncore
+{
+    namespace ncrypto
+    {
+        static inline u32 s_load32(byte const* p) { return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24); }
+
+        static inline void s_store32(byte* p, u32 v)
+        {
+            p[0] = (byte)v;
+            p[1] = (byte)(v >> 8);
+            p[2] = (byte)(v >> 16);
+            p[3] = (byte)(v >> 24);
+        }
+
+        static inline void s_store64(byte* p, u64 v)
+        {
+            s_store32(p, (u32)v);
+            s_store32(p + 4, (u32)(v >> 32));
+        }
+
+        static inline u32 s_rotl(u32 v, u32 n) { return (v << n) | (v >> (32 - n)); }
+
+        // ------------------------------------------------------------------------------------
+        // ChaCha20
+
+#define CHACHA_QR(a, b, c, d) \
+    a += b;                   \
+    d = s_rotl(d ^ a, 16);    \
+    c += d;                   \
+    b = s_rotl(b ^ c, 12);    \
+    a += b;                   \
+    d = s_rotl(d ^ a, 8);     \
+    c += d;                   \
+    b = s_rotl(b ^ c, 7)
+
+        static void s_chacha_rounds(u32* x)
+        {
+            for (u32 i = 0; i < 10; ++i)
+            {
+                CHACHA_QR(x[0], x[4], x[8], x[12]);
+                CHACHA_QR(x[1], x[5], x[9], x[13]);
+                CHACHA_QR(x[2], x[6], x[10], x[14]);
+                CHACHA_QR(x[3], x[7], x[11], x[15]);
+                CHACHA_QR(x[0], x[5], x[10], x[15]);
+                CHACHA_QR(x[1], x[6], x[11], x[12]);
+                CHACHA_QR(x[2], x[7], x[8], x[13]);
+                CHACHA_QR(x[3], x[4], x[9], x[14]);
+            }
+        }
+
+        static void s_chacha_init(u32* state, byte const* key, byte const* nonce, u32 counter)
+        {
+            state[0] = 0x61707865;  // "expand 32-byte k"
+            state[1] = 0x3320646e;
+            state[2] = 0x79622d32;
+            state[3] = 0x6b206574;
+            for (u32 i = 0; i < 8; ++i)
+                state[4 + i] = s_load32(key + 4 * i);
+            state[12] = counter;
+            for (u32 i = 0; i < 3; ++i)
+                state[13 + i] = s_load32(nonce + 4 * i);
+        }
+
+#ifdef CSOCKET_CHACHA_SSE2
+        static inline __m128i s_rotl_sse2(__m128i v, int n) { return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n)); }
+
+#    define CHACHA_QR_SSE2(a, b, c, d)                  \
+        a = _mm_add_epi32(a, b);                        \
+        d = s_rotl_sse2(_mm_xor_si128(d, a), 16);       \
+        c = _mm_add_epi32(c, d);                        \
+        b = s_rotl_sse2(_mm_xor_si128(b, c), 12);       \
+        a = _mm_add_epi32(a, b);                        \
+        d = s_rotl_sse2(_mm_xor_si128(d, a), 8);        \
+        c = _mm_add_epi32(c, d);                        \
+        b = s_rotl_sse2(_mm_xor_si128(b, c), 7)
+
+        // Four blocks at once, lane j of every register belongs to block j. The
+        // registers are transposed back to blocks when the key stream is applied.
+        static void s_chacha_4blocks(u32* state, byte* data)
+        {
+            __m128i x[16];
+            __m128i s[16];
+            for (u32 i = 0; i < 16; ++i)
+                s[i] = _mm_set1_epi32((int)state[i]);
+            s[12] = _mm_add_epi32(s[12], _mm_set_epi32(3, 2, 1, 0));
+            for (u32 i = 0; i < 16; ++i)
+                x[i] = s[i];
+
+            for (u32 i = 0; i < 10; ++i)
+            {
+                CHACHA_QR_SSE2(x[0], x[4], x[8], x[12]);
+                CHACHA_QR_SSE2(x[1], x[5], x[9], x[13]);
+                CHACHA_QR_SSE2(x[2], x[6], x[10], x[14]);
+                CHACHA_QR_SSE2(x[3], x[7], x[11], x[15]);
+                CHACHA_QR_SSE2(x[0], x[5], x[10], x[15]);
+                CHACHA_QR_SSE2(x[1], x[6], x[11], x[12]);
+                CHACHA_QR_SSE2(x[2], x[7], x[8], x[13]);
+                CHACHA_QR_SSE2(x[3], x[4], x[9], x[14]);
+            }
+
+            for (u32 g = 0; g < 4; ++g)
+            {
+                __m128i const a0 = _mm_add_epi32(x[g * 4 + 0], s[g * 4 + 0]);
+                __m128i const a1 = _mm_add_epi32(x[g * 4 + 1], s[g * 4 + 1]);
+                __m128i const a2 = _mm_add_epi32(x[g * 4 + 2], s[g * 4 + 2]);
+                __m128i const a3 = _mm_add_epi32(x[g * 4 + 3], s[g * 4 + 3]);
+                __m128i const t0 = _mm_unpacklo_epi32(a0, a1);
+                __m128i const t1 = _mm_unpacklo_epi32(a2, a3);
+                __m128i const t2 = _mm_unpackhi_epi32(a0, a1);
+                __m128i const t3 = _mm_unpackhi_epi32(a2, a3);
+
+                __m128i const k[4] = {_mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1), _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)};
+                for (u32 b = 0; b < 4; ++b)
+                {
+                    __m128i* p = (__m128i*)(data + b * 64 + g * 16);
+                    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k[b]));
+                }
+            }
+            state[12] += 4;
+        }
+#endif
+
+        void chacha20(byte const* key, byte const* nonce, u32 counter, byte* data, u32 size)
+        {
+            u32 state[16];
+            s_chacha_init(state, key, nonce, counter);
+
+#ifdef CSOCKET_CHACHA_SSE2
+            while (size >= 256)
+            {
+                s_chacha_4blocks(state, data);
+                data += 256;
+                size -= 256;
+            }
+#endif
+
+            while (size > 0)
+            {
+                u32 x[16];
+                for (u32 i = 0; i < 16; ++i)
+                    x[i] = state[i];
+                s_chacha_rounds(x);
+
+                byte stream[64];
+                for (u32 i = 0; i < 16; ++i)
+                    s_store32(stream + 4 * i, x[i] + state[i]);
+                u32 const n = (size < 64) ? size : 64;
+                for (u32 i = 0; i < n; ++i)
+                    data[i] ^= stream[i];
+
+                state[12] += 1;
+                data += n;
+                size -= n;
+            }
+        }
+
+        void hchacha20(byte* out, byte const* key, byte const* input)
+        {
+            u32 x[16];
+            s_chacha_init(x, key, input + 4, s_load32(input));
+            s_chacha_rounds(x);
+            for (u32 i = 0; i < 4; ++i)
+            {
+                s_store32(out + 4 * i, x[i]);
+                s_store32(out + 16 + 4 * i, x[12 + i]);
+            }
+        }
+
+        // ------------------------------------------------------------------------------------
+        // Poly1305, 26 bit limbs so that the products fit in 64 bits
+
+        void poly1305_t::init(byte const* key)
+        {
+            m_r[0] = (s_load32(key + 0)) & 0x3ffffff;
+            m_r[1] = (s_load32(key + 3) >> 2) & 0x3ffff03;
+            m_r[2] = (s_load32(key + 6) >> 4) & 0x3ffc0ff;
+            m_r[3] = (s_load32(key + 9) >> 6) & 0x3f03fff;
+            m_r[4] = (s_load32(key + 12) >> 8) & 0x00fffff;
+            for (u32 i = 0; i < 5; ++i)
+                m_h[i] = 0;
+            for (u32 i = 0; i < 4; ++i)
+                m_pad[i] = s_load32(key + 16 + 4 * i);
+            m_leftover = 0;
+        }
+
+        void poly1305_t::blocks(byte const* data, u32 size, u32 hibit)
+        {
+            u32 const r0 = m_r[0], r1 = m_r[1], r2 = m_r[2], r3 = m_r[3], r4 = m_r[4];
+            u32 const s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+            u32       h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+
+            while (size >= 16)
+            {
+                h0 += (s_load32(data + 0)) & 0x3ffffff;
+                h1 += (s_load32(data + 3) >> 2) & 0x3ffffff;
+                h2 += (s_load32(data + 6) >> 4) & 0x3ffffff;
+                h3 += (s_load32(data + 9) >> 6) & 0x3ffffff;
+                h4 += (s_load32(data + 12) >> 8) | hibit;
+
+                u64 const d0 = (u64)h0 * r0 + (u64)h1 * s4 + (u64)h2 * s3 + (u64)h3 * s2 + (u64)h4 * s1;
+                u64       d1 = (u64)h0 * r1 + (u64)h1 * r0 + (u64)h2 * s4 + (u64)h3 * s3 + (u64)h4 * s2;
+                u64       d2 = (u64)h0 * r2 + (u64)h1 * r1 + (u64)h2 * r0 + (u64)h3 * s4 + (u64)h4 * s3;
+                u64       d3 = (u64)h0 * r3 + (u64)h1 * r2 + (u64)h2 * r1 + (u64)h3 * r0 + (u64)h4 * s4;
+                u64       d4 = (u64)h0 * r4 + (u64)h1 * r3 + (u64)h2 * r2 + (u64)h3 * r1 + (u64)h4 * r0;
+
+                u32 c = (u32)(d0 >> 26);
+                h0    = (u32)d0 & 0x3ffffff;
+                d1 += c;
+                c  = (u32)(d1 >> 26);
+                h1 = (u32)d1 & 0x3ffffff;
+                d2 += c;
+                c  = (u32)(d2 >> 26);
+                h2 = (u32)d2 & 0x3ffffff;
+                d3 += c;
+                c  = (u32)(d3 >> 26);
+                h3 = (u32)d3 & 0x3ffffff;
+                d4 += c;
+                c  = (u32)(d4 >> 26);
+                h4 = (u32)d4 & 0x3ffffff;
+                h0 += c * 5;
+                c  = h0 >> 26;
+                h0 = h0 & 0x3ffffff;
+                h1 += c;
+
+                data += 16;
+                size -= 16;
+            }
+
+            m_h[0] = h0;
+            m_h[1] = h1;
+            m_h[2] = h2;
+            m_h[3] = h3;
+            m_h[4] = h4;
+        }
+
+        void poly1305_t::update(byte const* data, u32 size)
+        {
+            if (m_leftover > 0)
+            {
+                u32 const n = (size < 16 - m_leftover) ? size : (16 - m_leftover);
+                g_memcpy(m_buffer + m_leftover, data, n);
+                m_leftover += n;
+                data += n;
+                size -= n;
+                if (m_leftover < 16)
+                    return;
+                blocks(m_buffer, 16, 1 << 24);
+                m_leftover = 0;
+            }
+
+            u32 const full = size & ~15u;
+            if (full > 0)
+            {
+                blocks(data, full, 1 << 24);
+                data += full;
+                size -= full;
+            }
+
+            if (size > 0)
+            {
+                g_memcpy(m_buffer, data, size);
+                m_leftover = size;
+            }
+        }
+
+        void poly1305_t::final(byte* tag)
+        {
+            if (m_leftover > 0)
+            {
+                // The last block is padded with a 1 followed by zeros instead of the high bit
+                m_buffer[m_leftover] = 1;
+                for (u32 i = m_leftover + 1; i < 16; ++i)
+                    m_buffer[i] = 0;
+                blocks(m_buffer, 16, 0);
+            }
+
+            u32 h0 = m_h[0], h1 = m_h[1], h2 = m_h[2], h3 = m_h[3], h4 = m_h[4];
+            u32 c;
+            c  = h1 >> 26;
+            h1 = h1 & 0x3ffffff;
+            h2 += c;
+            c  = h2 >> 26;
+            h2 = h2 & 0x3ffffff;
+            h3 += c;
+            c  = h3 >> 26;
+            h3 = h3 & 0x3ffffff;
+            h4 += c;
+            c  = h4 >> 26;
+            h4 = h4 & 0x3ffffff;
+            h0 += c * 5;
+            c  = h0 >> 26;
+            h0 = h0 & 0x3ffffff;
+            h1 += c;
+
+            // h - p, selected in constant time when h >= p
+            u32 g0 = h0 + 5;
+            c      = g0 >> 26;
+            g0 &= 0x3ffffff;
+            u32 g1 = h1 + c;
+            c      = g1 >> 26;
+            g1 &= 0x3ffffff;
+            u32 g2 = h2 + c;
+            c      = g2 >> 26;
+            g2 &= 0x3ffffff;
+            u32 g3 = h3 + c;
+            c      = g3 >> 26;
+            g3 &= 0x3ffffff;
+            u32 g4 = h4 + c - (1 << 26);
+
+            u32 mask = (g4 >> 31) - 1;
+            g0 &= mask;
+            g1 &= mask;
+            g2 &= mask;
+            g3 &= mask;
+            g4 &= mask;
+            mask = ~mask;
+            h0   = (h0 & mask) | g0;
+            h1   = (h1 & mask) | g1;
+            h2   = (h2 & mask) | g2;
+            h3   = (h3 & mask) | g3;
+            h4   = (h4 & mask) | g4;
+
+            h0 = h0 | (h1 << 26);
+            h1 = (h1 >> 6) | (h2 << 20);
+            h2 = (h2 >> 12) | (h3 << 14);
+            h3 = (h3 >> 18) | (h4 << 8);
+
+            u64 f = (u64)h0 + m_pad[0];
+            s_store32(tag + 0, (u32)f);
+            f = (u64)h1 + m_pad[1] + (f >> 32);
+            s_store32(tag + 4, (u32)f);
+            f = (u64)h2 + m_pad[2] + (f >> 32);
+            s_store32(tag + 8, (u32)f);
+            f = (u64)h3 + m_pad[3] + (f >> 32);
+            s_store32(tag + 12, (u32)f);
+        }
+
+        // ------------------------------------------------------------------------------------
+        // AEAD
+
+        static void s_aead_tag(byte const* key, byte const* nonce, byte const* aad, u32 aad_size, byte const* data, u32 size, byte* tag)
+        {
+            // The Poly1305 key is the first half of block 0 of the key stream
+            byte otk[64];
+            g_memset(otk, 0, sizeof(otk));
+            chacha20(key, nonce, 0, otk, sizeof(otk));
+
+            static byte const zeros[16] = {0};
+            poly1305_t        mac;
+            mac.init(otk);
+            mac.update(aad, aad_size);
+            mac.update(zeros, (16 - (aad_size & 15)) & 15);
+            mac.update(data, size);
+            mac.update(zeros, (16 - (size & 15)) & 15);
+
+            byte sizes[16];
+            s_store64(sizes, aad_size);
+            s_store64(sizes + 8, size);
+            mac.update(sizes, sizeof(sizes));
+            mac.final(tag);
+            g_memset(otk, 0, sizeof(otk));
+        }
+
+        void seal(byte const* key, byte const* nonce, byte const* aad, u32 aad_size, byte* data, u32 size, byte* tag)
+        {
+            chacha20(key, nonce, 1, data, size);
+            s_aead_tag(key, nonce, aad, aad_size, data, size, tag);
+        }
+
+        bool open(byte const* key, byte const* nonce, byte const* aad, u32 aad_size, byte* data, u32 size, byte const* tag)
+        {
+            byte expected[TAG_SIZE];
+            s_aead_tag(key, nonce, aad, aad_size, data, size, expected);
+
+            // Constant time compare
+            u32 diff = 0;
+            for (u32 i = 0; i < TAG_SIZE; ++i)
+                diff |= (u32)(expected[i] ^ tag[i]);
+            if (diff != 0)
+                return false;
+
+            chacha20(key, nonce, 1, data, size);
+            return true;
+        }
+
+        // ------------------------------------------------------------------------------------
+        // X25519, field elements are 16 limbs of 16 bits in signed 64 bit integers
+
+        typedef s64 fe_t[16];
+
+        static void s_fe_carry(fe_t o)
+        {
+            for (u32 i = 0; i < 16; ++i)
+            {
+                o[i] += (s64)1 << 16;
+                s64 const c = o[i] >> 16;
+                if (i < 15)
+                    o[i + 1] += c - 1;
+                else
+                    o[0] += 38 * (c - 1);
+                o[i] -= c * ((s64)1 << 16);
+            }
+        }
+
+        // Swaps @p and @q when @b is 1, in constant time
+        static void s_fe_swap(fe_t p, fe_t q, s64 b)
+        {
+            s64 const c = ~(b - 1);
+            for (u32 i = 0; i < 16; ++i)
+            {
+                s64 const t = c & (p[i] ^ q[i]);
+                p[i] ^= t;
+                q[i] ^= t;
+            }
+        }
+
+        static void s_fe_pack(byte* o, fe_t const n)
+        {
+            fe_t t;
+            fe_t m;
+            for (u32 i = 0; i < 16; ++i)
+                t[i] = n[i];
+            s_fe_carry(t);
+            s_fe_carry(t);
+            s_fe_carry(t);
+            for (u32 j = 0; j < 2; ++j)
+            {
+                m[0] = t[0] - 0xffed;
+                for (u32 i = 1; i < 15; ++i)
+                {
+                    m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+                    m[i - 1] &= 0xffff;
+                }
+                m[15]       = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+                s64 const b = (m[15] >> 16) & 1;
+                m[14] &= 0xffff;
+                s_fe_swap(t, m, 1 - b);
+            }
+            for (u32 i = 0; i < 16; ++i)
+            {
+                o[2 * i]     = (byte)(t[i] & 0xff);
+                o[2 * i + 1] = (byte)(t[i] >> 8);
+            }
+        }
+
+        static void s_fe_unpack(fe_t o, byte const* n)
+        {
+            for (u32 i = 0; i < 16; ++i)
+                o[i] = n[2 * i] + ((s64)n[2 * i + 1] << 8);
+            o[15] &= 0x7fff;
+        }
+
+        static void s_fe_add(fe_t o, fe_t const a, fe_t const b)
+        {
+            for (u32 i = 0; i < 16; ++i)
+                o[i] = a[i] + b[i];
+        }
+
+        static void s_fe_sub(fe_t o, fe_t const a, fe_t const b)
+        {
+            for (u32 i = 0; i < 16; ++i)
+                o[i] = a[i] - b[i];
+        }
+
+        static void s_fe_mul(fe_t o, fe_t const a, fe_t const b)
+        {
+            s64 t[31];
+            for (u32 i = 0; i < 31; ++i)
+                t[i] = 0;
+            for (u32 i = 0; i < 16; ++i)
+                for (u32 j = 0; j < 16; ++j)
+                    t[i + j] += a[i] * b[j];
+            for (u32 i = 0; i < 15; ++i)
+                t[i] += 38 * t[i + 16];
+            for (u32 i = 0; i < 16; ++i)
+                o[i] = t[i];
+            s_fe_carry(o);
+            s_fe_carry(o);
+        }
+
+        static void s_fe_invert(fe_t o, fe_t const i)
+        {
+            fe_t c;
+            for (u32 a = 0; a < 16; ++a)
+                c[a] = i[a];
+            for (s32 a = 253; a >= 0; --a)
+            {
+                s_fe_mul(c, c, c);
+                if (a != 2 && a != 4)
+                    s_fe_mul(c, c, i);
+            }
+            for (u32 a = 0; a < 16; ++a)
+                o[a] = c[a];
+        }
+
+        static void s_scalarmult(byte* q, byte const* n, byte const* p)
+        {
+            static fe_t const c121665 = {0xDB41, 1};
+
+            byte z[32];
+            for (u32 i = 0; i < 32; ++i)
+                z[i] = n[i];
+            z[31] = (z[31] & 127) | 64;
+            z[0] &= 248;
+
+            fe_t x, a, b, c, d, e, f;
+            s_fe_unpack(x, p);
+            for (u32 i = 0; i < 16; ++i)
+            {
+                b[i] = x[i];
+                a[i] = c[i] = d[i] = 0;
+            }
+            a[0] = d[0] = 1;
+
+            // Montgomery ladder
+            for (s32 i = 254; i >= 0; --i)
+            {
+                s64 const r = (z[i >> 3] >> (i & 7)) & 1;
+                s_fe_swap(a, b, r);
+                s_fe_swap(c, d, r);
+                s_fe_add(e, a, c);
+                s_fe_sub(a, a, c);
+                s_fe_add(c, b, d);
+                s_fe_sub(b, b, d);
+                s_fe_mul(d, e, e);
+                s_fe_mul(f, a, a);
+                s_fe_mul(a, c, a);
+                s_fe_mul(c, b, e);
+                s_fe_add(e, a, c);
+                s_fe_sub(a, a, c);
+                s_fe_mul(b, a, a);
+                s_fe_sub(c, d, f);
+                s_fe_mul(a, c, c121665);
+                s_fe_add(a, a, d);
+                s_fe_mul(c, c, a);
+                s_fe_mul(a, d, f);
+                s_fe_mul(d, b, x);
+                s_fe_mul(b, e, e);
+                s_fe_swap(a, b, r);
+                s_fe_swap(c, d, r);
+            }
+
+            s_fe_invert(c, c);
+            s_fe_mul(a, a, c);
+            s_fe_pack(q, a);
+            g_memset(z, 0, sizeof(z));
+        }
+
+        void x25519_public(byte* public_key, byte const* secret_key)
+        {
+            static byte const base[32] = {9};
+            s_scalarmult(public_key, secret_key, base);
+        }
+
+        bool x25519(byte* shared, byte const* secret_key, byte const* point)
+        {
+            s_scalarmult(shared, secret_key, point);
+            byte zero = 0;
+            for (u32 i = 0; i < 32; ++i)
+                zero |= shared[i];
+            return zero != 0;
+        }
+
+        // ------------------------------------------------------------------------------------
+
+        bool random_bytes(byte* data, u32 size)
+        {
+#ifdef PLATFORM_PC
+            return RtlGenRandom(data, size) != FALSE;
+#else
+            int const fd = ::open("/dev/urandom", O_RDONLY);
+            if (fd < 0)
+                return false;
+            while (size > 0)
+            {
+                ssize_t const n = ::read(fd, data, size);
+                if (n <= 0)
+                    break;
+                data += n;
+                size -= (u32)n;
+            }
+            ::close(fd);
+            return size == 0;
+#endif
+        }
+    }  // namespace ncrypto
+
+}  // namespace ncore
@@ -0,0 +1,194 @@
+#include "ccore/c_target.h"
+#include "cbase/c_memory.h"
+
+#include "csocket/private/c_lz.h"
+
+namespace ncore
+{
+    namespace nlz
+    {
+        enum
+        {
+            MIN_MATCH     = 4,
+            LAST_LITERALS = 5,   // the last bytes of the input are always literals
+            MF_LIMIT      = 12,  // a match does not start in the last bytes of the input
+            MAX_OFFSET    = 0xFFFF,
+        };
+
+        static inline u32 s_read32(byte const* p) { return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24); }
+        static inline u32 s_hash(u32 v) { return (v * 2654435761u) >> (32 - HASH_LOG); }
+
+        // The part of a length that did not fit in the token
+        static inline byte* s_write_length(byte* op, u32 len)
+        {
+            while (len >= 255)
+            {
+                *op++ = 255;
+                len -= 255;
+            }
+            *op++ = (byte)len;
+            return op;
+        }
+
+        static inline bool s_read_length(byte const* src, u32 src_size, u32& ip, u32 max_len, u32& len)
+        {
+            for (;;)
+            {
+                if (ip >= src_size || len > max_len)
+                    return false;
+                u32 const b = src[ip++];
+                len += b;
+                if (b != 255)
+                    return true;
+            }
+        }
+
+        // One sequence, without a match (@match_len = 0) it is the last one
+        static bool s_emit(byte*& op, byte* end, byte const* literals, u32 num_literals, u32 offset, u32 match_len)
+        {
+            u32 const needed = 1 + (num_literals / 255 + 1) + num_literals + 2 + (match_len / 255 + 1);
+            if (needed > (u32)(end - op))
+                return false;
+
+            byte* token = op++;
+            if (num_literals >= 15)
+            {
+                *token = 15 << 4;
+                op     = s_write_length(op, num_literals - 15);
+            }
+            else
+            {
+                *token = (byte)(num_literals << 4);
+            }
+            g_memcpy(op, literals, num_literals);
+            op += num_literals;
+
+            if (match_len == 0)
+                return true;
+
+            *op++        = (byte)offset;
+            *op++        = (byte)(offset >> 8);
+            u32 const ml = match_len - MIN_MATCH;
+            if (ml >= 15)
+            {
+                *token |= 15;
+                op = s_write_length(op, ml - 15);
+            }
+            else
+            {
+                *token |= (byte)ml;
+            }
+            return true;
+        }
+
+        u32 compress(byte const* src, u32 src_size, byte* dst, u32 dst_max, u32* hash_table)
+        {
+            byte*       op     = dst;
+            byte* const end    = dst + dst_max;
+            u32         anchor = 0;
+            u32         ip     = 0;
+
+            if (src_size > MF_LIMIT)
+            {
+                u32 const match_limit = src_size - LAST_LITERALS;
+                u32 const ip_limit    = src_size - MF_LIMIT;
+                while (ip <= ip_limit)
+                {
+                    u32 const seq = s_read32(src + ip);
+                    u32 const h   = s_hash(seq);
+                    u32 const ref = hash_table[h];
+                    hash_table[h] = ip;
+
+                    // Entries can be left over from an earlier input, a match is always verified
+                    if (ref >= ip || (ip - ref) > MAX_OFFSET || s_read32(src + ref) != seq)
+                    {
+                        // Skip ahead faster the longer nothing matches
+                        ip += 1 + ((ip - anchor) >> 6);
+                        continue;
+                    }
+
+                    // Extend the match backwards into the literals and then forwards
+                    u32 start = ip;
+                    u32 mref  = ref;
+                    while (start > anchor && mref > 0 && src[start - 1] == src[mref - 1])
+                    {
+                        start -= 1;
+                        mref -= 1;
+                    }
+                    u32 len = MIN_MATCH;
+                    while (ip + len + 4 <= match_limit && s_read32(src + ip + len) == s_read32(src + ref + len))
+                        len += 4;
+                    while (ip + len < match_limit && src[ip + len] == src[ref + len])
+                        len += 1;
+                    len += ip - start;
+
+                    if (!s_emit(op, end, src + anchor, start - anchor, ip - ref, len))
+                        return 0;
+                    ip     = start + len;
+                    anchor = ip;
+
+                    // The end of a match is often followed by another one
+                    hash_table[s_hash(s_read32(src + ip - 2))] = ip - 2;
+                }
+            }
+
+            if (!s_emit(op, end, src + anchor, src_size - anchor, 0, 0))
+                return 0;
+            return (u32)(op - dst);
+        }
+
+        bool decompress(byte const* src, u32 src_size, byte* dst, u32 dst_size)
+        {
+            u32 ip = 0;
+            u32 op = 0;
+            for (;;)
+            {
+                if (ip >= src_size)
+                    return false;
+                u32 const token = src[ip++];
+
+                u32 num_literals = token >> 4;
+                if (num_literals == 15 && !s_read_length(src, src_size, ip, dst_size, num_literals))
+                    return false;
+                if (num_literals > src_size - ip || num_literals > dst_size - op)
+                    return false;
+                g_memcpy(dst + op, src + ip, num_literals);
+                ip += num_literals;
+                op += num_literals;
+
+                // The last sequence has no match
+                if (ip == src_size)
+                    return op == dst_size;
+
+                if (src_size - ip < 2)
+                    return false;
+                u32 const offset = (u32)src[ip] | ((u32)src[ip + 1] << 8);
+                ip += 2;
+                if (offset == 0 || offset > op)
+                    return false;
+
+                u32 len = token & 15;
+                if (len == 15 && !s_read_length(src, src_size, ip, dst_size, len))
+                    return false;
+                len += MIN_MATCH;
+                if (len > dst_size - op)
+                    return false;
+
+                // A match can overlap with the bytes it produces
+                byte*       d = dst + op;
+                byte const* s = d - offset;
+                if (offset >= len)
+                {
+                    g_memcpy(d, s, len);
+                }
+                else
+                {
+                    for (u32 i = 0; i < len; ++i)
+                        d[i] = s[i];
+                }
+                op += len;
+            }
+        }
+    }  // namespace nlz
+
+}  // namespace ncore
@@ -1,5 +1,6 @@
 #include "ccore/c_target.h"
 #include "cbase/c_debug.h"
+#include "cbase/c_memory.h"
 #include "csocket/c_address.h"
 #include "csocket/c_netip.h"
 #include "csocket/c_socket.h"
@@ -27,7 +28,22 @@ typedef char raw_type;  // Type used for raw data on this platform
 typedef void raw_type;  // Type used for raw data on this platform
 #endif
 
-#include <errno.h>  // For errno
+#include <errno.h>   // For errno
+#include <limits.h>  // For IOV_MAX
+
+// The frames of a write are kept on the stack
+#if defined(IOV_MAX) && IOV_MAX < 256
+#    define WRITE_MAX_IOV IOV_MAX
+#else
+#    define WRITE_MAX_IOV 256
+#endif
+#ifndef MSG_NOSIGNAL
+#    define MSG_NOSIGNAL 0
+#endif
+#if defined(TARGET_LINUX) && defined(MSG_ZEROCOPY)
+#    include <linux/errqueue.h>  // For sock_extended_err
+#    define CSOCKET_ZEROCOPY
+#endif
 
 namespace ncore
 {
@@ -40,94 +56,586 @@ namespace ncore
                          );
     }
 
-    s32 message_socket_writer::write(message_t*& msg)
+    // The next frame of @node, @offset is the part of its payload that has been send
+    void message_socket_writer::make_frame(message_node_t* node, u32 offset, message_frame_t& frame) const
     {
-        msg = NULL;
+        byte* data;
+        u32   data_size;
+        get_msg_payload(node, data, data_size);
+        u32 const payload_size = get_msg_frame_size(node) - sizeof(message_header_t);
+
+        frame.m_node   = node;
+        frame.m_offset = offset;
+        if (m_fragment_size == 0 || payload_size <= m_fragment_size)
+        {
+            frame.m_size     = payload_size + sizeof(message_header_t);
+            frame.m_hdr_size = 0;
+            frame.m_last     = 1;
+            return;
+        }
+
+        u32 const body = (payload_size - offset < m_fragment_size) ? (payload_size - offset) : m_fragment_size;
+        frame.m_last   = (offset + body == payload_size) ? 1 : 0;
+
+        // The receiver reassembles the fragments of a message per lane
+        message_header_t hdr;
+        hdr.m_msg_size  = body;
+        hdr.m_msg_flags = ((message_header_t const*)data)->m_msg_flags & ~(u32)(MSG_FLAG_LANE_MASK | MSG_FLAG_FRAGMENT_END);
+        hdr.m_msg_flags |= MSG_FLAG_FRAGMENT | (get_msg_lane(node) << MSG_FLAG_LANE_SHIFT);
+        if (frame.m_last)
+            hdr.m_msg_flags |= MSG_FLAG_FRAGMENT_END;
 
-        if (m_current_msg == NULL)
+        frame.m_hdr_size = sizeof(message_header_t);
+        if (offset == 0)
         {
-            m_current_msg = m_send_queue->peek();
-            if (m_current_msg != NULL)
+            hdr.m_msg_size += sizeof(u32);
+            g_memcpy(frame.m_hdr + sizeof(message_header_t), &payload_size, sizeof(u32));
+            frame.m_hdr_size += sizeof(u32);
+        }
+        g_memcpy(frame.m_hdr, &hdr, sizeof(message_header_t));
+        frame.m_size = frame.m_hdr_size + body;
+    }
+
+    // The ranges of the bytes [@from, @to) of @data followed by a chain of segments,
+    // at most @max_iov of them. Adds the number of bytes they cover to @size.
+    static u32 s_chain_iov(byte* data, u32 data_size, message_segment_t const* seg, u32 from, u32 to, io_vec_t* iov, u32 max_iov, u32& size)
+    {
+        u32 count = 0;
+        u32 begin = 0;
+        for (;;)
+        {
+            u32 const end = begin + data_size;
+            if (from < end)
             {
-                get_msg_payload(m_current_msg, m_data, m_bytes_to_write);
-                m_bytes_written = 0;
+                if (count == max_iov)
+                    break;
+                u32 const last    = (to < end) ? to : end;
+                iov[count].m_base = data + (from - begin);
+                iov[count].m_size = last - from;
+                size += last - from;
+                count += 1;
+                from = last;
             }
+            if (from >= to || seg == NULL)
+                break;
+            begin     = end;
+            data      = seg->m_data;
+            data_size = seg->m_size;
+            seg       = seg->m_next;
+        }
+        return count;
+    }
+
+    // The ranges of the part of @frame that has not been written yet, at most @max_iov
+    // of them. @size receives the number of bytes they cover, it is less than the rest
+    // of the frame when a message with many segments did not fit.
+    static u32 s_frame_iov(message_frame_t const& frame, u32 written, io_vec_t* iov, u32 max_iov, u32& size)
+    {
+        byte* data;
+        u32   data_size;
+        get_msg_payload(frame.m_node, data, data_size);
+        message_segment_t const* segments = ((frame.m_node->m_shared != NULL) ? frame.m_node->m_shared : frame.m_node)->m_segments;
+
+        size = 0;
+        if (frame.m_hdr_size == 0)
+            return s_chain_iov(data, data_size, segments, written, frame.m_size, iov, max_iov, size);
+
+        u32 count = 0;
+        if (written < frame.m_hdr_size)
+        {
+            iov[0].m_base = (byte*)frame.m_hdr + written;
+            iov[0].m_size = frame.m_hdr_size - written;
+            size          = frame.m_hdr_size - written;
+            written       = frame.m_hdr_size;
+            count         = 1;
         }
+        u32 const from = frame.m_offset + (written - frame.m_hdr_size);
+        u32 const to   = frame.m_offset + (frame.m_size - frame.m_hdr_size);
+        return count + s_chain_iov(data + sizeof(message_header_t), data_size - sizeof(message_header_t), segments, from, to, iov + count, max_iov - count, size);
+    }
 
-        if (m_current_msg != NULL)
+    // The remainder of the current frame followed by as many frames as fit, in the
+    // order of their lanes. @frames receives every frame and @fragments tells if
+    // any of them has its header in @frames.
+    u32 message_socket_writer::gather(io_vec_t* iov, message_frame_t* frames, u32 max_iov, u32 max_size, u32& size, u32& num_frames, bool& fragments)
+    {
+        size       = 0;
+        num_frames = 0;
+        fragments  = false;
+        if (m_frame.m_node == NULL)
         {
-            s32 n;
-            s32 bytes_written = m_bytes_written;
-            while ((n = ::send(m_socket, (const char*)(m_data + bytes_written), m_bytes_to_write - bytes_written, 0)) > 0)
+            message_node_t* node = m_send_queue->peek();
+            if (node == NULL)
+                return 0;
+            make_frame(node, m_lane_offset[get_msg_lane(node)], m_frame);
+            m_frame_written = 0;
+        }
+
+        // The frames after the current one continue where it ends
+        u32 offsets[MSG_LANES];
+        for (u32 i = 0; i < MSG_LANES; ++i)
+            offsets[i] = m_lane_offset[i];
+        if (m_frame.m_hdr_size != 0)
+            offsets[get_msg_lane(m_frame.m_node)] = m_frame.m_last ? 0 : (m_frame.m_offset + m_frame.m_size - m_frame.m_hdr_size);
+
+        frames[0]  = m_frame;
+        u32 count  = s_frame_iov(frames[0], m_frame_written, iov, max_iov, size);
+        fragments  = m_frame.m_hdr_size != 0;
+        num_frames = 1;
+
+        // Nothing can follow a frame that did not fit completely
+        bool            truncated = size < (m_frame.m_size - m_frame_written);
+        message_node_t* node      = m_send_queue->peek();
+        while (node != NULL && !truncated && count < max_iov && size < max_size)
+        {
+            // The current frame is the whole message or its last fragment
+            if (node == m_frame.m_node && m_frame.m_last)
             {
-                bytes_written += n;
-                if (bytes_written == m_bytes_to_write)
-                    break;
+                node = m_send_queue->next(node);
+                continue;
             }
-            m_bytes_written = bytes_written;
 
-            if (is_error(n))
-                return -1;
+            u32 const        lane  = get_msg_lane(node);
+            message_frame_t& frame = frames[num_frames];
+            make_frame(node, offsets[lane], frame);
+            u32 frame_size;
+            count += s_frame_iov(frame, 0, iov + count, max_iov - count, frame_size);
+            size += frame_size;
+            num_frames += 1;
+            truncated = frame_size < frame.m_size;
 
-            if (bytes_written == m_bytes_to_write)
+            // A message that is not done yet is followed by its next fragment
+            if (frame.m_hdr_size != 0)
             {
-                m_current_msg = m_send_queue->pop();
-                msg           = node_to_msg(m_current_msg);
-                return m_send_queue->empty() ? 0 : 1;
+                fragments     = true;
+                offsets[lane] = frame.m_last ? 0 : (frame.m_offset + frame.m_size - frame.m_hdr_size);
             }
-            else
+            if (frame.m_last)
+                node = m_send_queue->next(node);
+        }
+        return count;
+    }
+
+    u32 message_socket_writer::next_writev(io_vec_t const*& iov, u32 max_size)
+    {
+        u32  size;
+        bool fragments;
+        iov = m_iov;
+        return gather(m_iov, m_frames, MAX_IOV, max_size, size, m_num_frames, fragments);
+    }
+
+    u32 message_socket_writer::commit_write(u32 n) { return commit(n, 0, m_frames, m_num_frames); }
+
+    u32 message_socket_writer::commit(u32 n, u32 send_id, message_frame_t const* frames, u32 num_frames)
+    {
+        // A write can end anywhere, also in the middle of a frame. The frames were
+        // written in the order they were gathered in, which is not the order of the
+        // queue anymore when a higher lane got a message in the meantime.
+        u32 completed = 0;
+        u32 i         = 0;
+        while (n > 0 && m_frame.m_node != NULL)
+        {
+            // The payload is referenced by this zero-copy send
+            if (send_id != 0)
+                m_frame.m_node->m_send_id = send_id;
+
+            u32 const remaining = m_frame.m_size - m_frame_written;
+            if (n < remaining)
             {
-                return 1;
+                m_frame_written += n;
+                break;
+            }
+
+            n -= remaining;
+            message_node_t* node = m_frame.m_node;
+            if (m_frame.m_hdr_size != 0)
+                m_lane_offset[get_msg_lane(node)] = m_frame.m_last ? 0 : (m_frame.m_offset + m_frame.m_size - m_frame.m_hdr_size);
+            if (m_frame.m_last)
+            {
+                m_send_queue->remove(node);
+                if (node->m_send_id != 0)
+                    m_zc_queue.push(node);
+                else
+                    m_pool->free_local(node_to_msg(node));
+                completed += 1;
+            }
+            m_frame.m_node = NULL;
+
+            // At a frame boundary the next gather starts at the front of the highest lane
+            i += 1;
+            if (n > 0 && i < num_frames)
+            {
+                m_frame         = frames[i];
+                m_frame_written = 0;
             }
         }
-        else
+        return completed;
+    }
+
+    void message_socket_writer::reset()
+    {
+        // Note: the kernel might still hold on to the pages of zero-copy sends
+        // when the socket is closed with unsent data, that data is lost anyway.
+        message_node_t* node;
+        while ((node = m_zc_queue.pop()) != NULL)
+            m_pool->free_local(node_to_msg(node));
+        if (m_send_queue != NULL)
         {
-            return 0;
+            while ((node = m_send_queue->pop()) != NULL)
+                m_pool->free_local(node_to_msg(node));
         }
+        init(m_socket, m_send_queue, m_pool);
     }
 
-    s32 message_socket_reader::read(message_t*& msg, message_t*& rcvd)
+    // The headers of fragments are gathered from @frames, which does not live as long
+    // as a zero-copy send. They are copied into slots of the writer that are only
+    // reused once the send has completed. Returns false when there are not enough
+    // free slots, the send should copy instead.
+    bool message_socket_writer::keep_headers(io_vec_t* iov, u32 count, message_frame_t const* frames, u32 num_frames)
     {
-        rcvd = NULL;
+        byte const* begin = (byte const*)frames;
+        byte const* end   = (byte const*)(frames + num_frames);
+        u32         head  = m_zc_hdr_head;
+        for (u32 i = 0; i < count; ++i)
+        {
+            byte const* base = (byte const*)iov[i].m_base;
+            if (base < begin || base >= end)
+                continue;
+            if ((head - m_zc_hdr_tail) == ZEROCOPY_HDR_SLOTS)
+                return false;
+            byte* slot = m_zc_hdrs[head % ZEROCOPY_HDR_SLOTS];
+            g_memcpy(slot, base, (u32)iov[i].m_size);
+            iov[i].m_base = slot;
+            head += 1;
+        }
+        m_zc_hdr_head = head;
+        return true;
+    }
 
-        if (m_msg == NULL)
+    void message_socket_writer::complete_zerocopy(u32 lo, u32 hi)
+    {
+        // Completions are normally reported in order, ones that arrive early
+        // are remembered in a mask until the ones before them have arrived.
+        for (u32 id = lo; id != hi + 1; ++id)
         {
-            m_msg = msg;
-            m_hdr = msg_to_node(msg);
-            get_msg_payload(m_hdr, m_data, m_data_size);
-            m_bytes_read    = 0;
-            m_bytes_to_read = 4;
-            m_state         = STATE_READ_SIZE;
+            u32 const d = id - m_zc_done;
+            if (d < 64)
+                m_zc_mask |= (u64)1 << d;
+        }
+        while ((m_zc_mask & 1) != 0)
+        {
+            m_zc_mask >>= 1;
+            m_zc_done += 1;
+            m_zc_hdr_tail = m_zc_hdr_end[m_zc_done % ZEROCOPY_MAX_PENDING];
         }
 
-        s32 n;
-        s32 bytes_read = m_bytes_read;
-        while ((n = ::recv(m_socket, (char*)(m_data + bytes_read), m_bytes_to_read - bytes_read, 0)) > 0)
+        message_node_t* node;
+        while ((node = m_zc_queue.peek()) != NULL && (s32)(node->m_send_id - m_zc_done) <= 0)
         {
-            bytes_read += n;
-            if (bytes_read == m_bytes_to_read)
-                break;
+            m_zc_queue.pop();
+            m_pool->free_local(node_to_msg(node));
         }
+    }
 
-        if (is_error(n))
-            return -1;
+    s32 message_socket_writer::reap_zerocopy()
+    {
+#ifdef CSOCKET_ZEROCOPY
+        s32 result = 0;
+        for (;;)
+        {
+            char          control[128];
+            struct msghdr msg;
+            g_memset(&msg, 0, sizeof(msg));
+            msg.msg_control    = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(m_socket, &msg, MSG_ERRQUEUE) == -1)
+                return (errno == EAGAIN || errno == EWOULDBLOCK) ? result : -1;
+
+            for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                    continue;
+
+                struct sock_extended_err const* err = (struct sock_extended_err const*)CMSG_DATA(cm);
+                if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                    return -1;
+
+                // The kernel had to copy the data anyway (e.g. loopback), zero-copy only has overhead
+                if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0)
+                    m_zc_threshold = 0;
+
+                complete_zerocopy(err->ee_info, err->ee_data);
+                result = 1;
+            }
+        }
+#else
+        return 0;
+#endif
+    }
+
+    s32 message_socket_writer::write(s32& deficit)
+    {
+        io_vec_t        iov[WRITE_MAX_IOV];
+        message_frame_t frames[WRITE_MAX_IOV];
+        while (deficit > 0)
+        {
+            u32       size;
+            u32       num_frames;
+            bool      fragments;
+            u32 const count = gather(iov, frames, WRITE_MAX_IOV, (u32)deficit, size, num_frames, fragments);
+            if (count == 0)
+                return 1;
+
+#ifdef PLATFORM_PC
+            WSABUF buffers[WRITE_MAX_IOV];
+            for (u32 i = 0; i < count; ++i)
+            {
+                buffers[i].buf = (CHAR*)iov[i].m_base;
+                buffers[i].len = (ULONG)iov[i].m_size;
+            }
+            DWORD     sent    = 0;
+            s32       n       = (::WSASend(m_socket, buffers, count, &sent, 0, NULL, NULL) == 0) ? (s32)sent : -1;
+            u32 const send_id = 0;
+#else
+            struct msghdr msg;
+            g_memset(&msg, 0, sizeof(msg));
+            msg.msg_iov    = (struct iovec*)iov;
+            msg.msg_iovlen = count;
+
+            s32 n        = -1;
+            u32 send_id  = 0;
+#    ifdef CSOCKET_ZEROCOPY
+            u32 const hdr_head = m_zc_hdr_head;
+            if (m_zc_threshold > 0 && size >= m_zc_threshold && (m_zc_seq - m_zc_done) < ZEROCOPY_MAX_PENDING && (!fragments || keep_headers(iov, count, frames, num_frames)))
+            {
+                n = (s32)::sendmsg(m_socket, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+                if (n > 0)
+                {
+                    send_id                                      = ++m_zc_seq;  // the kernel numbers the zero-copy sends from 0
+                    m_zc_hdr_end[send_id % ZEROCOPY_MAX_PENDING] = m_zc_hdr_head;
+                }
+                else
+                {
+                    m_zc_hdr_head = hdr_head;
+                    if (errno != ENOBUFS)
+                        return is_error(n) ? -1 : 0;
+                }
+            }
+#    endif
+            // ENOBUFS means the socket is out of memory for zero-copy, copy instead
+            if (send_id == 0)
+                n = (s32)::sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+#endif
+            if (n <= 0)
+                return is_error(n) ? -1 : 0;
+
+            commit((u32)n, send_id, frames, num_frames);
+            deficit -= n;
+
+            // A short write means that the socket buffer is full
+            if ((u32)n < size)
+                return 0;
+        }
+        return m_send_queue->empty() ? 1 : 2;
+    }
 
-        m_bytes_read = bytes_read;
+    void message_socket_reader::reset()
+    {
+        // A fragment that is received directly is received into a partial message
+        if (m_msg != NULL && m_msg_lane == MSG_LANES)
+            m_pool->free_local(m_msg);
+        for (u32 i = 0; i < MSG_LANES; ++i)
+        {
+            if (m_partial[i] != NULL)
+                m_pool->free_local(m_partial[i]);
+        }
+        init(m_socket, m_pool, m_buffer);
+    }
 
-        if (m_state == STATE_READ_SIZE && m_bytes_read == m_bytes_to_read)
+    void message_socket_reader::next_read(byte*& data, u32& size)
+    {
+        if (m_msg != NULL)
         {
-            m_state         = STATE_READ_BODY;
-            m_bytes_to_read = ((u32 const*)m_data)[0];
-            m_bytes_read    = 0;
+            data = m_msg->m_data + m_bytes_read;
+            size = m_bytes_to_read - m_bytes_read;
+            return;
         }
 
-        if (m_bytes_read == m_bytes_to_read)
+        // Move the partial frame that is left to the start of the buffer, it is
+        // always smaller than a large frame so there is room for the rest.
+        if (m_begin > 0)
         {
-            rcvd = msg;
-            msg  = NULL;
+            g_memmove(m_buffer, m_buffer + m_begin, m_end - m_begin);
+            m_end -= m_begin;
+            m_begin = 0;
         }
+        data = m_buffer + m_end;
+        size = RECV_BUFFER_SIZE - m_end;
+    }
+
+    void message_socket_reader::commit_read(u32 n)
+    {
+        if (m_msg != NULL)
+            m_bytes_read += n;
+        else
+            m_end += n;
+    }
+
+    s32 message_socket_reader::parse(message_t*& rcvd)
+    {
+        // Fragments that do not complete a message are consumed without returning
+        for (;;)
+        {
+            u32 const available = m_end - m_begin;
+            if (available < sizeof(message_header_t))
+                return 0;
+
+            message_header_t hdr;
+            g_memcpy(&hdr, m_buffer + m_begin, sizeof(message_header_t));
+            if (hdr.m_msg_size > m_pool->max_size())
+                return -1;
+
+            u32 const frame_size = sizeof(message_header_t) + hdr.m_msg_size;
+            if (available < frame_size && hdr.m_msg_size < LARGE_FRAME_SIZE)
+                return 0;
+
+            message_t* msg;
+            u32        offset = 0;  // where the body goes in the message
+            u32        body   = m_begin + sizeof(message_header_t);
+            u32        size   = hdr.m_msg_size;
+            u32        lane   = MSG_LANES;
+            if ((hdr.m_msg_flags & MSG_FLAG_FRAGMENT) != 0)
+            {
+                lane = (hdr.m_msg_flags & MSG_FLAG_LANE_MASK) >> MSG_FLAG_LANE_SHIFT;
+                if (lane >= MSG_LANES)
+                    return -1;
 
-        return n == 0 ? 0 : 1;
+                // The first fragment starts with the size of the whole message, which
+                // is allocated once and the fragments are copied into their place.
+                if (m_partial[lane] == NULL)
+                {
+                    if (size < sizeof(u32))
+                        return -1;
+                    if (available < sizeof(message_header_t) + sizeof(u32))
+                        return 0;
+
+                    u32 total;
+                    g_memcpy(&total, m_buffer + body, sizeof(u32));
+                    if (total > m_pool->max_size())
+                        return -1;
+
+                    msg = m_pool->alloc_local(total);
+                    if (msg == NULL)
+                        return -1;
+                    msg_to_header(msg)->m_msg_flags = hdr.m_msg_flags & ~(u32)(MSG_FLAG_FRAGMENT | MSG_FLAG_FRAGMENT_END);
+                    msg->m_size                     = total;
+                    m_partial[lane]                 = msg;
+                    m_partial_size[lane]            = 0;
+                    body += sizeof(u32);
+                    size -= sizeof(u32);
+                }
+
+                msg    = m_partial[lane];
+                offset = m_partial_size[lane];
+                if (size > msg->m_size - offset)
+                    return -1;
+            }
+            else
+            {
+                msg = m_pool->alloc_local(size);
+                if (msg == NULL)
+                    return -1;
+                msg_to_header(msg)->m_msg_flags = hdr.m_msg_flags;
+                msg->m_size                     = size;
+            }
+
+            if (available < frame_size)
+            {
+                // A large frame, take what we have and receive the rest directly into the message
+                u32 const part = m_end - body;
+                g_memcpy(msg->m_data + offset, m_buffer + body, part);
+                m_begin         = 0;
+                m_end           = 0;
+                m_msg           = msg;
+                m_msg_lane      = lane;
+                m_msg_end       = (hdr.m_msg_flags & MSG_FLAG_FRAGMENT_END) != 0;
+                m_bytes_read    = offset + part;
+                m_bytes_to_read = offset + size;
+                return 0;
+            }
+
+            g_memcpy(msg->m_data + offset, m_buffer + body, size);
+            m_begin += frame_size;
+            if (lane == MSG_LANES)
+            {
+                rcvd = msg;
+                return 1;
+            }
+
+            m_partial_size[lane] = offset + size;
+            if ((hdr.m_msg_flags & MSG_FLAG_FRAGMENT_END) != 0)
+                return complete(lane, rcvd);
+        }
+    }
+
+    s32 message_socket_reader::complete(u32 lane, message_t*& rcvd)
+    {
+        // The fragments should add up to the size given by the first one
+        message_t* msg = m_partial[lane];
+        if (m_partial_size[lane] != msg->m_size)
+            return -1;
+        m_partial[lane] = NULL;
+        rcvd            = msg;
+        return 1;
+    }
+
+    s32 message_socket_reader::next_msg(message_t*& rcvd)
+    {
+        rcvd = NULL;
+        if (m_msg != NULL)
+        {
+            if (m_bytes_read < m_bytes_to_read)
+                return 0;
+
+            message_t* msg = m_msg;
+            m_msg          = NULL;
+            if (m_msg_lane == MSG_LANES)
+            {
+                rcvd = msg;
+                return 1;
+            }
+
+            u32 const lane       = m_msg_lane;
+            m_msg_lane           = MSG_LANES;
+            m_partial_size[lane] = m_bytes_to_read;
+            if (m_msg_end)
+                return complete(lane, rcvd);
+        }
+        return parse(rcvd);
+    }
+
+    s32 message_socket_reader::read(message_t*& rcvd, s32& deficit)
+    {
+        for (;;)
+        {
+            // Messages that are already in the buffer do not need a system call
+            s32 const status = next_msg(rcvd);
+            if (status != 0)
+                return status;
+            if (deficit <= 0)
+                return 2;
+
+            byte* data;
+            u32   size;
+            next_read(data, size);
+            if (size > (u32)deficit)
+                size = (u32)deficit;
+            s32 const n = (s32)::recv(m_socket, (char*)data, size, 0);
+            if (n <= 0)
+                return is_error(n) ? -1 : 0;
+            commit_read((u32)n);
+            deficit -= n;
+        }
     }
 
 }  // namespace ncore
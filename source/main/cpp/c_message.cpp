@@ -1,9 +1,627 @@
 #include "ccore/c_target.h"
+#include "cbase/c_allocator.h"
 #include "cbase/c_debug.h"
+#include "cbase/c_memory.h"
 #include "csocket/c_message.h"
 #include "csocket/private/c_message.h"
 
 namespace ncore
 {
+    binary_reader_t message_t::get_reader() const { return cbuffer_t(m_data, m_data + m_size).reader(); }
+    binary_writer_t message_t::get_writer() const { return buffer_t(m_data, m_data + m_max).writer(); }
 
-}
+    static const u32 s_block_overhead = sizeof(message_node_t) + sizeof(message_t) + sizeof(message_header_t);
+    static const u32 s_slab_overhead  = 16;
+
+    static message_t *s_reset_msg(message_node_t *node, u32 capacity)
+    {
+        node->m_remote  = NULL;
+        node->m_next    = node;
+        node->m_prev    = node;
+        node->m_send_id = 0;
+        node->m_refs    = 0;
+        node->m_shared  = NULL;
+
+        node->m_segments      = NULL;
+        node->m_segments_size = 0;
+
+        message_t        *msg = node_to_msg(node);
+        message_header_t *hdr = msg_to_header(msg);
+        hdr->m_msg_size       = 0;
+        hdr->m_msg_flags      = 0;
+        msg->m_max            = capacity;
+        msg->m_size           = 0;
+        msg->m_data           = (byte *)hdr + sizeof(message_header_t);
+        return msg;
+    }
+
+    // The free messages a thread keeps for the pool it used last, alloc() and release()
+    // only take the lock of the pool to move a batch in or out of it. Messages of a
+    // pool the thread is not bound to go straight to their free list.
+    struct message_magazine_t
+    {
+        message_magazine_t()
+            : m_pool(nullptr)
+            , m_next(nullptr)
+        {
+            g_memset(m_nodes, 0, sizeof(m_nodes));
+            g_memset(m_count, 0, sizeof(m_count));
+        }
+
+        // A thread that exits gives its messages back
+        ~message_magazine_t()
+        {
+            if (m_pool != nullptr)
+                m_pool->unbind_magazine(this);
+        }
+
+        message_pool_t     *m_pool;
+        message_magazine_t *m_next;  // next magazine that is bound to m_pool
+        message_node_t     *m_nodes[message_pool_t::MAX_CLASSES];
+        u32                 m_count[message_pool_t::MAX_CLASSES];
+    };
+
+    static thread_local message_magazine_t s_magazine;
+
+    message_pool_t::message_pool_t()
+        : m_allocator(nullptr)
+        , m_lock(0)
+        , m_max_size(0)
+        , m_num_classes(0)
+        , m_slabs(nullptr)
+        , m_magazines(nullptr)
+    {
+        g_memset(m_classes, 0, sizeof(m_classes));
+    }
+
+    bool message_pool_t::init(alloc_t *allocator, u32 max_size)
+    {
+        m_allocator   = allocator;
+        m_lock        = 0;
+        m_max_size    = max_size;
+        m_num_classes = 0;
+        m_slabs       = nullptr;
+        m_magazines   = nullptr;
+
+        // Only the size classes up to the maximum message size are used
+        while (m_num_classes < MAX_CLASSES)
+        {
+            size_class_t &sc = m_classes[m_num_classes++];
+            sc.m_capacity    = (u32)1 << (MIN_SIZE_SHIFT + m_num_classes - 1);
+            sc.m_block_size  = (s_block_overhead + sc.m_capacity + 15) & ~15;
+            sc.m_cache       = nullptr;
+            sc.m_cache_count = 0;
+            sc.m_free        = nullptr;
+            sc.m_free_count  = 0;
+            if (sc.m_capacity >= max_size)
+                break;
+        }
+
+        if (m_max_size > m_classes[m_num_classes - 1].m_capacity)
+            m_max_size = m_classes[m_num_classes - 1].m_capacity;
+        return true;
+    }
+
+    void message_pool_t::exit()
+    {
+        // The messages in the magazines of the threads are in the slabs, the threads
+        // must no longer use this pool.
+        natomic::lock(&m_lock);
+        while (m_magazines != nullptr)
+        {
+            message_magazine_t *mag = m_magazines;
+            m_magazines             = mag->m_next;
+            g_memset(mag->m_nodes, 0, sizeof(mag->m_nodes));
+            g_memset(mag->m_count, 0, sizeof(mag->m_count));
+            mag->m_next = nullptr;
+            mag->m_pool = nullptr;
+        }
+        natomic::unlock(&m_lock);
+
+        while (m_slabs != nullptr)
+        {
+            slab_t *slab = m_slabs;
+            m_slabs      = slab->m_next;
+            m_allocator->deallocate(slab);
+        }
+        g_memset(m_classes, 0, sizeof(m_classes));
+        m_num_classes = 0;
+    }
+
+    u32 message_pool_t::size_to_class(u32 size) const
+    {
+        if (size > m_max_size)
+            return m_num_classes;
+        u32 cls = 0;
+        while (m_classes[cls].m_capacity < size)
+            cls += 1;
+        return cls;
+    }
+
+    // Called with the lock held, this is the only place that uses the general allocator
+    void message_pool_t::grow(u32 cls)
+    {
+        size_class_t &sc    = m_classes[cls];
+        u32           count = (SLAB_SIZE - s_slab_overhead) / sc.m_block_size;
+        if (count == 0)
+            count = 1;
+
+        slab_t *slab = (slab_t *)m_allocator->allocate(s_slab_overhead + count * sc.m_block_size, 16);
+        if (slab == nullptr)
+            return;
+        slab->m_next = m_slabs;
+        m_slabs      = slab;
+
+        byte *block = (byte *)slab + s_slab_overhead;
+        for (u32 i = 0; i < count; ++i)
+        {
+            message_node_t *node = new (block) message_node_t();
+            new (node_to_msg(node)) message_t();
+            node->m_pool  = this;
+            node->m_class = cls;
+            node->m_next  = sc.m_free;
+            sc.m_free     = node;
+            block += sc.m_block_size;
+        }
+        sc.m_free_count += count;
+    }
+
+    // Binds the magazine of the calling thread to this pool, the messages that it holds of
+    // the pool it was bound to go back to that pool first.
+    message_magazine_t *message_pool_t::bind_magazine()
+    {
+        message_magazine_t *mag = &s_magazine;
+        if (mag->m_pool != this)
+        {
+            if (mag->m_pool != nullptr)
+                mag->m_pool->unbind_magazine(mag);
+
+            natomic::lock(&m_lock);
+            mag->m_next = m_magazines;
+            m_magazines = mag;
+            mag->m_pool = this;
+            natomic::unlock(&m_lock);
+        }
+        return mag;
+    }
+
+    void message_pool_t::unbind_magazine(message_magazine_t *mag)
+    {
+        natomic::lock(&m_lock);
+        for (u32 cls = 0; cls < m_num_classes; ++cls)
+        {
+            size_class_t &sc = m_classes[cls];
+            while (mag->m_nodes[cls] != nullptr)
+            {
+                message_node_t *node = mag->m_nodes[cls];
+                mag->m_nodes[cls]    = node->m_next;
+                node->m_next         = sc.m_free;
+                sc.m_free            = node;
+            }
+            sc.m_free_count += mag->m_count[cls];
+            mag->m_count[cls] = 0;
+        }
+
+        message_magazine_t **link = &m_magazines;
+        while (*link != nullptr && *link != mag)
+            link = &(*link)->m_next;
+        if (*link != nullptr)
+            *link = mag->m_next;
+        mag->m_next = nullptr;
+        mag->m_pool = nullptr;
+        natomic::unlock(&m_lock);
+    }
+
+    // Returns false when @node does not go into the magazine of the calling thread, a
+    // magazine that is not bound yet is bound to the pool of @node.
+    bool message_pool_t::put_magazine(message_node_t *node)
+    {
+        u32 const cls = node->m_class;
+        if (!in_magazine(cls))
+            return false;
+
+        message_magazine_t *mag = &s_magazine;
+        if (mag->m_pool != this)
+        {
+            if (mag->m_pool != nullptr)
+                return false;
+            bind_magazine();
+        }
+
+        node->m_next      = mag->m_nodes[cls];
+        mag->m_nodes[cls] = node;
+        mag->m_count[cls] += 1;
+
+        if (mag->m_count[cls] > MAGAZINE_MAX)
+        {
+            // Hand a batch back to the shared free list
+            message_node_t *head = mag->m_nodes[cls];
+            message_node_t *tail = head;
+            for (u32 i = 1; i < MAGAZINE_BATCH; ++i)
+                tail = tail->m_next;
+            mag->m_nodes[cls] = tail->m_next;
+            mag->m_count[cls] -= MAGAZINE_BATCH;
+            push_free(cls, head, tail, MAGAZINE_BATCH);
+        }
+        return true;
+    }
+
+    void message_pool_t::push_free(u32 cls, message_node_t *head, message_node_t *tail, u32 count)
+    {
+        size_class_t &sc = m_classes[cls];
+        natomic::lock(&m_lock);
+        tail->m_next = sc.m_free;
+        sc.m_free    = head;
+        sc.m_free_count += count;
+        natomic::unlock(&m_lock);
+    }
+
+    message_t *message_pool_t::alloc(u32 size)
+    {
+        u32 const cls = size_to_class(size);
+        if (cls == m_num_classes)
+            return NULL;
+
+        size_class_t &sc = m_classes[cls];
+        if (in_magazine(cls))
+        {
+            message_magazine_t *mag = bind_magazine();
+            if (mag->m_nodes[cls] == nullptr)
+            {
+                // Refill the magazine with a batch from the shared free list
+                natomic::lock(&m_lock);
+                if (sc.m_free == nullptr)
+                    grow(cls);
+                u32 n = 0;
+                while (sc.m_free != nullptr && n < MAGAZINE_BATCH)
+                {
+                    message_node_t *node = sc.m_free;
+                    sc.m_free            = node->m_next;
+                    node->m_next         = mag->m_nodes[cls];
+                    mag->m_nodes[cls]    = node;
+                    n += 1;
+                }
+                sc.m_free_count -= n;
+                natomic::unlock(&m_lock);
+                mag->m_count[cls] = n;
+            }
+
+            message_node_t *node = mag->m_nodes[cls];
+            if (node == nullptr)
+                return NULL;
+            mag->m_nodes[cls] = node->m_next;
+            mag->m_count[cls] -= 1;
+            return s_reset_msg(node, sc.m_capacity);
+        }
+
+        natomic::lock(&m_lock);
+        if (sc.m_free == nullptr)
+            grow(cls);
+        message_node_t *node = sc.m_free;
+        if (node != nullptr)
+        {
+            sc.m_free = node->m_next;
+            sc.m_free_count -= 1;
+        }
+        natomic::unlock(&m_lock);
+
+        return (node != nullptr) ? s_reset_msg(node, sc.m_capacity) : NULL;
+    }
+
+    message_t *message_pool_t::shrink(message_t *msg)
+    {
+        // Only move the message when it is at least 4 times smaller than its
+        // size class, the copy is then small compared to the memory it frees.
+        message_node_t *node = msg_to_node(msg);
+        u32 const       cls  = size_to_class(msg->m_size);
+        if (cls + 2 > node->m_class)
+            return msg;
+
+        message_t *small = alloc(msg->m_size);
+        if (small == NULL)
+            return msg;
+
+        g_memcpy(small->m_data, msg->m_data, msg->m_size);
+        small->m_size                     = msg->m_size;
+        msg_to_header(small)->m_msg_flags = msg_to_header(msg)->m_msg_flags;
+
+        // The segments move along with the payload
+        message_node_t *small_node  = msg_to_node(small);
+        small_node->m_segments      = node->m_segments;
+        small_node->m_segments_size = node->m_segments_size;
+        node->m_segments            = NULL;
+        node->m_segments_size       = 0;
+        release(msg);
+        return small;
+    }
+
+    // Drops a reference, returns true when the message is not in use anymore
+    static bool s_unref(message_node_t *node)
+    {
+        if (node->m_refs == 0)
+            return true;
+        return natomic::fetch_add(&node->m_refs, (u32)-1) == 1;
+    }
+
+    void message_pool_t::share(message_t *msg, u32 refs)
+    {
+        message_node_t *node = msg_to_node(msg);
+        msg_to_header(msg)->m_msg_size = msg->m_size + node->m_segments_size;
+        natomic::store_release(&node->m_refs, refs);
+    }
+
+    message_segment_t *message_pool_t::alloc_segment(u32 size)
+    {
+        // A segment can never be larger than the largest message
+        u32 capacity = sizeof(message_segment_t) + size;
+        if (capacity > m_max_size)
+            capacity = m_max_size;
+
+        message_t *msg = alloc(capacity);
+        if (msg == NULL)
+            return NULL;
+
+        message_segment_t *seg = (message_segment_t *)msg->m_data;
+        seg->m_next            = NULL;
+        seg->m_data            = msg->m_data + sizeof(message_segment_t);
+        seg->m_size            = 0;
+        seg->m_max             = msg->m_max - sizeof(message_segment_t);
+        seg->m_release         = NULL;
+        seg->m_user            = NULL;
+        return seg;
+    }
+
+    static message_segment_t *s_last_segment(message_node_t *node)
+    {
+        message_segment_t *seg = node->m_segments;
+        while (seg != NULL && seg->m_next != NULL)
+            seg = seg->m_next;
+        return seg;
+    }
+
+    bool message_pool_t::append(message_t *msg, byte const *data, u32 size)
+    {
+        message_node_t *node = msg_to_node(msg);
+        u32 const       used = msg->m_size + node->m_segments_size;
+        if (used > m_max_size || size > m_max_size - used)
+            return false;
+
+        // The message itself is filled up first, as long as nothing follows it, then the
+        // room that is left in the last segment.
+        message_segment_t *last = s_last_segment(node);
+        u32                room = (node->m_segments == NULL) ? (msg->m_max - msg->m_size) : 0;
+        if (last != NULL && last->m_size < last->m_max)
+            room += last->m_max - last->m_size;
+
+        // The segments for the rest are allocated before anything is copied, so that
+        // the message is left as it was when the pool runs out.
+        message_segment_t *added = NULL;
+        message_segment_t *tail  = NULL;
+        while (room < size)
+        {
+            u32 const          need = size - room;
+            message_segment_t *seg  = alloc_segment(need > (u32)SEGMENT_SIZE ? need : (u32)SEGMENT_SIZE);
+            if (seg == NULL)
+            {
+                while (added != NULL)
+                {
+                    message_segment_t *next = added->m_next;
+                    release(segment_to_msg(added));
+                    added = next;
+                }
+                return false;
+            }
+            if (tail == NULL)
+                added = seg;
+            else
+                tail->m_next = seg;
+            tail = seg;
+            room += seg->m_max;
+        }
+
+        if (node->m_segments == NULL)
+        {
+            u32 const n = (size < msg->m_max - msg->m_size) ? size : (msg->m_max - msg->m_size);
+            g_memcpy(msg->m_data + msg->m_size, data, n);
+            msg->m_size += n;
+            data += n;
+            size -= n;
+        }
+
+        if (added != NULL)
+        {
+            if (last == NULL)
+                node->m_segments = added;
+            else
+                last->m_next = added;
+        }
+        while (size > 0)
+        {
+            if (last == NULL || last->m_size >= last->m_max)
+                last = (last == NULL) ? node->m_segments : last->m_next;
+
+            u32 const n = (size < last->m_max - last->m_size) ? size : (last->m_max - last->m_size);
+            g_memcpy(last->m_data + last->m_size, data, n);
+            last->m_size += n;
+            node->m_segments_size += n;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool message_pool_t::attach(message_t *msg, byte *data, u32 size, message_release_fn release, void *user)
+    {
+        message_node_t *node = msg_to_node(msg);
+        u32 const       used = msg->m_size + node->m_segments_size;
+        if (used > m_max_size || size > m_max_size - used)
+            return false;
+
+        message_segment_t *seg = alloc_segment(0);
+        if (seg == NULL)
+            return false;
+        seg->m_data    = data;
+        seg->m_size    = size;
+        seg->m_max     = 0;
+        seg->m_release = release;
+        seg->m_user    = user;
+
+        message_segment_t *last = s_last_segment(node);
+        if (last == NULL)
+            node->m_segments = seg;
+        else
+            last->m_next = seg;
+        node->m_segments_size += size;
+        return true;
+    }
+
+    void message_pool_t::release_segments(message_node_t *node)
+    {
+        message_segment_t *seg = node->m_segments;
+        while (seg != NULL)
+        {
+            message_segment_t *next = seg->m_next;
+            if (seg->m_release != NULL)
+                seg->m_release(seg->m_user, seg->m_data, seg->m_size);
+            release(segment_to_msg(seg));
+            seg = next;
+        }
+        node->m_segments      = NULL;
+        node->m_segments_size = 0;
+    }
+
+    void message_pool_t::release(message_t *msg)
+    {
+        message_node_t *node   = msg_to_node(msg);
+        message_node_t *shared = node->m_shared;
+        if (s_unref(node))
+        {
+            release_segments(node);
+            if (!node->m_pool->put_magazine(node))
+                node->m_pool->push_free(node->m_class, node, node, 1);
+        }
+        if (shared != NULL)
+            release(node_to_msg(shared));
+    }
+
+    void message_pool_t::release(message_t *const *msgs, u32 count)
+    {
+        // Messages go into the magazine of the calling thread when they can, runs of
+        // the others from the same pool and size class are chained and go back to the
+        // free list with a single lock
+        message_node_t *head = NULL;
+        message_node_t *tail = NULL;
+        u32             n    = 0;
+        for (u32 i = 0; i < count; ++i)
+        {
+            message_node_t *node   = msg_to_node(msgs[i]);
+            message_node_t *shared = node->m_shared;
+            if (s_unref(node))
+            {
+                release_segments(node);
+                if (!node->m_pool->put_magazine(node))
+                {
+                    if (head != NULL && (node->m_pool != head->m_pool || node->m_class != head->m_class))
+                    {
+                        head->m_pool->push_free(head->m_class, head, tail, n);
+                        head = NULL;
+                        n    = 0;
+                    }
+                    if (head == NULL)
+                        tail = node;
+                    node->m_next = head;
+                    head         = node;
+                    n += 1;
+                }
+            }
+            if (shared != NULL)
+                release(node_to_msg(shared));
+        }
+        if (head != NULL)
+            head->m_pool->push_free(head->m_class, head, tail, n);
+    }
+
+    message_t *message_pool_t::alloc_local(u32 size)
+    {
+        u32 const cls = size_to_class(size);
+        if (cls == m_num_classes)
+            return NULL;
+
+        size_class_t &sc = m_classes[cls];
+        if (sc.m_cache == nullptr)
+        {
+            // Refill the cache with a batch from the shared free list
+            natomic::lock(&m_lock);
+            if (sc.m_free == nullptr)
+                grow(cls);
+            u32 n = 0;
+            while (sc.m_free != nullptr && n < CACHE_BATCH)
+            {
+                message_node_t *node = sc.m_free;
+                sc.m_free            = node->m_next;
+                node->m_next         = sc.m_cache;
+                sc.m_cache           = node;
+                n += 1;
+            }
+            sc.m_free_count -= n;
+            natomic::unlock(&m_lock);
+            sc.m_cache_count = n;
+        }
+
+        message_node_t *node = sc.m_cache;
+        if (node == nullptr)
+            return NULL;
+        sc.m_cache = node->m_next;
+        sc.m_cache_count -= 1;
+        return s_reset_msg(node, sc.m_capacity);
+    }
+
+    message_t *message_pool_t::alloc_ref(message_t *shared)
+    {
+        message_t *ref = alloc(0);
+        if (ref != NULL)
+        {
+            message_node_t *node = msg_to_node(shared);
+            natomic::fetch_add(&node->m_refs, 1);
+            msg_to_node(ref)->m_shared = node;
+            ref->m_size                = shared->m_size;
+        }
+        return ref;
+    }
+
+    void message_pool_t::free_local(message_t *msg)
+    {
+        message_node_t *node = msg_to_node(msg);
+        if (node->m_pool != this)
+        {
+            release(msg);
+            return;
+        }
+
+        message_node_t *shared = node->m_shared;
+        if (s_unref(node))
+        {
+            release_segments(node);
+            size_class_t &sc = m_classes[node->m_class];
+            node->m_next     = sc.m_cache;
+            sc.m_cache       = node;
+            sc.m_cache_count += 1;
+
+            if (sc.m_cache_count > CACHE_MAX)
+            {
+                // Hand a batch back to the shared free list
+                message_node_t *head = sc.m_cache;
+                message_node_t *tail = head;
+                for (u32 i = 1; i < CACHE_BATCH; ++i)
+                    tail = tail->m_next;
+                sc.m_cache = tail->m_next;
+                sc.m_cache_count -= CACHE_BATCH;
+                push_free(node->m_class, head, tail, CACHE_BATCH);
+            }
+        }
+
+        if (shared != NULL)
+            free_local(node_to_msg(shared));
+    }
+
+}  // namespace ncore
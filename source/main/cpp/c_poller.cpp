@@ -0,0 +1,248 @@
+#include "ccore/c_target.h"
+#include "cbase/c_allocator.h"
+#include "cbase/c_debug.h"
+#include "cbase/c_memory.h"
+
+#include "csocket/private/c_poller.h"
+
+#ifdef PLATFORM_PC
+#    include <winsock2.h>  // For select()
+#elif defined(TARGET_LINUX)
+#    include <sys/epoll.h>  // For epoll_create1(), epoll_ctl() and epoll_wait()
+#    include <unistd.h>     // For close()
+#else
+#    include <sys/select.h>  // For select()
+#    include <sys/time.h>    // For timeval
+#endif
+
+#include <errno.h>  // For errno
+
+namespace ncore
+{
+    poller_t::poller_t()
+        : m_allocator(nullptr)
+        , m_max(0)
+        , m_len(0)
+        , m_epoll(-1)
+        , m_epoll_events(nullptr)
+        , m_entries(nullptr)
+    {
+    }
+
+#if defined(TARGET_LINUX) && !defined(PLATFORM_PC)
+
+    static u32 s_to_epoll(u32 events)
+    {
+        u32 e = EPOLLET | EPOLLRDHUP;
+        if (events & POLL_READ)
+            e |= EPOLLIN;
+        if (events & POLL_WRITE)
+            e |= EPOLLOUT;
+        return e;
+    }
+
+    static u32 s_from_epoll(u32 e)
+    {
+        u32 events = 0;
+        if (e & EPOLLIN)
+            events |= POLL_READ;
+        if (e & EPOLLOUT)
+            events |= POLL_WRITE;
+        if (e & EPOLLERR)
+            events |= POLL_ERROR;
+        if (e & (EPOLLHUP | EPOLLRDHUP))
+            events |= POLL_HANGUP;
+        return events;
+    }
+
+    bool poller_t::init(alloc_t* allocator, u32 max_sockets)
+    {
+        m_allocator    = allocator;
+        m_max          = max_sockets;
+        m_len          = 0;
+        m_epoll        = ::epoll_create1(EPOLL_CLOEXEC);
+        m_epoll_events = m_allocator->allocate(sizeof(struct epoll_event) * m_max, sizeof(void*));
+        return m_epoll != -1;
+    }
+
+    void poller_t::exit()
+    {
+        if (m_epoll != -1)
+        {
+            ::close(m_epoll);
+            m_epoll = -1;
+        }
+        if (m_epoll_events != nullptr)
+        {
+            m_allocator->deallocate(m_epoll_events);
+            m_epoll_events = nullptr;
+        }
+        m_len = 0;
+    }
+
+    bool poller_t::add(sd_t sock, void* user, u32 events)
+    {
+        struct epoll_event ev;
+        ev.events   = s_to_epoll(events);
+        ev.data.ptr = user;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, sock, &ev) == -1)
+            return false;
+        m_len += 1;
+        return true;
+    }
+
+    bool poller_t::mod(sd_t sock, void* user, u32 events)
+    {
+        struct epoll_event ev;
+        ev.events   = s_to_epoll(events);
+        ev.data.ptr = user;
+        return ::epoll_ctl(m_epoll, EPOLL_CTL_MOD, sock, &ev) == 0;
+    }
+
+    bool poller_t::rem(sd_t sock)
+    {
+        struct epoll_event ev;  // Kernels before 2.6.9 require a non-null event
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_DEL, sock, &ev) == -1)
+            return false;
+        m_len -= 1;
+        return true;
+    }
+
+    s32 poller_t::wait(poll_event_t* events, u32 max_events, s32 timeout_ms)
+    {
+        if (max_events > m_max)
+            max_events = m_max;
+
+        struct epoll_event* ready = (struct epoll_event*)m_epoll_events;
+        s32                 n     = ::epoll_wait(m_epoll, ready, (s32)max_events, timeout_ms);
+        if (n < 0)
+            return (errno == EINTR) ? 0 : -1;
+
+        for (s32 i = 0; i < n; ++i)
+        {
+            events[i].m_user   = ready[i].data.ptr;
+            events[i].m_events = s_from_epoll(ready[i].events);
+        }
+        return n;
+    }
+
+#else
+
+    bool poller_t::init(alloc_t* allocator, u32 max_sockets)
+    {
+        m_allocator = allocator;
+        m_max       = max_sockets;
+        m_len       = 0;
+        m_entries   = (entry_t*)m_allocator->allocate(sizeof(entry_t) * m_max, sizeof(void*));
+        return true;
+    }
+
+    void poller_t::exit()
+    {
+        if (m_entries != nullptr)
+        {
+            m_allocator->deallocate(m_entries);
+            m_entries = nullptr;
+        }
+        m_len = 0;
+    }
+
+    bool poller_t::add(sd_t sock, void* user, u32 events)
+    {
+        if (m_len == m_max)
+            return false;
+        m_entries[m_len].m_sock   = sock;
+        m_entries[m_len].m_events = events;
+        m_entries[m_len].m_user   = user;
+        m_len += 1;
+        return true;
+    }
+
+    bool poller_t::mod(sd_t sock, void* user, u32 events)
+    {
+        for (u32 i = 0; i < m_len; ++i)
+        {
+            if (m_entries[i].m_sock == sock)
+            {
+                m_entries[i].m_events = events;
+                m_entries[i].m_user   = user;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool poller_t::rem(sd_t sock)
+    {
+        for (u32 i = 0; i < m_len; ++i)
+        {
+            if (m_entries[i].m_sock == sock)
+            {
+                m_len -= 1;
+                m_entries[i] = m_entries[m_len];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    s32 poller_t::wait(poll_event_t* events, u32 max_events, s32 timeout_ms)
+    {
+        sd_t   max_fd = -1;
+        fd_set read_set, write_set, excp_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        FD_ZERO(&excp_set);
+        for (u32 i = 0; i < m_len; ++i)
+        {
+            entry_t const& e = m_entries[i];
+            if (e.m_events & POLL_READ)
+                FD_SET(e.m_sock, &read_set);
+            if (e.m_events & POLL_WRITE)
+            {
+                FD_SET(e.m_sock, &write_set);
+                FD_SET(e.m_sock, &excp_set);
+            }
+            if (e.m_sock > max_fd)
+                max_fd = e.m_sock;
+        }
+
+        timeval  tv;
+        timeval* ptv = NULL;
+        if (timeout_ms >= 0)
+        {
+            tv.tv_sec  = timeout_ms / 1000;
+            tv.tv_usec = (timeout_ms % 1000) * 1000;
+            ptv        = &tv;
+        }
+
+        s32 n = ::select((s32)max_fd + 1, &read_set, &write_set, &excp_set, ptv);
+        if (n <= 0)
+            return (n < 0 && errno != EINTR) ? -1 : 0;
+
+        s32 count = 0;
+        for (u32 i = 0; i < m_len && count < (s32)max_events; ++i)
+        {
+            entry_t const& e     = m_entries[i];
+            u32            ready = 0;
+            if (FD_ISSET(e.m_sock, &read_set))
+                ready |= POLL_READ;
+            if (FD_ISSET(e.m_sock, &write_set))
+                ready |= POLL_WRITE;
+            // The exception set means out-of-band data, not an error. Winsock also reports
+            // a failed connect only there, the write then reports the error.
+            if (FD_ISSET(e.m_sock, &excp_set))
+                ready |= POLL_WRITE;
+            if (ready != 0)
+            {
+                events[count].m_user   = e.m_user;
+                events[count].m_events = ready;
+                count += 1;
+            }
+        }
+        return count;
+    }
+
+#endif
+
+}  // namespace ncore
@@ -6,8 +6,14 @@
 #include "cbase/c_printf.h"
 #include "cbase/c_va_list.h"
 
+#include "csocket/private/c_crypto.h"
+#include "csocket/private/c_lz.h"
 #include "csocket/private/c_message-tcp.h"
 #include "csocket/private/c_message.h"
+#include "csocket/private/c_poller.h"
+#include "csocket/private/c_timer_wheel.h"
+#include "csocket/private/c_uring.h"
+#include "csocket/private/c_wakeup.h"
 #include "csocket/c_address.h"
 #include "csocket/c_message.h"
 #include "csocket/c_netip.h"
@@ -29,9 +35,7 @@ typedef char raw_type;  // Type used for raw data on this platform
 #    include <netdb.h>       // For gethostbyname()
 #    include <netinet/in.h>  // For sockaddr_in
 // #include <stdio>
-#ifdef TARGET_MAC
-#    include <fcntl.h>  // For socket(), connect(), send(), and recv()
-#endif
+#    include <fcntl.h>       // For fcntl()
 #    include <sys/socket.h>  // For socket(), connect(), send(), and recv()
 #    include <sys/types.h>   // For data types
 #    include <unistd.h>      // For close()
@@ -64,6 +68,33 @@ namespace ncore
         return true;
     }
 
+    static inline void s_prefetch(void const* p)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        __builtin_prefetch(p);
+#endif
+    }
+
+    static bool s_set_zerocopy(sd_t sock)
+    {
+#ifdef SO_ZEROCOPY
+        s32 one = 1;
+        return ::setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // The pending error of a socket, also when getsockopt itself fails
+    static s32 s_get_socket_error(sd_t sock)
+    {
+        s32       error     = 0;
+        socklen_t error_len = sizeof(error);
+        if (::getsockopt(sock, SOL_SOCKET, SO_ERROR, (raw_type*)&error, &error_len) != 0)
+            return errno;
+        return error;
+    }
+
     static void s_read_sockaddr(const sockaddr_storage* addr, char* host, u16& port)
     {
         if (addr->ss_family == AF_INET)
@@ -123,6 +154,7 @@ namespace ncore
     const u16 STATUS_SECURE              = 0x1000;
     const u16 STATUS_SECURE_RECV         = 0x0001;
     const u16 STATUS_SECURE_SEND         = 0x0002;
+    const u16 STATUS_SECURE_RESUME       = 0x0010;  // our secure message resumes a session with a ticket
     const u16 STATUS_ACCEPT              = 0x0004;
     const u16 STATUS_CONNECT             = 0x0008;
     const u16 STATUS_ACCEPT_SECURE_RECV  = STATUS_ACCEPT | STATUS_SECURE | STATUS_SECURE_RECV;
@@ -134,46 +166,255 @@ namespace ncore
     const u16 STATUS_DISCONNECTED        = 0x80;
     const u16 STATUS_CLOSE               = 0x100;
     const u16 STATUS_CLOSE_IMMEDIATELY   = 0x200;
+    const u16 STATUS_CLOSE_SHUTDOWN      = 0x400;  // io_uring, waiting for the requests in flight
+    const u16 STATUS_CONNECT_WAIT        = 0x800;  // the address is claimed, the socket is created when the reconnect delay has passed
 
     static bool status_is(u16 status, u16 check) { return (status & check) == check; }
     static bool status_is_one_of(u16 status, u16 check) { return (status & check) != 0; }
     static u16  status_set(u16 status, u16 set) { return status | set; }
     static u16  status_clear(u16 status, u16 set) { return status & ~set; }
 
+    // Features are announced in the secure handshake, a connection uses the ones both sides have
+    const u32 FEATURE_COMPRESSION = 0x1;
+    const u32 FEATURE_ENCRYPTION  = 0x2;
+    const u32 FEATURE_TICKETS     = 0x4;
+    const u32 HANDSHAKE_RESUME    = 0x80000000;  // with the features, the secure message resumes a session with a ticket
+
+    static u32 s_features(socket_config_t const& config)
+    {
+        u32 features = 0;
+        if (config.m_compress_min_size > 0)
+            features |= FEATURE_COMPRESSION;
+        if (config.m_encrypt)
+            features |= FEATURE_ENCRYPTION;
+        if (config.m_ticket_cache_size > 0)
+            features |= FEATURE_TICKETS;
+        return features;
+    }
+
+    // Keys of the encrypted transport, one per direction. The nonce of a message is
+    // its lane and its number in that lane, the messages of a lane arrive in order.
+    struct channel_t
+    {
+        byte m_secret[ncrypto::KEY_SIZE];  // our X25519 key, only during the handshake
+        byte m_send_key[ncrypto::KEY_SIZE];
+        byte m_recv_key[ncrypto::KEY_SIZE];
+        u64  m_send_seq[MSG_LANES];
+        u64  m_recv_seq[MSG_LANES];
+    };
+
+    static void s_channel_nonce(byte* nonce, u32 lane, u64 seq)
+    {
+        g_memcpy(nonce, &lane, sizeof(u32));
+        g_memcpy(nonce + sizeof(u32), &seq, sizeof(u64));
+    }
+
+    // The key of each direction is derived from a secret that both sides share
+    static void s_channel_keys(channel_t& channel, byte const* master, bool connector)
+    {
+        static char const s_labels[2][17] = {"csocket connect ", "csocket accept  "};
+
+        u32 const send = connector ? 0 : 1;
+        ncrypto::hchacha20(channel.m_send_key, master, (byte const*)s_labels[send]);
+        ncrypto::hchacha20(channel.m_recv_key, master, (byte const*)s_labels[1 - send]);
+    }
+
+    static bool s_equal(byte const* a, byte const* b, u32 size)
+    {
+        byte diff = 0;
+        for (u32 i = 0; i < size; ++i)
+            diff |= a[i] ^ b[i];
+        return diff == 0;
+    }
+
+    // A session ticket lets a reconnect skip the key exchange. The side that accepted
+    // the connection issues one after every handshake, both sides keep it under the
+    // ID of the other side and it can only be used once.
+    //
+    //   ticket message = id | secret | features (u32)
+    //   resume message = sockid | netip | features (u32) with HANDSHAKE_RESUME | id | salt | public key
+    //   resume answer  = sockid | netip | features (u32) with HANDSHAKE_RESUME
+    //
+    // With encryption the keys are derived from HChaCha20(secret, salt), so every
+    // resumed session has keys of its own. The connector holds on to its messages until
+    // the answer arrives, when the ticket is not accepted the answer is a normal secure
+    // message and the public key of the resume message completes the full handshake.
+    enum
+    {
+        TICKET_ID_SIZE   = 16,
+        TICKET_SALT_SIZE = 16,
+        TICKET_MSG_SIZE  = TICKET_ID_SIZE + ncrypto::KEY_SIZE + sizeof(u32),
+        TICKET_WAYS      = 8,  // slots that are searched for an ID, a full set replaces its oldest ticket
+    };
+
+    struct ticket_t
+    {
+        sockid_t m_sockid;
+        byte     m_id[TICKET_ID_SIZE];
+        byte     m_secret[ncrypto::KEY_SIZE];
+        u32      m_features;
+        u32      m_stamp;  // 0 = empty, otherwise the higher the newer
+    };
+
+    struct tickets_t
+    {
+        inline tickets_t()
+            : m_mask(0)
+            , m_stamp(0)
+            , m_array(NULL)
+        {
+        }
+
+        u32       m_mask;
+        u32       m_stamp;
+        ticket_t* m_array;
+    };
+
+    static u32 s_hash_sockid(sockid_t const& sockid)
+    {
+        cbuffer_t const id   = sockid.cbuffer();
+        u32             hash = 2166136261u;
+        for (byte const* b = id.m_begin; b < id.m_end; ++b)
+            hash = (hash ^ *b) * 16777619u;
+        return hash;
+    }
+
+    static void s_init_tickets(alloc_t* allocator, tickets_t* self, u32 max)
+    {
+        self->m_mask  = 0;
+        self->m_stamp = 0;
+        self->m_array = NULL;
+        if (max == 0)
+            return;
+
+        u32 size = TICKET_WAYS;
+        while (size < max)
+            size <<= 1;
+        self->m_array = g_allocate_array<ticket_t>(allocator, size);
+        self->m_mask  = size - 1;
+        g_memset(self->m_array, 0, size * sizeof(ticket_t));
+    }
+
+    static void s_exit_tickets(alloc_t* allocator, tickets_t* self)
+    {
+        if (self->m_array != NULL)
+        {
+            g_memset(self->m_array, 0, (self->m_mask + 1) * sizeof(ticket_t));
+            g_deallocate_array(allocator, self->m_array);
+        }
+        self->m_mask  = 0;
+        self->m_stamp = 0;
+        self->m_array = NULL;
+    }
+
+    static ticket_t* s_find_ticket(tickets_t* self, sockid_t const& sockid)
+    {
+        if (self->m_array == NULL)
+            return NULL;
+        u32 const hash = s_hash_sockid(sockid);
+        for (u32 i = 0; i < TICKET_WAYS; ++i)
+        {
+            ticket_t* ticket = &self->m_array[(hash + i) & self->m_mask];
+            if (ticket->m_stamp != 0 && ticket->m_sockid.compare(sockid) == 0)
+                return ticket;
+        }
+        return NULL;
+    }
+
+    // The slot for a new ticket of @sockid, it replaces the ticket that @sockid had or else an empty or the oldest slot
+    static ticket_t* s_store_ticket(tickets_t* self, sockid_t const& sockid)
+    {
+        if (self->m_array == NULL)
+            return NULL;
+        ticket_t* slot = s_find_ticket(self, sockid);
+        if (slot == NULL)
+        {
+            u32 const hash = s_hash_sockid(sockid);
+            for (u32 i = 0; i < TICKET_WAYS; ++i)
+            {
+                ticket_t* ticket = &self->m_array[(hash + i) & self->m_mask];
+                if (slot == NULL || ticket->m_stamp < slot->m_stamp)
+                    slot = ticket;
+            }
+        }
+
+        self->m_stamp += 1;
+        if (self->m_stamp == 0)
+            self->m_stamp = 1;
+        slot->m_sockid = sockid;
+        slot->m_stamp  = self->m_stamp;
+        return slot;
+    }
+
+    static void s_erase_ticket(ticket_t* ticket) { g_memset(ticket, 0, sizeof(ticket_t)); }
+
+    enum e_timer_type
+    {
+        TIMER_CONNECTION = 1,  // reconnect delay, handshake deadline, idle timeout and keepalive of a connection
+    };
+
     struct connection_t
     {
         sd_t                  m_handle;
-        tick_t                m_last_io_time;
+        tick_t                m_last_recv_time;
+        tick_t                m_last_send_time;
         u16                   m_status;
         u16                   m_ip_port;
+        u32                   m_index;
+        u32                   m_poll_events;
+        u32                   m_uring_ops;
+        u32 volatile          m_send_blocked;  // send_msg() returned SEND_WOULD_BLOCK, report when drained
+        u32                   m_backlog;       // POLL_READ and/or POLL_WRITE, there is more to read or write
+        s32                   m_recv_deficit;
+        s32                   m_send_deficit;
+        u32                   m_features;      // FEATURE_* that both sides support, known once secured
+        channel_t             m_channel;
+        sockid_t              m_peer_id;       // ID from the secure message of the other side
         char                  m_ip_str[20];
         u32                   m_sockaddr_len;
         socket_address        m_sockaddr;
         address_t*            m_address;
         socket_tcp_t*         m_parent;
-        message_queue_t       m_message_queue;
-        message_t*            m_message_read;
+        byte*                 m_recv_buffer;   // only while the connection is registered, see attach_recv_buffer()
+        message_lanes_t       m_message_queue;
+        message_queue_t       m_pending;       // messages send before the connection was secured
         message_socket_reader m_message_reader;
         message_socket_writer m_message_writer;
+        wheel_timer_t         m_timer;
     };
 
     const int INVALID_SOCKET = -1;
 
     static void s_init(connection_t* c, socket_tcp_t* parent)
     {
-        c->m_handle       = INVALID_SOCKET;
-        c->m_last_io_time = 0;
-        c->m_status       = STATUS_NONE;
-        c->m_ip_port      = 0;
+        c->m_handle         = INVALID_SOCKET;
+        c->m_last_recv_time = 0;
+        c->m_last_send_time = 0;
+        c->m_status         = STATUS_NONE;
+        c->m_ip_port        = 0;
+        c->m_poll_events    = 0;
+        c->m_uring_ops      = 0;
+        c->m_send_blocked   = 0;
+        c->m_backlog        = 0;
+        c->m_recv_deficit   = 0;
+        c->m_send_deficit   = 0;
+        c->m_features       = 0;
+        g_memset(&c->m_channel, 0, sizeof(c->m_channel));
+        c->m_peer_id = sockid_t();
         g_memset(c->m_ip_str, 0, sizeof(c->m_ip_str));
         c->m_sockaddr_len = 0;
         c->m_sockaddr.clear();
         c->m_address = NULL;
         c->m_parent  = parent;
+        c->m_recv_buffer = NULL;
         c->m_message_queue.init();
-        c->m_message_read = NULL;
-        c->m_message_reader.init(INVALID_SOCKET);
-        c->m_message_writer.init(INVALID_SOCKET, NULL);
+        c->m_pending.init();
+        c->m_message_reader.init(INVALID_SOCKET, NULL, NULL);
+        c->m_message_writer.init(INVALID_SOCKET, NULL, NULL);
+        c->m_timer.m_next = NULL;
+        c->m_timer.m_prev = NULL;
+        c->m_timer.m_user = c;
+        c->m_timer.m_type = TIMER_CONNECTION;
     }
 
     enum e_create_socket
@@ -184,7 +425,7 @@ namespace ncore
 
     static s32 s_create_socket(crunes_t const& host, u16 port, u32 flags, connection_t* socket)
     {
-        socket->m_handle = NULL;
+        socket->m_handle = INVALID_SOCKET;
         socket->m_status = STATUS_NONE;
 
         addrinfo* info;
@@ -222,6 +463,7 @@ namespace ncore
             if (::setsockopt(socket->m_handle, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char*>(&flag), sizeof(flag)) == -1)
             {
                 ::close(socket->m_handle);
+                socket->m_handle = -1;
                 return -1;
             }
 #endif
@@ -231,7 +473,7 @@ namespace ncore
                 socket->m_handle = -1;
                 return -1;
             }
-            if (nflags::is_set(flags, CS_OPTION_LISTEN))
+            if (!nflags::is_set(flags, CS_OPTION_LISTEN))
             {
                 if (::connect(socket->m_handle, nextAddr->ai_addr, nextAddr->ai_addrlen) == -1 && !nflags::is_set(flags, CS_OPTION_NOBLOCK))
                 {
@@ -321,18 +563,123 @@ namespace ncore
         return true;
     }
 
+    static void s_init_connections(alloc_t* allocator, connections_t* self, u32 max)
+    {
+        self->m_len   = 0;
+        self->m_max   = max;
+        self->m_array = g_allocate_array<connection_t*>(allocator, max);
+    }
+
+    static void s_exit_connections(alloc_t* allocator, connections_t* self)
+    {
+        g_deallocate_array(allocator, self->m_array);
+        self->m_len   = 0;
+        self->m_max   = 0;
+        self->m_array = NULL;
+    }
+
+    bool remove_connection(connections_t* self, connection_t* c)
+    {
+        for (u32 i = 0; i < self->m_len; ++i)
+        {
+            if (self->m_array[i] == c)
+            {
+                self->m_len -= 1;
+                self->m_array[i] = self->m_array[self->m_len];
+                return true;
+            }
+        }
+        return false;
+    }
+
     // An address is a netip_t connected to an ID.
     // When it is actively used it has a valid pointer
     // to a connection.
     // The ID and netip are part of the 'secure' handshake
     // that is done when a connection is established.
+    // The reconnect delay belongs to the connection that has claimed the address, it
+    // is only changed by the shard that owns that connection.
+    // Messages that are send between connect() and the claim of the address are held
+    // on the address, see s_hold_msg().
+    static message_node_t s_held_closed;
+
     struct address_t
     {
-        connection_t* m_conn;
-        sockid_t      m_sockid;
-        netip_t       m_netip;
+        inline address_t()
+            : m_conn(NULL)
+            , m_held(&s_held_closed)
+            , m_held_bytes(0)
+            , m_connect_delay(0)
+        {
+        }
+
+        connection_t* volatile   m_conn;  // claimed with a CAS by the shard that connects, other threads read it with acquire
+        message_node_t* volatile m_held;  // a stack of held messages, s_held_closed when the address is not being connected
+        u32 volatile             m_held_bytes;
+        sockid_t                 m_sockid;
+        netip_t                  m_netip;
+        u32                      m_connect_delay;  // ms to wait before connecting again, grows with every failed attempt
     };
 
+    // connect() lets messages be held on the address until a shard claims it
+    static void s_open_held(address_t* addr)
+    {
+        message_node_t* expected = &s_held_closed;
+        natomic::cas(&addr->m_held, expected, (message_node_t*)NULL);
+    }
+
+    // Returns false when the address is not being connected or it holds too much already
+    static bool s_hold_msg(address_t* addr, message_t* msg, u32 max_size)
+    {
+        message_node_t* node = msg_to_node(msg);
+        u32 const       size = get_msg_frame_size(node);
+        if (natomic::fetch_add(&addr->m_held_bytes, size) + size > max_size)
+        {
+            natomic::fetch_add(&addr->m_held_bytes, (u32)0 - size);
+            return false;
+        }
+
+        message_node_t* head = natomic::load_acquire(&addr->m_held);
+        do
+        {
+            if (head == &s_held_closed)
+            {
+                natomic::fetch_add(&addr->m_held_bytes, (u32)0 - size);
+                return false;
+            }
+            node->m_next = head;
+        } while (!natomic::cas(&addr->m_held, head, node));
+        return true;
+    }
+
+    // Takes the held messages in the order they were send, nothing is held anymore until
+    // the next connect()
+    static message_node_t* s_take_held(address_t* addr)
+    {
+        message_node_t* held  = natomic::exchange(&addr->m_held, &s_held_closed);
+        message_node_t* order = NULL;
+        while (held != NULL && held != &s_held_closed)
+        {
+            message_node_t* next = held->m_next;
+            natomic::fetch_add(&addr->m_held_bytes, (u32)0 - get_msg_frame_size(held));
+            held->m_next = order;
+            order        = held;
+            held         = next;
+        }
+        return order;
+    }
+
+    static void s_drop_held(address_t* addr)
+    {
+        message_node_t* held = s_take_held(addr);
+        while (held != NULL)
+        {
+            message_node_t* next = held->m_next;
+            message_pool_t::release(node_to_msg(held));
+            held = next;
+        }
+    }
+
     struct addresses_t
     {
         inline addresses_t()
@@ -362,16 +709,19 @@ namespace ncore
         return true;
     }
 
-    static void add_to_set(sd_t sock, fd_set* set, sd_t* max_fd)
+    static void s_init_addresses(alloc_t* allocator, addresses_t* self, u32 max)
     {
-        if (sock != INVALID_SOCKET)
-        {
-            FD_SET(sock, set);
-            if (*max_fd == INVALID_SOCKET || sock > *max_fd)
-            {
-                *max_fd = sock;
-            }
-        }
+        self->m_len   = 0;
+        self->m_max   = max;
+        self->m_array = g_allocate_array<address_t*>(allocator, max);
+    }
+
+    static void s_exit_addresses(alloc_t* allocator, addresses_t* self)
+    {
+        g_deallocate_array(allocator, self->m_array);
+        self->m_len   = 0;
+        self->m_max   = 0;
+        self->m_array = NULL;
     }
 
     class socket_tcp_t : public socket_t
@@ -385,50 +735,158 @@ namespace ncore
         connection_t m_server_socket;
 
         u32           m_max_open;
+        connection_t* m_connections;
+        byte**        m_free_recv_buffers;  // receive buffers of closed connections, at most m_max_open
+        u32           m_num_free_recv_buffers;
         connections_t m_free_connections;
         connections_t m_secure_connections;
         connections_t m_open_connections;
-
-        addresses_t m_to_connect;
-        addresses_t m_to_disconnect;
-
-        message_queue_t m_received_messages;
-
-        connection_t* accept();
-        void          send_secure_msg(connection_t* conn);
+        connections_t m_close_connections;
+        connections_t m_backlog_connections;  // served in deficit round robin order
+
+        u32 volatile  m_requests_lock;  // connect() and disconnect() can be called from any thread
+        addresses_t   m_to_connect;
+        addresses_t   m_to_disconnect;
+        addresses_t   m_secured;  // addresses of connections that completed the handshake
+        addresses_t   m_drained;  // addresses of blocked connections that went below the low watermark
+        timer_wheel_t m_timers;
+
+        socket_config_t m_config;
+        bool            m_use_uring;
+        bool            m_uring_multishot;
+        poller_t        m_poller;
+        poll_event_t*   m_poll_events;
+        uring_t         m_uring;
+        uring_cqe_t*    m_uring_cqes;
+        wakeup_t        m_wakeup;
+
+        message_pool_t       m_message_pool;
+        message_queue_t      m_received_messages;
+        u32                  m_num_recv_rings;
+        message_spsc_ring_t* m_recv_rings;           // received messages for the worker threads
+        message_queue_t*     m_recv_overflow;        // received messages that are waiting for room in their ring
+        u32                  m_recv_overflow_count;
+        message_mpsc_queue_t m_forwarded_messages;  // messages from other shards and threads for connections that we own
+        u32                  m_lz_table[nlz::HASH_SIZE];  // hash table of the compressor
+        tickets_t            m_client_tickets;            // tickets for reconnecting to the peers we connect to
+        tickets_t            m_server_tickets;            // tickets we issued to the peers that connect to us
+
+        bool accept(connection_t*& conn);
+        bool       queue_msg(connection_t* conn, message_t* msg);
+        message_t* compress_msg(message_t* msg);
+        message_t* decompress_msg(message_t* msg);
+        message_t* seal_msg(connection_t* conn, message_t* msg);
+        bool       open_msg(connection_t* conn, message_t* msg);
+        bool       derive_keys(connection_t* conn, byte const* peer_key);
+        void       resume_keys(connection_t* conn, byte const* secret, byte const* salt);
+        void deliver_msg(connection_t* conn, message_node_t* node);
+        void flush_recv_overflow();
+        void connect_to(address_t* addr, tick_t current_time, addresses_t& failed_conns);
+        void connect_socket(connection_t* conn, tick_t current_time);
+        void queue_held(connection_t* conn);
+        void on_connect_failed(address_t* addr);
+        void write_identity(binary_writer_t& writer, u32 features);
+        void send_secure_msg(connection_t* conn);
+        void send_resume_msg(connection_t* conn, ticket_t* ticket);
+        void send_resumed_msg(connection_t* conn);
+        bool on_resume_msg(connection_t* conn, sockid_t const& sockid, message_t* msg, u32 offset);
+        void send_ticket_msg(connection_t* conn);
+        void on_ticket_msg(connection_t* conn, message_t* msg);
+        void send_keepalive_msg(connection_t* conn);
+
+        bool attach_recv_buffer(connection_t* conn);
+        void detach_recv_buffer(connection_t* conn);
+        bool register_connection(connection_t* conn, u32 events);
+        void set_write_interest(connection_t* conn, bool write);
+        void schedule_close(connection_t* conn);
+        void close_connection(connection_t* conn, addresses_t& closed_conns, addresses_t& failed_conns);
+        void on_connected(connection_t* conn);
+        void on_secured(connection_t* conn);
+        void arm_timer(connection_t* conn);
+        void on_timer(connection_t* conn, tick_t current_time);
+        bool on_message(connection_t* conn, message_t* rcvd_msg);
+        void on_send_queue_empty(connection_t* conn);
+        void on_send_queue_drained(connection_t* conn);
+        void on_readable(connection_t* conn, s32 quantum, tick_t current_time);
+        void on_writable(connection_t* conn, s32 quantum, tick_t current_time);
+        void add_backlog(connection_t* conn, u32 events);
+        void process_backlog(tick_t current_time);
+        void process_poll(s32 wait_ms);
+        s32  io_quantum() const;
+
+        void uring_accept(sd_t sock, tick_t current_time);
+        void uring_post_recv(connection_t* conn);
+        void uring_post_send(connection_t* conn);
+        void uring_completion(uring_cqe_t const& cqe, tick_t current_time);
+        void process_uring(s32 wait_ms);
+        s32  process_wait_ms();
+        bool pop_request(addresses_t* requests, address_t*& addr);
 
     public:
         inline socket_tcp_t()
             : m_allocator(nullptr)
+            , m_max_open(0)
+            , m_connections(nullptr)
+            , m_free_recv_buffers(nullptr)
+            , m_num_free_recv_buffers(0)
+            , m_requests_lock(0)
+            , m_use_uring(false)
+            , m_uring_multishot(true)
+            , m_poll_events(nullptr)
+            , m_uring_cqes(nullptr)
+            , m_num_recv_rings(0)
+            , m_recv_rings(nullptr)
+            , m_recv_overflow(nullptr)
+            , m_recv_overflow_count(0)
         {
             s_attach();
         }
         ~socket_tcp_t() { s_release(); }
 
-        void init(alloc_t* allocator) { m_allocator = allocator; }
+        void init(alloc_t* allocator, socket_config_t const& config)
+        {
+            m_allocator = allocator;
+            m_config    = config;
+        }
 
         virtual void open(u16 port, crunes_t const& socket_name, sockid_t const& id, u32 max_open);
         virtual void close();
 
-        virtual void process(addresses_t& open_conns, addresses_t& closed_conns, addresses_t& new_conns, addresses_t& failed_conns, addresses_t& pex_conns);
+        virtual void process(addresses_t& open_conns, addresses_t& closed_conns, addresses_t& new_conns, addresses_t& failed_conns, addresses_t& pex_conns, addresses_t& drained_conns);
 
         virtual void connect(address_t*);
         virtual void disconnect(address_t*);
+        virtual void wakeup();
 
         virtual bool alloc_msg(message_t*& msg);
-        virtual void commit_msg(message_t* msg);
+        virtual bool alloc_msg(message_t*& msg, u32 size);
+        virtual void commit_msg(message_t*& msg);
         virtual void free_msg(message_t* msg);
+        virtual bool append_msg(message_t* msg, byte const* data, u32 size);
+        virtual bool attach_msg(message_t* msg, byte* data, u32 size, message_release_fn release, void* user);
 
-        virtual bool send_msg(message_t* msg, address_t* to);
+        virtual esend_result send_msg(message_t* msg, address_t* to);
+        virtual esend_result send_msg(message_t* msg, address_t* to, esend_lane lane);
+        virtual u32          broadcast_msg(message_t* msg, addresses_t const& to);
         virtual bool recv_msg(message_t*& msg, address_t*& from);
+        virtual bool recv_msg(u32 ring, message_t*& msg, address_t*& from);
+        virtual u32  recv_msgs(received_msg_t* msgs, u32 max_msgs);
+        virtual u32  recv_msgs(u32 ring, received_msg_t* msgs, u32 max_msgs);
+        virtual void free_msgs(received_msg_t const* msgs, u32 count);
 
         DCORE_CLASS_PLACEMENT_NEW_DELETE
     };
 
     socket_t* gCreateTcpBasedSocket(alloc_t* allocator)
+    {
+        socket_config_t config;
+        return gCreateTcpBasedSocket(allocator, config);
+    }
+
+    socket_t* gCreateTcpBasedSocket(alloc_t* allocator, socket_config_t const& config)
     {
         socket_tcp_t* socket = g_allocate<socket_tcp_t>(allocator);
-        socket->init(allocator);
+        socket->init(allocator, config);
         return socket;
     }
 
@@ -439,359 +897,1835 @@ namespace ncore
         g_deallocate(s->m_allocator, s);
     }
 
-    void socket_tcp_t::open(u16 port, crunes_t const& name, sockid_t const& id, u32 max_open)
-    {
-        // Open the server (bind/listen) socket
-        m_sockid = id;
-        s_create_socket(crunes_t(), port, CS_OPTION_LISTEN | CS_OPTION_NOBLOCK, &m_server_socket);
-    }
-
-    void socket_tcp_t::close()
+    void gCreateTcpBasedSockets(alloc_t* allocator, socket_config_t const& config, socket_t** shards, u32 num_shards)
     {
-        // close all active sockets
-        // close server socket
-        // free all messages
+        for (u32 i = 0; i < num_shards; ++i)
+        {
+            shards[i] = gCreateTcpBasedSocket(allocator, config);
+        }
     }
 
-    connection_t* socket_tcp_t::accept()
+    void gDestroyTcpBasedSockets(socket_t** shards, u32 num_shards)
     {
-        connection_t* c = NULL;
-
-        socket_address sa;
-        socklen_t      len = sizeof(sa);
-
-        // NOTE: on Windows, sock is always > FD_SETSIZE
-        sd_t sock = ::accept(m_server_socket.m_handle, &sa.sa, &len);
-        if (sock != INVALID_SOCKET)
+        for (u32 i = 0; i < num_shards; ++i)
         {
-            pop_connection(&m_free_connections, c);
-            if (c == NULL)
-            {
-                ::close(sock);
-                c = NULL;
-            }
-            else
-            {
-                s_init(c, this);
-                s_set_blocking_mode(sock, false);
-                c->m_parent       = this;
-                c->m_handle       = sock;
-                c->m_address      = NULL;
-                c->m_sockaddr_len = len;
-                memcpy(&c->m_sockaddr, &sa, len);
-                c->m_status = STATUS_ACCEPT_SECURE_RECV;
-            }
+            gDestroyTcpBasedSocket(shards[i]);
+            shards[i] = NULL;
         }
-        return c;
     }
 
-    void socket_tcp_t::send_secure_msg(connection_t* conn)
+    // io_uring request user data is the fixed file slot and the operation,
+    // slot 0 is the server socket, slot i+1 is connection i and the last slot
+    // is the wakeup handle.
+    enum e_uring_op
     {
-        // Create a message with our ID and Address details and send it
-        message_t* secure_msg;
-        alloc_msg(secure_msg);
+        URING_OP_ACCEPT  = 0x1,
+        URING_OP_CONNECT = 0x2,
+        URING_OP_RECV    = 0x4,
+        URING_OP_SEND    = 0x8,
+        URING_OP_WAKEUP  = 0x10,
+        URING_OP_CANCEL  = 0x20,
+    };
 
-        binary_writer_t msg_writer = secure_msg->get_writer();
-        msg_writer.write_data(m_sockid.buffer());
-        byte     netip_data[netip_t::SERIALIZE_SIZE];
-        buffer_t netip(netip_data, netip_data + netip_t::SERIALIZE_SIZE);
-        m_netip.serialize_to(netip);
-        msg_writer.write_data(netip);
-        secure_msg->m_size = msg_writer.size();
+    static inline u64 s_uring_user(u32 slot, u32 op) { return ((u64)slot << 8) | op; }
 
-        conn->m_message_queue.push(secure_msg);
-    }
+    const u32 URING_MAX_CQES = 256;
 
-    void socket_tcp_t::process(addresses_t& open_connections, addresses_t& closed_connections, addresses_t& new_connections, addresses_t& failed_connections, addresses_t& pex_connections)
+    void socket_tcp_t::open(u16 port, crunes_t const& name, sockid_t const& id, u32 max_open)
     {
-        // Non-block connects to remote IP:Port sockets
-        address_t* remote_addr;
-        while (pop_address(&m_to_connect, remote_addr))
+        m_sockid     = id;
+        m_local_port = port;
+        m_max_open   = max_open;
+
+        // Pre-allocate all connection objects, they are recycled through the free list.
+        // Receive buffers are only allocated for the connections that are opened.
+        m_connections           = g_allocate_array<connection_t>(m_allocator, m_max_open);
+        m_free_recv_buffers     = g_allocate_array<byte*>(m_allocator, m_max_open);
+        m_num_free_recv_buffers = 0;
+        s_init_connections(m_allocator, &m_free_connections, m_max_open);
+        s_init_connections(m_allocator, &m_secure_connections, m_max_open);
+        s_init_connections(m_allocator, &m_open_connections, m_max_open);
+        s_init_connections(m_allocator, &m_close_connections, m_max_open);
+        s_init_connections(m_allocator, &m_backlog_connections, m_max_open);
+        for (u32 i = 0; i < m_max_open; ++i)
         {
-            connection_t* c = remote_addr->m_conn;
-            if (c->m_address == NULL)
-            {
-                if (pop_connection(&m_free_connections, c))
-                {
-                    s_init(c, this);
+            s_init(&m_connections[i], this);
+            m_connections[i].m_index = i;
+            push_connection(&m_free_connections, &m_connections[i]);
+        }
+        s_init_addresses(m_allocator, &m_to_connect, m_max_open);
+        s_init_addresses(m_allocator, &m_to_disconnect, m_max_open);
+        s_init_addresses(m_allocator, &m_secured, m_max_open);
+        s_init_addresses(m_allocator, &m_drained, m_max_open);
+        m_timers.init(getTime(), millisecondsToTicks(1));
+        m_message_pool.init(m_allocator, m_config.m_max_message_size + ncrypto::TAG_SIZE);  // room for the tag of an encrypted message
+        m_received_messages.init();
+        g_memset(m_lz_table, 0, sizeof(m_lz_table));
+        s_init_tickets(m_allocator, &m_client_tickets, m_config.m_ticket_cache_size);
+        s_init_tickets(m_allocator, &m_server_tickets, m_config.m_ticket_cache_size);
+
+        // Rings for the worker threads
+        m_num_recv_rings      = m_config.m_recv_rings;
+        m_recv_overflow_count = 0;
+        if (m_num_recv_rings > 0)
+        {
+            u32 ring_size = 2;
+            while (ring_size < m_config.m_recv_ring_size)
+                ring_size <<= 1;
 
-                    char    remote_str_chars[128];
-                    runes_t remote_str = make_runes(remote_str_chars, remote_str_chars + sizeof(remote_str_chars) - 1);
-                    remote_addr->m_netip.to_string(remote_str, true);
-                    if (s_create_socket(make_crunes(remote_str), remote_addr->m_netip.get_port(), CS_OPTION_NOBLOCK, c) == 0)
-                    {
-                        // This connection needs to be secured first
-                        push_connection(&m_secure_connections, c);
-                        c->m_status = STATUS_CONNECT_SECURE_SEND | STATUS_CONNECTING;
-                    }
-                    else
-                    {
-                        // Failed to connect to remote, reuse the connection object
-                        push_address(&failed_connections, remote_addr);
-                        push_connection(&m_free_connections, c);
-                    }
-                }
+            m_recv_rings    = g_allocate_array<message_spsc_ring_t>(m_allocator, m_num_recv_rings);
+            m_recv_overflow = g_allocate_array<message_queue_t>(m_allocator, m_num_recv_rings);
+            for (u32 i = 0; i < m_num_recv_rings; ++i)
+            {
+                m_recv_rings[i].init(m_allocator, ring_size);
+                m_recv_overflow[i].init();
             }
         }
+        m_forwarded_messages.init();
 
-        // build the set of 'reading' sockets
-        // build the set of 'writing' sockets
-        sd_t   max_fd = INVALID_SOCKET;
-        fd_set read_set, write_set, excp_set;
-        FD_ZERO(&read_set);
-        FD_ZERO(&write_set);
-        FD_ZERO(&excp_set);
-        add_to_set(m_server_socket.m_handle, &read_set, &max_fd);
-        for (u32 i = 0; i < m_open_connections.m_len;)
+        m_wakeup.init();
+
+        // Every connection can have a receive and a send in flight
+        m_use_uring = false;
+        if (m_config.m_transport == socket_config_t::TRANSPORT_URING)
         {
-            connection_t* conn = m_open_connections.m_array[i];
+            m_use_uring = m_uring.init(m_allocator, 2 * m_max_open + 3, m_max_open + 2);
+            if (m_use_uring)
+                m_uring_cqes = g_allocate_array<uring_cqe_t>(m_allocator, URING_MAX_CQES);
+        }
 
-            // DBG(("%p read_set", conn));
-            add_to_set(conn->m_handle, &read_set, &max_fd);
+        // Otherwise the server socket, the wakeup handle and all connections are registered with one poller
+        if (!m_use_uring)
+        {
+            m_poller.init(m_allocator, m_max_open + 2);
+            m_poll_events = g_allocate_array<poll_event_t>(m_allocator, m_max_open + 2);
+        }
 
-            if (conn->m_message_queue.m_size > 0)
+        if (m_wakeup.valid())
+        {
+            if (m_use_uring)
+            {
+                m_uring.set_file(m_max_open + 1, m_wakeup.handle());
+                m_uring.poll_read(m_max_open + 1, s_uring_user(m_max_open + 1, URING_OP_WAKEUP));
+            }
+            else
             {
-                // DBG(("%p write_set", conn));
-                add_to_set(conn->m_handle, &write_set, &max_fd);
+                m_poller.add(m_wakeup.handle(), &m_wakeup, POLL_READ);
             }
-            ++i;
         }
 
-        // process to-secure sockets, send / receive messages on these sockets
-        // process messages for the 'secure' sockets and see if they are now 'secured'
-        // any 'secured' sockets add them to 'open' sockets and add their addresses to 'new_connections'
-        for (u32 i = 0; i < m_secure_connections.m_len; ++i)
+        // Open the server (bind/listen) socket
+        s_init(&m_server_socket, this);
+        if (s_create_socket(crunes_t(), port, CS_OPTION_LISTEN | CS_OPTION_NOBLOCK, &m_server_socket) == 0)
         {
-            connection_t* sc = m_secure_connections.m_array[i];
-            if (status_is(sc->m_status, STATUS_SECURE_RECV))
+            if (m_use_uring)
             {
-                add_to_set(sc->m_handle, &read_set, &max_fd);
+                m_uring.set_file(0, m_server_socket.m_handle);
+                m_uring.accept(0, m_uring_multishot, s_uring_user(0, URING_OP_ACCEPT));
             }
-            else if (status_is(sc->m_status, STATUS_SECURE_SEND))
+            else
             {
-                add_to_set(sc->m_handle, &write_set, &max_fd);
+                m_poller.add(m_server_socket.m_handle, &m_server_socket, POLL_READ);
             }
         }
+    }
 
-        // process messages for all other sockets and filter out any 'pex' messages, process them and register the addresses, for any 'new' address
-        // add them to 'connections'.
-        // for any socket that gave an 'error/except-ion' mark them as 'closed', add their addresses to 'closed_connections' and free their messages
-
-        // any other messages add them to the 'recv queue'
-        s32 const wait_ms = 1;
-
-        timeval tv;
-        tv.tv_sec  = wait_ms / 1000;
-        tv.tv_usec = (wait_ms % 1000) * 1000;
+    void socket_tcp_t::close()
+    {
+        if (m_connections == nullptr)
+            return;
 
-        if (::select((s32)max_fd + 1, &read_set, &write_set, &excp_set, &tv) > 0)
+        // Requests in flight reference the receive buffers, the messages that are being
+        // send and the message headers of the ring. They are cancelled and the sockets
+        // are shut down, then we wait for their completions before anything is freed.
+        if (m_use_uring)
         {
-            // select() might have been waiting for a long time, reset current_time
-            // now to prevent last_io_time being set to the past.
-            tick_t current_time = getTime();
-
-            // @TODO: Handle exceptions of the listening socket, we basically
-            //        have to restart the server when this happens and the user needs
-            //        to know this.
-            //        Restarting should have a time-guard so that we don't try and restart
-            //        every call.
-
-            // Accept new connections
-            if (m_server_socket.m_handle != INVALID_SOCKET && FD_ISSET(m_server_socket.m_handle, &read_set))
+            u64 const cancel_user = s_uring_user(0, URING_OP_CANCEL);
+            for (u32 i = 0; i < m_max_open; ++i)
             {
-                // We're not looping here, and accepting just one connection at
-                // a time. The reason is that eCos does not respect non-blocking
-                // flag on a listening socket and hangs in a loop.
-                connection_t* conn = accept();
-                if (conn != NULL)
+                connection_t* conn = &m_connections[i];
+                if (conn->m_handle != INVALID_SOCKET)
+                    ::shutdown(conn->m_handle, SHUT_RDWR);
+                for (u32 op = URING_OP_CONNECT; op <= URING_OP_SEND; op <<= 1)
                 {
-                    conn->m_last_io_time = current_time;
-                    conn->m_status       = STATUS_ACCEPT_SECURE_RECV;
-                    push_connection(&m_secure_connections, conn);
+                    if ((conn->m_uring_ops & op) != 0)
+                        m_uring.cancel(s_uring_user(i + 1, op), cancel_user);
                 }
             }
+            m_uring.cancel(s_uring_user(0, URING_OP_ACCEPT), cancel_user);
+            if (m_wakeup.valid())
+                m_uring.cancel(s_uring_user(m_max_open + 1, URING_OP_WAKEUP), cancel_user);
+            m_uring.drain(-1);
+            m_uring.exit();
+            g_deallocate_array(m_allocator, m_uring_cqes);
+            m_uring_cqes = nullptr;
+        }
 
-            message_queue_t rcvd_secure_messages;
-            rcvd_secure_messages.init();
-
-            for (u32 i = 0; i < m_open_connections.m_len;)
+        // close all active sockets and free their messages
+        for (u32 i = 0; i < m_max_open; ++i)
+        {
+            connection_t* conn = &m_connections[i];
+            if (conn->m_handle != INVALID_SOCKET)
             {
-                connection_t* conn = m_open_connections.m_array[i];
-
-                // Why only checking connections that are in the CONNECTING state
-                // for exceptions ?
-                // if (status_is(conn->m_status, STATUS_CONNECTING))
-                {
-                    // The socket was in the state of connecting and was added to the write set.
-                    // If it appears in the exception set we will close and remove it.
-                    if (FD_ISSET(conn->m_handle, &excp_set))
-                    {
-                        conn->m_status = STATUS_CLOSE_IMMEDIATELY;
-                    }
-                }
-
-                if (!status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
-                {
-                    if (FD_ISSET(conn->m_handle, &read_set))
-                    {
-                        conn->m_last_io_time = current_time;
-
-                        s32 status = 1;
-                        while (status > 0)
-                        {
-                            if (conn->m_message_read == NULL)
-                            {
-                                alloc_msg(conn->m_message_read);
-                            }
-
-                            message_t* rcvd_msg = NULL;
-                            status              = conn->m_message_reader.read(conn->m_message_read, rcvd_msg);
-
-                            if (rcvd_msg != NULL)
-                            {
-                                message_node_t* rcvd_node = msg_to_node(rcvd_msg);
-                                rcvd_node->m_remote       = conn->m_address;
-                                if (status_is(conn->m_status, STATUS_SECURE))
-                                {
-                                    if (status_is(conn->m_status, STATUS_SECURE_RECV))
-                                    {
-                                        binary_reader_t msg_reader = rcvd_msg->get_reader();
-                                        sockid_t        sockid;
-                                        buffer_t        sockid_buffer = sockid.buffer();
-                                        msg_reader.read_data(sockid_buffer);
-
-                                        // Search this ID in our database, if no address found create one
-                                        // and add it to the database.
-                                        // If found compare the netip in the entry with the netip received.
-
-                                        if (status_is(conn->m_status, STATUS_ACCEPT_SECURE_RECV))
-                                        {
-                                            // This is an incoming connection and we have received a secure
-                                            // message. Send one back with our own information to conclude
-                                            // the secure handshake.
-                                            send_secure_msg(conn);
-                                            conn->m_status = status_clear(conn->m_status, STATUS_SECURE_RECV);
-                                            conn->m_status = status_set(conn->m_status, STATUS_SECURE_SEND);
-                                        }
-                                    }
-                                    else
-                                    {
-                                        // Something is wrong
-                                        conn->m_status = STATUS_CLOSE_IMMEDIATELY;
-                                    }
-                                }
-                                else
-                                {
-                                    m_received_messages.push(rcvd_node);
-                                }
-                            }
-                        }
-                    }
-
-                    if (FD_ISSET(conn->m_handle, &write_set))
-                    {
-                        conn->m_last_io_time = current_time;
-
-                        if (status_is(conn->m_status, STATUS_CONNECTING))
-                        {
-                            // Connected !
-                            conn->m_status = status_clear(conn->m_status, STATUS_CONNECTING);
-                            conn->m_status = status_set(conn->m_status, STATUS_CONNECTED);
-
-                            // Is this a SECURE connection
-                            if (status_is(conn->m_status, STATUS_SECURE))
-                            {
-                                send_secure_msg(conn);
-                            }
-                        }
-
-                        s32        status;
-                        message_t* msg_that_was_send;
-                        while ((status = conn->m_message_writer.write(msg_that_was_send)) > 0)
-                        {
-                            if (msg_that_was_send != NULL)
-                                free_msg(msg_that_was_send);
-                        }
-
-                        if (status_is(conn->m_status, STATUS_SECURE_SEND))
-                        {
-                            if (conn->m_message_queue.empty())
-                            {
-                                if (status_is(conn->m_status, STATUS_SECURE | STATUS_CONNECT))
-                                {
-                                    conn->m_status = status_clear(conn->m_status, STATUS_SECURE_SEND);
-                                    conn->m_status = status_set(conn->m_status, STATUS_SECURE_RECV);
-                                }
-                                else if (status_is(conn->m_status, STATUS_SECURE | STATUS_ACCEPT))
-                                {
-                                    // Connection has been secured
-                                    conn->m_status = status_clear(conn->m_status, STATUS_SECURE_SEND);
-                                    conn->m_status = status_set(conn->m_status, STATUS_CONNECTED);
-                                }
-                            }
-                        }
-
-                        if (status < 0)
-                        {
-                            conn->m_status = status_set(conn->m_status, STATUS_CLOSE_IMMEDIATELY);
-                        }
-                    }
-                }
+                ::close(conn->m_handle);
+                conn->m_handle = INVALID_SOCKET;
             }
+            conn->m_message_writer.reset();
+            conn->m_message_reader.reset();
+            detach_recv_buffer(conn);
+            message_node_t* pending;
+            while ((pending = conn->m_pending.pop()) != NULL)
+                m_message_pool.free_local(node_to_msg(pending));
         }
 
-        // Check connection states that are in-active or in a non connected state
-        tick_t current_time = getTime();
-        for (u32 i = 0; i < m_open_connections.m_len;)
+        // close server socket
+        if (m_server_socket.m_handle != INVALID_SOCKET)
         {
-            connection_t* conn = m_open_connections.m_array[i];
+            ::close(m_server_socket.m_handle);
+            m_server_socket.m_handle = INVALID_SOCKET;
+        }
 
-            tick_t timeout = millisecondsToTicks(1000);
-            if (!status_is(conn->m_status, STATUS_CONNECTED) && ((conn->m_last_io_time + timeout) > current_time))
-            {
-                // This connection seems 'frozen', close it
-                conn->m_status = STATUS_CLOSE_IMMEDIATELY;
-            }
+        // free all messages
+        message_node_t* node;
+        while ((node = m_received_messages.pop()) != NULL)
+            m_message_pool.free_local(node_to_msg(node));
+        while ((node = m_forwarded_messages.pop()) != NULL)
+            m_message_pool.free_local(node_to_msg(node));
+        for (u32 i = 0; i < m_num_recv_rings; ++i)
+        {
+            while ((node = m_recv_rings[i].pop()) != NULL)
+                m_message_pool.free_local(node_to_msg(node));
+            while ((node = m_recv_overflow[i].pop()) != NULL)
+                m_message_pool.free_local(node_to_msg(node));
+            m_recv_rings[i].exit(m_allocator);
+        }
+        if (m_num_recv_rings > 0)
+        {
+            g_deallocate_array(m_allocator, m_recv_overflow);
+            g_deallocate_array(m_allocator, m_recv_rings);
+            m_recv_overflow  = nullptr;
+            m_recv_rings     = nullptr;
+            m_num_recv_rings = 0;
         }
 
-        // for all open sockets add their addresses to 'open_connections'
-        // Every X seconds build a pex message and send it to the next open connection
+        if (!m_use_uring)
+        {
+            m_poller.exit();
+            g_deallocate_array(m_allocator, m_poll_events);
+            m_poll_events = nullptr;
+        }
+        m_wakeup.exit();
+        m_timers.clear();
+        s_exit_tickets(m_allocator, &m_server_tickets);
+        s_exit_tickets(m_allocator, &m_client_tickets);
+        s_exit_addresses(m_allocator, &m_secured);
+        s_exit_addresses(m_allocator, &m_drained);
+        s_exit_addresses(m_allocator, &m_to_disconnect);
+        s_exit_addresses(m_allocator, &m_to_connect);
+        s_exit_connections(m_allocator, &m_backlog_connections);
+        s_exit_connections(m_allocator, &m_close_connections);
+        s_exit_connections(m_allocator, &m_open_connections);
+        s_exit_connections(m_allocator, &m_secure_connections);
+        s_exit_connections(m_allocator, &m_free_connections);
+        while (m_num_free_recv_buffers > 0)
+            g_deallocate_array(m_allocator, m_free_recv_buffers[--m_num_free_recv_buffers]);
+        g_deallocate_array(m_allocator, m_free_recv_buffers);
+        g_deallocate_array(m_allocator, m_connections);
+        m_free_recv_buffers = nullptr;
+        m_connections       = nullptr;
+        m_message_pool.exit();
     }
 
-    void socket_tcp_t::connect(address_t* a) { push_address(&m_to_connect, a); }
-    void socket_tcp_t::disconnect(address_t* a) { push_address(&m_to_disconnect, a); }
-
-    bool socket_tcp_t::alloc_msg(message_t*& msg)
+    bool socket_tcp_t::accept(connection_t*& c)
     {
-        msg = NULL;
-        return false;
-    }
+        c = NULL;
 
-    void socket_tcp_t::commit_msg(message_t* msg)
-    {
-        // commit the now actual used message size
-    }
+        socket_address sa;
+        socklen_t      len = sizeof(sa);
+
+        // NOTE: on Windows, sock is always > FD_SETSIZE
+        sd_t sock = ::accept(m_server_socket.m_handle, &sa.sa, &len);
+        if (sock == INVALID_SOCKET)
+            return false;
+
+        if (!pop_connection(&m_free_connections, c))
+        {
+            ::close(sock);
+            c = NULL;
+        }
+        else
+        {
+            s_init(c, this);
+            s_set_blocking_mode(sock, true);
+            c->m_parent       = this;
+            c->m_handle       = sock;
+            c->m_address      = NULL;
+            c->m_sockaddr_len = len;
+            memcpy(&c->m_sockaddr, &sa, len);
+            c->m_status = STATUS_ACCEPT_SECURE_RECV;
+        }
+        return true;
+    }
+
+    // Our ID, address details and features, the start of a secure message
+    void socket_tcp_t::write_identity(binary_writer_t& writer, u32 features)
+    {
+        writer.write_data(m_sockid.buffer());
+        byte     netip_data[netip_t::SERIALIZE_SIZE];
+        buffer_t netip(netip_data, netip_data + netip_t::SERIALIZE_SIZE);
+        m_netip.serialize_to(netip);
+        writer.write_data(netip);
+        writer.write(features);
+    }
+
+    void socket_tcp_t::send_secure_msg(connection_t* conn)
+    {
+        // Create a message with our ID and Address details and send it
+        message_t* secure_msg = m_message_pool.alloc_local(m_sockid.buffer().size() + netip_t::SERIALIZE_SIZE + sizeof(u32) + ncrypto::KEY_SIZE);
+        if (secure_msg == NULL)
+        {
+            schedule_close(conn);
+            return;
+        }
+
+        // A new key for every handshake, its public half goes into the message
+        byte public_key[ncrypto::KEY_SIZE];
+        if (m_config.m_encrypt)
+        {
+            if (!ncrypto::random_bytes(conn->m_channel.m_secret, ncrypto::KEY_SIZE))
+            {
+                m_message_pool.free_local(secure_msg);
+                schedule_close(conn);
+                return;
+            }
+            ncrypto::x25519_public(public_key, conn->m_channel.m_secret);
+        }
+
+        binary_writer_t msg_writer = secure_msg->get_writer();
+        write_identity(msg_writer, s_features(m_config));
+        if (m_config.m_encrypt)
+            msg_writer.write_data(cbuffer_t(public_key, public_key + ncrypto::KEY_SIZE));
+        secure_msg->m_size = msg_writer.size();
+
+        set_msg_lane(secure_msg, SEND_LANE_HIGH);
+        conn->m_message_queue.push(msg_to_node(secure_msg));
+        set_write_interest(conn, true);
+    }
+
+    // Resumes the session of @ticket instead of doing the key exchange. Our public key
+    // goes along, so that the other side can fall back to the full handshake when it
+    // does not accept the ticket.
+    void socket_tcp_t::send_resume_msg(connection_t* conn, ticket_t* ticket)
+    {
+        u32 const  key_size   = m_config.m_encrypt ? ncrypto::KEY_SIZE : 0;
+        message_t* resume_msg = m_message_pool.alloc_local(m_sockid.buffer().size() + netip_t::SERIALIZE_SIZE + sizeof(u32) + TICKET_ID_SIZE + TICKET_SALT_SIZE + key_size);
+        byte       salt[TICKET_SALT_SIZE];
+        bool       ok = resume_msg != NULL && ncrypto::random_bytes(salt, TICKET_SALT_SIZE);
+        if (ok && m_config.m_encrypt)
+            ok = ncrypto::random_bytes(conn->m_channel.m_secret, ncrypto::KEY_SIZE);
+        if (!ok)
+        {
+            if (resume_msg != NULL)
+                m_message_pool.free_local(resume_msg);
+            schedule_close(conn);
+            return;
+        }
+
+        conn->m_peer_id  = ticket->m_sockid;
+        conn->m_features = ticket->m_features;
+        conn->m_status   = status_set(conn->m_status, STATUS_SECURE_RESUME);
+        if ((conn->m_features & FEATURE_ENCRYPTION) != 0)
+            resume_keys(conn, ticket->m_secret, salt);
+
+        binary_writer_t msg_writer = resume_msg->get_writer();
+        write_identity(msg_writer, conn->m_features | HANDSHAKE_RESUME);
+        msg_writer.write_data(cbuffer_t(ticket->m_id, ticket->m_id + TICKET_ID_SIZE));
+        msg_writer.write_data(cbuffer_t(salt, salt + TICKET_SALT_SIZE));
+        if (m_config.m_encrypt)
+        {
+            byte public_key[ncrypto::KEY_SIZE];
+            ncrypto::x25519_public(public_key, conn->m_channel.m_secret);
+            msg_writer.write_data(cbuffer_t(public_key, public_key + ncrypto::KEY_SIZE));
+        }
+        resume_msg->m_size = msg_writer.size();
+
+        // A ticket is used once, the next connect does the full handshake unless this one is renewed
+        s_erase_ticket(ticket);
+
+        set_msg_lane(resume_msg, SEND_LANE_HIGH);
+        conn->m_message_queue.push(msg_to_node(resume_msg));
+        set_write_interest(conn, true);
+    }
+
+    // Answers a resume message whose ticket we accepted
+    void socket_tcp_t::send_resumed_msg(connection_t* conn)
+    {
+        message_t* resumed_msg = m_message_pool.alloc_local(m_sockid.buffer().size() + netip_t::SERIALIZE_SIZE + sizeof(u32));
+        if (resumed_msg == NULL)
+        {
+            schedule_close(conn);
+            return;
+        }
+
+        binary_writer_t msg_writer = resumed_msg->get_writer();
+        write_identity(msg_writer, conn->m_features | HANDSHAKE_RESUME);
+        resumed_msg->m_size = msg_writer.size();
+
+        set_msg_lane(resumed_msg, SEND_LANE_HIGH);
+        conn->m_message_queue.push(msg_to_node(resumed_msg));
+        set_write_interest(conn, true);
+    }
+
+    // Checks the ticket of a resume message and takes over the session it belongs to.
+    // Only the peer that holds the ticket ID uses it up, a replayed message finds nothing.
+    bool socket_tcp_t::on_resume_msg(connection_t* conn, sockid_t const& sockid, message_t* msg, u32 offset)
+    {
+        ticket_t* ticket = s_find_ticket(&m_server_tickets, sockid);
+        if (ticket == NULL || msg->m_size < offset + TICKET_ID_SIZE + TICKET_SALT_SIZE)
+            return false;
+        if (!s_equal(ticket->m_id, msg->m_data + offset, TICKET_ID_SIZE))
+            return false;
+
+        conn->m_peer_id  = sockid;
+        conn->m_features = ticket->m_features;
+        if ((conn->m_features & FEATURE_ENCRYPTION) != 0)
+            resume_keys(conn, ticket->m_secret, msg->m_data + offset + TICKET_ID_SIZE);
+        s_erase_ticket(ticket);
+        return true;
+    }
+
+    // Issues a ticket to the peer of a connection that we accepted. Without encryption
+    // its secret is not used.
+    void socket_tcp_t::send_ticket_msg(connection_t* conn)
+    {
+        message_t* ticket_msg = m_message_pool.alloc_local(TICKET_MSG_SIZE);
+        if (ticket_msg == NULL)
+            return;
+
+        ticket_t* ticket = s_store_ticket(&m_server_tickets, conn->m_peer_id);
+        if (!ncrypto::random_bytes(ticket->m_id, TICKET_ID_SIZE) || !ncrypto::random_bytes(ticket->m_secret, ncrypto::KEY_SIZE))
+        {
+            s_erase_ticket(ticket);
+            m_message_pool.free_local(ticket_msg);
+            return;
+        }
+        ticket->m_features = conn->m_features;
+
+        g_memcpy(ticket_msg->m_data, ticket->m_id, TICKET_ID_SIZE);
+        g_memcpy(ticket_msg->m_data + TICKET_ID_SIZE, ticket->m_secret, ncrypto::KEY_SIZE);
+        g_memcpy(ticket_msg->m_data + TICKET_ID_SIZE + ncrypto::KEY_SIZE, &ticket->m_features, sizeof(u32));
+        ticket_msg->m_size                     = TICKET_MSG_SIZE;
+        msg_to_header(ticket_msg)->m_msg_flags = MSG_FLAG_TICKET;
+        set_msg_lane(ticket_msg, SEND_LANE_HIGH);
+        queue_msg(conn, ticket_msg);
+    }
+
+    // Keeps the ticket that the other side issued for our next connect to it, only
+    // when it is the peer that the address belongs to.
+    void socket_tcp_t::on_ticket_msg(connection_t* conn, message_t* msg)
+    {
+        if (!status_is(conn->m_status, STATUS_CONNECT) || conn->m_address == NULL || msg->m_size != TICKET_MSG_SIZE)
+            return;
+        if (conn->m_address->m_sockid.compare(conn->m_peer_id) != 0)
+            return;
+
+        ticket_t* ticket = s_store_ticket(&m_client_tickets, conn->m_peer_id);
+        if (ticket == NULL)
+            return;
+        g_memcpy(ticket->m_id, msg->m_data, TICKET_ID_SIZE);
+        g_memcpy(ticket->m_secret, msg->m_data + TICKET_ID_SIZE, ncrypto::KEY_SIZE);
+        g_memcpy(&ticket->m_features, msg->m_data + TICKET_ID_SIZE + ncrypto::KEY_SIZE, sizeof(u32));
+        ticket->m_features &= s_features(m_config);
+    }
+
+    void socket_tcp_t::send_keepalive_msg(connection_t* conn)
+    {
+        // Messages that are still queued keep the connection alive as well
+        if (!conn->m_message_queue.empty())
+            return;
+
+        message_t* keepalive_msg = m_message_pool.alloc_local(0);
+        if (keepalive_msg == NULL)
+            return;
+
+        msg_to_header(keepalive_msg)->m_msg_flags = MSG_FLAG_KEEPALIVE;
+        set_msg_lane(keepalive_msg, SEND_LANE_HIGH);
+
+        // An encrypted keepalive is only a tag, anyone on the path could make up a plain one
+        if ((conn->m_features & FEATURE_ENCRYPTION) != 0)
+        {
+            keepalive_msg = seal_msg(conn, keepalive_msg);
+            if (keepalive_msg == NULL)
+                return;
+        }
+        conn->m_message_queue.push(msg_to_node(keepalive_msg));
+        set_write_interest(conn, true);
+    }
+
+    // A connection has a receive buffer from the moment it is registered until it is
+    // closed, the buffers of closed connections are reused before a new one is allocated.
+    bool socket_tcp_t::attach_recv_buffer(connection_t* conn)
+    {
+        if (conn->m_recv_buffer == NULL)
+        {
+            if (m_num_free_recv_buffers > 0)
+                conn->m_recv_buffer = m_free_recv_buffers[--m_num_free_recv_buffers];
+            else
+                conn->m_recv_buffer = g_allocate_array<byte>(m_allocator, message_socket_reader::RECV_BUFFER_SIZE);
+        }
+        return conn->m_recv_buffer != NULL;
+    }
+
+    void socket_tcp_t::detach_recv_buffer(connection_t* conn)
+    {
+        if (conn->m_recv_buffer != NULL)
+        {
+            m_free_recv_buffers[m_num_free_recv_buffers++] = conn->m_recv_buffer;
+            conn->m_recv_buffer                            = NULL;
+        }
+    }
+
+    bool socket_tcp_t::register_connection(connection_t* conn, u32 events)
+    {
+        if (!attach_recv_buffer(conn))
+            return false;
+
+        conn->m_message_reader.init(conn->m_handle, &m_message_pool, conn->m_recv_buffer);
+        conn->m_message_writer.init(conn->m_handle, &conn->m_message_queue, &m_message_pool);
+        conn->m_message_writer.enable_fragments(m_config.m_fragment_size);
+        conn->m_poll_events = events;
+
+        if (m_use_uring)
+        {
+            if (!m_uring.set_file(conn->m_index + 1, conn->m_handle))
+            {
+                detach_recv_buffer(conn);
+                return false;
+            }
+
+            // A connecting socket becomes writable when the connect has completed
+            if (status_is(conn->m_status, STATUS_CONNECTING))
+            {
+                conn->m_uring_ops |= URING_OP_CONNECT;
+                m_uring.poll_write(conn->m_index + 1, s_uring_user(conn->m_index + 1, URING_OP_CONNECT));
+            }
+            else
+            {
+                uring_post_recv(conn);
+            }
+            return true;
+        }
+
+        // Large messages can be send without copying them into the kernel
+        if (m_config.m_zerocopy_threshold > 0 && s_set_zerocopy(conn->m_handle))
+            conn->m_message_writer.enable_zerocopy(m_config.m_zerocopy_threshold);
+
+        if (!m_poller.add(conn->m_handle, conn, events))
+        {
+            detach_recv_buffer(conn);
+            return false;
+        }
+        return true;
+    }
+
+    // Write interest is only armed while the connection has messages queued, the
+    // registration is edge-triggered so re-arming it reports the socket as writable
+    // right away when it has room in its send buffer.
+    // With io_uring there is no readiness, the send is queued directly.
+    void socket_tcp_t::set_write_interest(connection_t* conn, bool write)
+    {
+        if (m_use_uring)
+        {
+            if (write && !status_is(conn->m_status, STATUS_CONNECTING))
+                uring_post_send(conn);
+            return;
+        }
+
+        u32 const events = write ? (POLL_READ | POLL_WRITE) : POLL_READ;
+        if (conn->m_poll_events != events && conn->m_handle != INVALID_SOCKET)
+        {
+            conn->m_poll_events = events;
+            m_poller.mod(conn->m_handle, conn, events);
+        }
+    }
+
+    void socket_tcp_t::schedule_close(connection_t* conn)
+    {
+        if (!status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+        {
+            conn->m_status = status_set(conn->m_status, STATUS_CLOSE_IMMEDIATELY);
+            push_connection(&m_close_connections, conn);
+        }
+    }
+
+    void socket_tcp_t::close_connection(connection_t* conn, addresses_t& closed_connections, addresses_t& failed_connections)
+    {
+        // A connection that was waiting for its reconnect delay has no socket yet
+        if (conn->m_handle != INVALID_SOCKET)
+        {
+            if (m_use_uring)
+                m_uring.clear_file(conn->m_index + 1);
+            else
+                m_poller.rem(conn->m_handle);
+            ::close(conn->m_handle);
+        }
+
+        conn->m_message_writer.reset();
+        conn->m_message_reader.reset();
+        detach_recv_buffer(conn);
+        m_timers.cancel(&conn->m_timer);
+
+        // Messages that were waiting for the handshake are lost like the ones that are queued
+        message_node_t* pending;
+        while ((pending = conn->m_pending.pop()) != NULL)
+            m_message_pool.free_local(node_to_msg(pending));
+
+        if (!remove_connection(&m_open_connections, conn))
+            remove_connection(&m_secure_connections, conn);
+        if (conn->m_backlog != 0)
+            remove_connection(&m_backlog_connections, conn);
+
+        if (conn->m_address != NULL)
+        {
+            // A connection that never got connected is reported as 'failed'
+            if (status_is(conn->m_status, STATUS_CONNECTING))
+                push_address(&failed_connections, conn->m_address);
+            else
+                push_address(&closed_connections, conn->m_address);
+
+            // The next connect to this address backs off when it did not get secured
+            if (status_is(conn->m_status, STATUS_SECURE) && !status_is(conn->m_status, STATUS_CONNECT_WAIT))
+                on_connect_failed(conn->m_address);
+
+            // The address can only be claimed again once it no longer refers to this connection
+            connection_t* expected = conn;
+            natomic::cas(&conn->m_address->m_conn, expected, (connection_t*)NULL);
+        }
+
+        s_init(conn, this);
+        push_connection(&m_free_connections, conn);
+    }
+
+    void socket_tcp_t::on_connected(connection_t* conn)
+    {
+        // Connected !
+        conn->m_status = status_clear(conn->m_status, STATUS_CONNECTING);
+        conn->m_status = status_set(conn->m_status, STATUS_CONNECTED);
+
+        // Is this a SECURE connection, with a ticket from an earlier session it
+        // resumes that session instead.
+        if (status_is(conn->m_status, STATUS_SECURE))
+        {
+            ticket_t* ticket = (conn->m_address != NULL) ? s_find_ticket(&m_client_tickets, conn->m_address->m_sockid) : NULL;
+            if (ticket == NULL)
+                send_secure_msg(conn);
+            else
+                send_resume_msg(conn, ticket);
+        }
+    }
+
+    void socket_tcp_t::on_secured(connection_t* conn)
+    {
+        conn->m_status = status_clear(conn->m_status, STATUS_SECURE | STATUS_SECURE_RECV | STATUS_SECURE_SEND | STATUS_SECURE_RESUME);
+        conn->m_status = status_set(conn->m_status, STATUS_CONNECTED);
+
+        remove_connection(&m_secure_connections, conn);
+        push_connection(&m_open_connections, conn);
+
+        if (conn->m_address != NULL)
+        {
+            conn->m_address->m_connect_delay = 0;
+            push_address(&m_secured, conn->m_address);
+        }
+
+        // From now on the timer tracks the idle timeout and keepalive
+        arm_timer(conn);
+
+        // Messages that were send during the handshake go out first, in the order they were send
+        message_node_t* pending;
+        while ((pending = conn->m_pending.pop()) != NULL)
+            queue_msg(conn, node_to_msg(pending));
+
+        // The other side can skip the key exchange when it connects again
+        if (status_is(conn->m_status, STATUS_ACCEPT) && (conn->m_features & FEATURE_TICKETS) != 0)
+            send_ticket_msg(conn);
+    }
+
+    // A connection has a single timer, during the handshake it is the handshake
+    // deadline, once secured it fires at the earliest of the idle timeout and the
+    // next keepalive. I/O does not touch the timer, when it fires early because
+    // there has been I/O in the meantime it is simply re-armed.
+    void socket_tcp_t::arm_timer(connection_t* conn)
+    {
+        tick_t expire = 0;
+        if (status_is(conn->m_status, STATUS_SECURE))
+        {
+            if (m_config.m_handshake_timeout_ms > 0)
+                expire = conn->m_last_recv_time + millisecondsToTicks(m_config.m_handshake_timeout_ms);
+        }
+        else
+        {
+            if (m_config.m_idle_timeout_ms > 0)
+                expire = conn->m_last_recv_time + millisecondsToTicks(m_config.m_idle_timeout_ms);
+            if (m_config.m_keepalive_ms > 0)
+            {
+                tick_t const keepalive = conn->m_last_send_time + millisecondsToTicks(m_config.m_keepalive_ms);
+                if (expire == 0 || keepalive < expire)
+                    expire = keepalive;
+            }
+        }
+
+        if (expire != 0)
+            m_timers.schedule(&conn->m_timer, expire);
+        else
+            m_timers.cancel(&conn->m_timer);
+    }
+
+    void socket_tcp_t::on_timer(connection_t* conn, tick_t current_time)
+    {
+        if (status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+            return;
+
+        if (status_is(conn->m_status, STATUS_CONNECT_WAIT))
+        {
+            connect_socket(conn, current_time);
+            return;
+        }
+
+        // The handshake did not complete in time, or the remote has been silent for too long
+        if (status_is(conn->m_status, STATUS_SECURE) || (m_config.m_idle_timeout_ms > 0 && current_time >= conn->m_last_recv_time + millisecondsToTicks(m_config.m_idle_timeout_ms)))
+        {
+            schedule_close(conn);
+            return;
+        }
+
+        if (m_config.m_keepalive_ms > 0 && current_time >= conn->m_last_send_time + millisecondsToTicks(m_config.m_keepalive_ms))
+        {
+            send_keepalive_msg(conn);
+            conn->m_last_send_time = current_time;
+        }
+
+        arm_timer(conn);
+    }
+
+    // Returns false when the connection should be closed
+    bool socket_tcp_t::on_message(connection_t* conn, message_t* rcvd_msg)
+    {
+        message_node_t* rcvd_node = msg_to_node(rcvd_msg);
+        rcvd_node->m_remote       = conn->m_address;
+
+        // Keepalives have done their job by arriving, on an encrypted connection only
+        // when they have been sealed by the peer.
+        if ((msg_to_header(rcvd_msg)->m_msg_flags & MSG_FLAG_KEEPALIVE) != 0)
+        {
+            bool const valid = (conn->m_features & FEATURE_ENCRYPTION) == 0 || open_msg(conn, rcvd_msg);
+            m_message_pool.free_local(rcvd_msg);
+            if (!valid)
+            {
+                schedule_close(conn);
+                return false;
+            }
+            return true;
+        }
+
+        if (status_is(conn->m_status, STATUS_SECURE))
+        {
+            if (status_is(conn->m_status, STATUS_SECURE_RECV))
+            {
+                binary_reader_t msg_reader = rcvd_msg->get_reader();
+                sockid_t        sockid;
+                buffer_t        sockid_buffer = sockid.buffer();
+                msg_reader.read_data(sockid_buffer);
+
+                // A peer that does not announce any features sends a shorter message
+                u32 const features_offset = sockid_buffer.size() + netip_t::SERIALIZE_SIZE;
+                u32       features        = 0;
+                if (rcvd_msg->m_size >= features_offset + sizeof(u32))
+                    g_memcpy(&features, rcvd_msg->m_data + features_offset, sizeof(u32));
+
+                // A peer that reconnects with a ticket, when we do not accept it the public
+                // key that follows the ticket is used for the full handshake.
+                u32 key_offset = features_offset + sizeof(u32);
+                if ((features & HANDSHAKE_RESUME) != 0)
+                {
+                    if (status_is(conn->m_status, STATUS_ACCEPT_SECURE_RECV))
+                    {
+                        if (on_resume_msg(conn, sockid, rcvd_msg, key_offset))
+                        {
+                            m_message_pool.free_local(rcvd_msg);
+                            send_resumed_msg(conn);
+                            conn->m_status = status_clear(conn->m_status, STATUS_SECURE_RECV);
+                            conn->m_status = status_set(conn->m_status, STATUS_SECURE_SEND);
+                            return true;
+                        }
+                        key_offset += TICKET_ID_SIZE + TICKET_SALT_SIZE;
+                    }
+                    else
+                    {
+                        // The answer to our resume message, the ticket has been accepted
+                        bool const resumed = status_is(conn->m_status, STATUS_SECURE_RESUME) && sockid.compare(conn->m_peer_id) == 0;
+                        m_message_pool.free_local(rcvd_msg);
+                        if (!resumed)
+                        {
+                            schedule_close(conn);
+                            return false;
+                        }
+                        g_memset(conn->m_channel.m_secret, 0, sizeof(conn->m_channel.m_secret));
+                        on_secured(conn);
+                        return true;
+                    }
+                }
+                conn->m_features = features & s_features(m_config);
+                conn->m_peer_id  = sockid;
+
+                // With encryption enabled a peer without it is not accepted, its public key
+                // follows the features.
+                bool const  encrypt  = (conn->m_features & FEATURE_ENCRYPTION) != 0;
+                byte const* peer_key = rcvd_msg->m_data + key_offset;
+                bool        accepted = encrypt == m_config.m_encrypt;
+                if (encrypt && rcvd_msg->m_size < key_offset + ncrypto::KEY_SIZE)
+                    accepted = false;
+
+                // Search this ID in our database, if no address found create one
+                // and add it to the database.
+                // If found compare the netip in the entry with the netip received.
+
+                bool const accepting = status_is(conn->m_status, STATUS_ACCEPT_SECURE_RECV);
+                if (accepted && accepting)
+                {
+                    // This is an incoming connection and we have received a secure
+                    // message. Send one back with our own information to conclude
+                    // the secure handshake.
+                    send_secure_msg(conn);
+                    conn->m_status = status_clear(conn->m_status, STATUS_SECURE_RECV);
+                    conn->m_status = status_set(conn->m_status, STATUS_SECURE_SEND);
+                }
+                if (accepted && encrypt)
+                    accepted = derive_keys(conn, peer_key);
+                m_message_pool.free_local(rcvd_msg);
+
+                if (!accepted)
+                {
+                    schedule_close(conn);
+                    return false;
+                }
+                if (!accepting)
+                {
+                    // This is the answer to the secure message we have send, the
+                    // handshake is complete.
+                    on_secured(conn);
+                }
+            }
+            else
+            {
+                // Something is wrong
+                m_message_pool.free_local(rcvd_msg);
+                schedule_close(conn);
+                return false;
+            }
+        }
+        else
+        {
+            if ((conn->m_features & FEATURE_ENCRYPTION) != 0 && !open_msg(conn, rcvd_msg))
+            {
+                m_message_pool.free_local(rcvd_msg);
+                schedule_close(conn);
+                return false;
+            }
+            if ((msg_to_header(rcvd_msg)->m_msg_flags & MSG_FLAG_COMPRESSED) != 0)
+            {
+                message_t* unpacked = decompress_msg(rcvd_msg);
+                m_message_pool.free_local(rcvd_msg);
+                if (unpacked == NULL)
+                {
+                    schedule_close(conn);
+                    return false;
+                }
+                rcvd_node = msg_to_node(unpacked);
+            }
+            if ((msg_to_header(node_to_msg(rcvd_node))->m_msg_flags & MSG_FLAG_TICKET) != 0)
+            {
+                message_t* ticket_msg = node_to_msg(rcvd_node);
+                on_ticket_msg(conn, ticket_msg);
+                g_memset(ticket_msg->m_data, 0, ticket_msg->m_size);
+                m_message_pool.free_local(ticket_msg);
+                return true;
+            }
+            deliver_msg(conn, rcvd_node);
+        }
+        return true;
+    }
+
+    // A compressed copy of @msg, NULL when it is not worth it. Messages with segments
+    // and references from a broadcast are send as they are.
+    message_t* socket_tcp_t::compress_msg(message_t* msg)
+    {
+        message_node_t* node = msg_to_node(msg);
+        if (msg->m_size < m_config.m_compress_min_size || msg->m_size <= 2 * sizeof(u32) || node->m_segments != NULL || node->m_shared != NULL)
+            return NULL;
+
+        // The result has to be smaller than the message including the original size
+        message_t* packed = m_message_pool.alloc_local(msg->m_size);
+        if (packed == NULL)
+            return NULL;
+        u32 const size = nlz::compress(msg->m_data, msg->m_size, packed->m_data + sizeof(u32), msg->m_size - sizeof(u32) - 1, m_lz_table);
+        if (size == 0)
+        {
+            m_message_pool.free_local(packed);
+            return NULL;
+        }
+
+        g_memcpy(packed->m_data, &msg->m_size, sizeof(u32));
+        packed->m_size                     = size + sizeof(u32);
+        msg_to_header(packed)->m_msg_flags = msg_to_header(msg)->m_msg_flags | MSG_FLAG_COMPRESSED;
+        return packed;
+    }
+
+    // Both sides derive a key per direction from the X25519 shared secret
+    bool socket_tcp_t::derive_keys(connection_t* conn, byte const* peer_key)
+    {
+        channel_t& channel = conn->m_channel;
+        byte       shared[ncrypto::KEY_SIZE];
+        bool const valid = ncrypto::x25519(shared, channel.m_secret, peer_key);
+        if (valid)
+            s_channel_keys(channel, shared, status_is(conn->m_status, STATUS_CONNECT));
+        g_memset(shared, 0, sizeof(shared));
+        g_memset(channel.m_secret, 0, sizeof(channel.m_secret));
+        return valid;
+    }
+
+    // A resumed session derives its keys from the secret of the ticket and the salt of the resume message
+    void socket_tcp_t::resume_keys(connection_t* conn, byte const* secret, byte const* salt)
+    {
+        byte master[ncrypto::KEY_SIZE];
+        ncrypto::hchacha20(master, secret, salt);
+        s_channel_keys(conn->m_channel, master, status_is(conn->m_status, STATUS_CONNECT));
+        g_memset(master, 0, sizeof(master));
+    }
+
+    // Encrypts @msg in place and adds the tag, a message that cannot be changed in place
+    // (a broadcast reference or one with segments) is copied first. Returns NULL when it
+    // could not be sealed, @msg has been freed then.
+    message_t* socket_tcp_t::seal_msg(connection_t* conn, message_t* msg)
+    {
+        message_node_t* node = msg_to_node(msg);
+        if (node->m_shared != NULL || node->m_segments != NULL)
+        {
+            message_node_t* payload_node = (node->m_shared != NULL) ? node->m_shared : node;
+            message_t*      copy         = m_message_pool.alloc_local(get_msg_frame_size(node) - sizeof(message_header_t) + ncrypto::TAG_SIZE);
+            if (copy != NULL)
+            {
+                message_t const* payload = node_to_msg(payload_node);
+                g_memcpy(copy->m_data, payload->m_data, payload->m_size);
+                copy->m_size = payload->m_size;
+                for (message_segment_t const* seg = payload_node->m_segments; seg != NULL; seg = seg->m_next)
+                {
+                    g_memcpy(copy->m_data + copy->m_size, seg->m_data, seg->m_size);
+                    copy->m_size += seg->m_size;
+                }
+                msg_to_header(copy)->m_msg_flags = msg_to_header(msg)->m_msg_flags;
+            }
+            m_message_pool.free_local(msg);
+            if (copy == NULL)
+                return NULL;
+            msg = copy;
+        }
+
+        // The flags that change the meaning of the payload are authenticated with it
+        channel_t& channel = conn->m_channel;
+        u32 const  lane    = get_msg_lane(msg_to_node(msg));
+        u32 const  aad     = msg_to_header(msg)->m_msg_flags & (MSG_FLAG_KEEPALIVE | MSG_FLAG_COMPRESSED | MSG_FLAG_TICKET | MSG_FLAG_LANE_MASK);
+        byte       nonce[ncrypto::NONCE_SIZE];
+        s_channel_nonce(nonce, lane, channel.m_send_seq[lane]++);
+
+        byte tag[ncrypto::TAG_SIZE];
+        ncrypto::seal(channel.m_send_key, nonce, (byte const*)&aad, sizeof(aad), msg->m_data, msg->m_size, tag);
+        if (msg->m_size + ncrypto::TAG_SIZE <= msg->m_max)
+        {
+            g_memcpy(msg->m_data + msg->m_size, tag, ncrypto::TAG_SIZE);
+            msg->m_size += ncrypto::TAG_SIZE;
+        }
+        else if (!m_message_pool.append(msg, tag, ncrypto::TAG_SIZE))
+        {
+            m_message_pool.free_local(msg);
+            return NULL;
+        }
+        return msg;
+    }
+
+    // Checks the tag and decrypts @msg in place
+    bool socket_tcp_t::open_msg(connection_t* conn, message_t* msg)
+    {
+        if (msg->m_size < ncrypto::TAG_SIZE)
+            return false;
+
+        channel_t& channel = conn->m_channel;
+        u32 const  lane    = get_msg_lane(msg_to_node(msg));
+        u32 const  aad     = msg_to_header(msg)->m_msg_flags & (MSG_FLAG_KEEPALIVE | MSG_FLAG_COMPRESSED | MSG_FLAG_TICKET | MSG_FLAG_LANE_MASK);
+        byte       nonce[ncrypto::NONCE_SIZE];
+        s_channel_nonce(nonce, lane, channel.m_recv_seq[lane]++);
+
+        msg->m_size -= ncrypto::TAG_SIZE;
+        return ncrypto::open(channel.m_recv_key, nonce, (byte const*)&aad, sizeof(aad), msg->m_data, msg->m_size, msg->m_data + msg->m_size);
+    }
+
+    // The original of a compressed message, NULL when it is corrupt
+    message_t* socket_tcp_t::decompress_msg(message_t* msg)
+    {
+        u32 size = 0;
+        if (msg->m_size >= sizeof(u32))
+            g_memcpy(&size, msg->m_data, sizeof(u32));
+        if (msg->m_size < sizeof(u32) || size > m_config.m_max_message_size)
+            return NULL;
+
+        message_t* unpacked = m_message_pool.alloc_local(size);
+        if (unpacked == NULL)
+            return NULL;
+        if (!nlz::decompress(msg->m_data + sizeof(u32), msg->m_size - sizeof(u32), unpacked->m_data, size))
+        {
+            m_message_pool.free_local(unpacked);
+            return NULL;
+        }
+
+        unpacked->m_size                     = size;
+        msg_to_header(unpacked)->m_msg_flags = msg_to_header(msg)->m_msg_flags & ~(u32)MSG_FLAG_COMPRESSED;
+        msg_to_node(unpacked)->m_remote      = msg_to_node(msg)->m_remote;
+        return unpacked;
+    }
+
+    void socket_tcp_t::deliver_msg(connection_t* conn, message_node_t* node)
+    {
+        if (m_num_recv_rings == 0)
+        {
+            m_received_messages.push(node);
+            return;
+        }
+
+        // All messages of a connection go to the same ring, behind the ones that
+        // are still waiting for room in it.
+        u32 const ring = conn->m_index % m_num_recv_rings;
+        if (!m_recv_overflow[ring].empty() || !m_recv_rings[ring].push(node))
+        {
+            m_recv_overflow[ring].push(node);
+            m_recv_overflow_count += 1;
+        }
+    }
+
+    void socket_tcp_t::flush_recv_overflow()
+    {
+        if (m_recv_overflow_count == 0)
+            return;
+
+        for (u32 i = 0; i < m_num_recv_rings; ++i)
+        {
+            message_queue_t& overflow = m_recv_overflow[i];
+            while (!overflow.empty() && !m_recv_rings[i].full())
+            {
+                m_recv_rings[i].push(overflow.pop());
+                m_recv_overflow_count -= 1;
+            }
+        }
+    }
+
+    void socket_tcp_t::on_send_queue_empty(connection_t* conn)
+    {
+        if (status_is(conn->m_status, STATUS_SECURE_SEND))
+        {
+            if (status_is(conn->m_status, STATUS_SECURE | STATUS_CONNECT))
+            {
+                conn->m_status = status_clear(conn->m_status, STATUS_SECURE_SEND);
+                conn->m_status = status_set(conn->m_status, STATUS_SECURE_RECV);
+            }
+            else if (status_is(conn->m_status, STATUS_SECURE | STATUS_ACCEPT))
+            {
+                // Connection has been secured
+                on_secured(conn);
+            }
+        }
+    }
+
+    void socket_tcp_t::on_send_queue_drained(connection_t* conn)
+    {
+        if (natomic::load_acquire(&conn->m_send_blocked) == 0 || conn->m_message_queue.bytes() > m_config.m_send_low_watermark)
+            return;
+
+        natomic::store_release(&conn->m_send_blocked, 0);
+        if (conn->m_address != NULL)
+            push_address(&m_drained, conn->m_address);
+    }
+
+    void socket_tcp_t::on_readable(connection_t* conn, s32 quantum, tick_t current_time)
+    {
+        conn->m_last_recv_time = current_time;
+        conn->m_recv_deficit += quantum;
+
+        // Edge-triggered, keep reading until the socket has no more data or the
+        // deficit is used up, the connection then stays on the backlog. The reader
+        // takes the bytes it receives from the deficit, so a large message is
+        // received over several turns.
+        s32 status;
+        do
+        {
+            message_t* rcvd_msg = NULL;
+            status              = conn->m_message_reader.read(rcvd_msg, conn->m_recv_deficit);
+            if (rcvd_msg != NULL && !on_message(conn, rcvd_msg))
+                return;
+        } while (status == 1);
+
+        if (status < 0)
+        {
+            schedule_close(conn);
+        }
+        else if (status == 0)
+        {
+            conn->m_backlog &= ~POLL_READ;
+            conn->m_recv_deficit = 0;
+        }
+    }
+
+    void socket_tcp_t::on_writable(connection_t* conn, s32 quantum, tick_t current_time)
+    {
+        conn->m_last_send_time = current_time;
+        conn->m_send_deficit += quantum;
+
+        // Edge-triggered, the writer keeps writing until the socket cannot take any
+        // more data or the deficit is used up, the connection then stays on the backlog.
+        s32 const status = conn->m_message_writer.write(conn->m_send_deficit);
+        if (status < 0)
+        {
+            schedule_close(conn);
+            return;
+        }
+
+        if (status != 2)
+        {
+            conn->m_backlog &= ~POLL_WRITE;
+            conn->m_send_deficit = 0;
+        }
+
+        on_send_queue_drained(conn);
+        if (conn->m_message_queue.empty())
+        {
+            set_write_interest(conn, false);
+            on_send_queue_empty(conn);
+        }
+    }
+
+    s32 socket_tcp_t::io_quantum() const
+    {
+        s32 const unlimited = 0x40000000;
+        return (m_config.m_io_quantum > 0 && m_config.m_io_quantum < (u32)unlimited) ? (s32)m_config.m_io_quantum : unlimited;
+    }
+
+    // A connection that is readable or writable goes on the backlog, it stays there
+    // until reading and writing would block. Every tick the backlog is served in
+    // deficit round robin order, a connection gets m_io_quantum bytes per direction
+    // and what it goes over (a frame is never cut) is taken from its next turn. So a
+    // peer that is sending or receiving in bulk cannot hold up the others for long.
+    void socket_tcp_t::add_backlog(connection_t* conn, u32 events)
+    {
+        if (conn->m_backlog == 0)
+            push_connection(&m_backlog_connections, conn);
+        conn->m_backlog |= events;
+    }
+
+    void socket_tcp_t::process_backlog(tick_t current_time)
+    {
+        s32 const quantum = io_quantum();
+
+        u32 i = 0;
+        while (i < m_backlog_connections.m_len)
+        {
+            connection_t* conn = m_backlog_connections.m_array[i];
+
+            if ((conn->m_backlog & POLL_READ) != 0)
+                on_readable(conn, quantum, current_time);
+            if ((conn->m_backlog & POLL_WRITE) != 0 && !status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+                on_writable(conn, quantum, current_time);
+
+            if (conn->m_backlog != 0 && !status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+            {
+                i += 1;
+                continue;
+            }
+
+            conn->m_backlog = 0;
+            m_backlog_connections.m_len -= 1;
+            m_backlog_connections.m_array[i] = m_backlog_connections.m_array[m_backlog_connections.m_len];
+        }
+    }
+
+    void socket_tcp_t::process_poll(s32 wait_ms)
+    {
+        // Only the sockets that are ready are returned, so the cost of a tick does
+        // not depend on the number of open connections.
+        s32 const num_events = m_poller.wait(m_poll_events, m_max_open + 2, wait_ms);
+
+        // We might have been waiting for a long time, reset current_time
+        // now to prevent last_io_time being set to the past.
+        tick_t current_time = getTime();
+
+        for (s32 e = 0; e < num_events; ++e)
+        {
+            poll_event_t const& event = m_poll_events[e];
+
+            // @TODO: Handle exceptions of the listening socket, we basically
+            //        have to restart the server when this happens and the user needs
+            //        to know this.
+            //        Restarting should have a time-guard so that we don't try and restart
+            //        every call.
+
+            // Accept new connections
+            if (event.m_user == &m_server_socket)
+            {
+                // The listening socket is edge-triggered, accept until there are
+                // no more pending connections.
+                connection_t* conn;
+                while (accept(conn))
+                {
+                    if (conn != NULL)
+                    {
+                        conn->m_last_recv_time = current_time;
+                        conn->m_last_send_time = current_time;
+                        if (register_connection(conn, POLL_READ))
+                        {
+                            push_connection(&m_secure_connections, conn);
+                            arm_timer(conn);
+                        }
+                        else
+                        {
+                            ::close(conn->m_handle);
+                            s_init(conn, this);
+                            push_connection(&m_free_connections, conn);
+                        }
+                    }
+                }
+                continue;
+            }
+
+            // Requests from other threads are picked up at the start of the next process()
+            if (event.m_user == &m_wakeup)
+            {
+                m_wakeup.drain();
+                continue;
+            }
+
+            connection_t* conn = (connection_t*)event.m_user;
+            if (status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+                continue;
+
+            // Completions of zero-copy sends are reported through the error queue as well,
+            // only a pending error on the socket closes the connection.
+            if ((event.m_events & POLL_ERROR) != 0)
+            {
+                if (m_config.m_zerocopy_threshold != 0 && conn->m_message_writer.zerocopy_enabled())
+                    conn->m_message_writer.reap_zerocopy();
+                if (s_get_socket_error(conn->m_handle) != 0)
+                {
+                    schedule_close(conn);
+                    continue;
+                }
+            }
+
+            // A hang-up is handled by reading, which will drain any remaining
+            // data and report the end of the stream.
+            if ((event.m_events & (POLL_READ | POLL_HANGUP)) != 0)
+            {
+                add_backlog(conn, POLL_READ);
+            }
+
+            if ((event.m_events & POLL_WRITE) != 0 && !status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+            {
+                // A connect that failed also makes the socket writable, select() has no
+                // POLL_ERROR to tell us
+                if (status_is(conn->m_status, STATUS_CONNECTING))
+                {
+                    if (s_get_socket_error(conn->m_handle) != 0)
+                    {
+                        schedule_close(conn);
+                        continue;
+                    }
+                    on_connected(conn);
+                }
+                add_backlog(conn, POLL_WRITE);
+            }
+        }
+
+        process_backlog(current_time);
+    }
+
+    void socket_tcp_t::uring_accept(sd_t sock, tick_t current_time)
+    {
+        connection_t* conn;
+        if (!pop_connection(&m_free_connections, conn))
+        {
+            ::close(sock);
+            return;
+        }
+
+        s_init(conn, this);
+        conn->m_handle       = sock;
+        conn->m_status         = STATUS_ACCEPT_SECURE_RECV;
+        conn->m_last_recv_time = current_time;
+        conn->m_last_send_time = current_time;
+        if (register_connection(conn, POLL_READ))
+        {
+            push_connection(&m_secure_connections, conn);
+            arm_timer(conn);
+        }
+        else
+        {
+            ::close(sock);
+            s_init(conn, this);
+            push_connection(&m_free_connections, conn);
+        }
+    }
+
+    // Receive into the receive buffer, or directly into the message of a large frame,
+    // a receive takes at most m_io_quantum bytes
+    void socket_tcp_t::uring_post_recv(connection_t* conn)
+    {
+        byte* data;
+        u32   size;
+        conn->m_message_reader.next_read(data, size);
+        if (size > (u32)io_quantum())
+            size = (u32)io_quantum();
+        conn->m_uring_ops |= URING_OP_RECV;
+        m_uring.recv(conn->m_index + 1, data, size, s_uring_user(conn->m_index + 1, URING_OP_RECV));
+    }
+
+    // There is at most one send in flight per connection, it is re-posted on completion.
+    // The send gathers as many of the queued messages as the writer can take, up to
+    // m_io_quantum bytes, the kernel then interleaves the sends of the connections.
+    void socket_tcp_t::uring_post_send(connection_t* conn)
+    {
+        if ((conn->m_uring_ops & URING_OP_SEND) != 0)
+            return;
+
+        io_vec_t const* iov;
+        u32 const       count = conn->m_message_writer.next_writev(iov, (u32)io_quantum());
+        if (count > 0)
+        {
+            conn->m_uring_ops |= URING_OP_SEND;
+            m_uring.sendv(conn->m_index + 1, iov, count, s_uring_user(conn->m_index + 1, URING_OP_SEND));
+        }
+    }
+
+    void socket_tcp_t::uring_completion(uring_cqe_t const& cqe, tick_t current_time)
+    {
+        u32 const slot = (u32)(cqe.m_user >> 8);
+        u32 const op   = (u32)(cqe.m_user & 0xFF);
+
+        if (op == URING_OP_ACCEPT)
+        {
+            if (cqe.m_result >= 0)
+                uring_accept(cqe.m_result, current_time);
+            else if (cqe.m_result == -EINVAL)
+                m_uring_multishot = false;  // Kernel does not support multishot accept
+
+            if (!uring_t::has_more(cqe.m_flags))
+                m_uring.accept(0, m_uring_multishot, s_uring_user(0, URING_OP_ACCEPT));
+            return;
+        }
+
+        if (op == URING_OP_WAKEUP)
+        {
+            m_wakeup.drain();
+            m_uring.poll_read(slot, s_uring_user(slot, URING_OP_WAKEUP));
+            return;
+        }
+
+        connection_t* conn = &m_connections[slot - 1];
+        conn->m_uring_ops &= ~op;
+
+        if (status_is(conn->m_status, STATUS_CLOSE_IMMEDIATELY))
+        {
+            // The connection can be closed once the last request has completed, unless
+            // it is still on the close list from before it was shut down.
+            if (conn->m_uring_ops == 0 && status_is(conn->m_status, STATUS_CLOSE_SHUTDOWN))
+                push_connection(&m_close_connections, conn);
+            return;
+        }
+
+        if (op == URING_OP_CONNECT)
+        {
+            if (cqe.m_result < 0 || s_get_socket_error(conn->m_handle) != 0)
+            {
+                schedule_close(conn);
+                return;
+            }
+            conn->m_last_send_time = current_time;
+            on_connected(conn);
+            uring_post_recv(conn);
+            uring_post_send(conn);
+        }
+        else if (op == URING_OP_RECV)
+        {
+            if (cqe.m_result <= 0)
+            {
+                if (cqe.m_result == -EAGAIN || cqe.m_result == -EINTR)
+                    uring_post_recv(conn);
+                else
+                    schedule_close(conn);
+                return;
+            }
+
+            conn->m_last_recv_time = current_time;
+
+            // Handle all the messages that are complete with this receive
+            conn->m_message_reader.commit_read((u32)cqe.m_result);
+
+            s32        status;
+            message_t* rcvd_msg = NULL;
+            while ((status = conn->m_message_reader.next_msg(rcvd_msg)) > 0)
+            {
+                if (!on_message(conn, rcvd_msg))
+                    return;
+            }
+            if (status < 0)
+            {
+                schedule_close(conn);
+                return;
+            }
+
+            uring_post_recv(conn);
+        }
+        else if (op == URING_OP_SEND)
+        {
+            if (cqe.m_result < 0)
+            {
+                if (cqe.m_result == -EAGAIN || cqe.m_result == -EINTR)
+                    uring_post_send(conn);
+                else
+                    schedule_close(conn);
+                return;
+            }
+
+            conn->m_last_send_time = current_time;
+
+            conn->m_message_writer.commit_write((u32)cqe.m_result);
+
+            on_send_queue_drained(conn);
+            if (conn->m_message_queue.empty())
+                on_send_queue_empty(conn);
+            else
+                uring_post_send(conn);
+        }
+    }
+
+    void socket_tcp_t::process_uring(s32 wait_ms)
+    {
+        // All requests that were queued since the previous tick are handed
+        // to the kernel in one system call.
+        if (m_uring.submit(wait_ms) < 0)
+            return;
+
+        tick_t current_time = getTime();
+
+        u32 num_cqes;
+        while ((num_cqes = m_uring.reap(m_uring_cqes, URING_MAX_CQES)) > 0)
+        {
+            for (u32 i = 0; i < num_cqes; ++i)
+            {
+                uring_completion(m_uring_cqes[i], current_time);
+            }
+        }
+    }
+
+    // Wait for I/O at most until the next timer is due. Without a wakeup handle
+    // requests from other threads would have to wait for I/O, then process()
+    // does not block for more than 1 ms.
+    s32 socket_tcp_t::process_wait_ms()
+    {
+        s32 wait_ms = m_config.m_process_wait_ms;
+        if (!m_wakeup.valid() && (wait_ms < 0 || wait_ms > 1))
+            wait_ms = 1;
+
+        // Connections on the backlog still have data to read or write
+        if (m_backlog_connections.m_len > 0)
+            wait_ms = 0;
+
+        // Keep going while messages are waiting for the workers to make room
+        if (m_recv_overflow_count > 0 && (wait_ms < 0 || wait_ms > 1))
+            wait_ms = 1;
+
+        tick_t deadline;
+        if (wait_ms != 0 && m_timers.next_deadline(deadline))
+        {
+            tick_t const now    = getTime();
+            tick_t const one_ms = millisecondsToTicks(1);
+            s32 const    due_ms = (deadline > now) ? (s32)((deadline - now + one_ms - 1) / one_ms) : 0;
+            if (wait_ms < 0 || due_ms < wait_ms)
+                wait_ms = due_ms;
+        }
+        return wait_ms;
+    }
+
+    bool socket_tcp_t::pop_request(addresses_t* requests, address_t*& addr)
+    {
+        natomic::lock(&m_requests_lock);
+        bool const popped = pop_address(requests, addr);
+        natomic::unlock(&m_requests_lock);
+        return popped;
+    }
+
+    void socket_tcp_t::process(addresses_t& open_connections, addresses_t& closed_connections, addresses_t& new_connections, addresses_t& failed_connections, addresses_t& pex_connections, addresses_t& drained_connections)
+    {
+        // Messages that other shards and threads have forwarded to connections owned by us,
+        // the connection might have been closed in the meantime.
+        message_node_t* forwarded;
+        while ((forwarded = m_forwarded_messages.pop()) != NULL)
+        {
+            message_t*    msg  = node_to_msg(forwarded);
+            connection_t* conn = natomic::load_acquire(&forwarded->m_remote->m_conn);
+            if (conn == NULL || conn->m_parent != this || !queue_msg(conn, msg))
+                m_message_pool.free_local(msg);
+        }
+
+        // Received messages that did not fit in the rings of the workers
+        flush_recv_overflow();
+
+        // Non-block connects to remote IP:Port sockets, an address of which the
+        // previous connection failed is connected after a delay.
+        tick_t     current_time = getTime();
+        address_t* remote_addr;
+        while (pop_request(&m_to_connect, remote_addr))
+        {
+            connect_to(remote_addr, current_time, failed_connections);
+        }
+
+        // disconnect() can be called on any shard, only the shard that owns the connection
+        // closes it.
+        while (pop_request(&m_to_disconnect, remote_addr))
+        {
+            connection_t* conn = natomic::load_acquire(&remote_addr->m_conn);
+            if (conn != NULL && conn->m_parent != this)
+            {
+                conn->m_parent->disconnect(remote_addr);
+                continue;
+            }
+            s_drop_held(remote_addr);
+            if (conn != NULL)
+                schedule_close(conn);
+        }
+
+        // process to-secure sockets, send / receive messages on these sockets
+        // process messages for the 'secure' sockets and see if they are now 'secured'
+        // any 'secured' sockets add them to 'open' sockets and add their addresses to 'new_connections'
+
+        // process messages for all other sockets and filter out any 'pex' messages, process them and register the addresses, for any 'new' address
+        // add them to 'connections'.
+        // for any socket that gave an 'error/except-ion' mark them as 'closed', add their addresses to 'closed_connections' and free their messages
+
+        // any other messages add them to the 'recv queue'
+        s32 const wait_ms = process_wait_ms();
+        if (m_use_uring)
+            process_uring(wait_ms);
+        else
+            process_poll(wait_ms);
+
+        // Timers, the cost only depends on the number of timers that expire
+        current_time = getTime();
+        m_timers.advance(current_time);
+
+        wheel_timer_t* timer;
+        while ((timer = m_timers.pop_expired()) != NULL)
+        {
+            if (timer->m_type == TIMER_CONNECTION)
+                on_timer((connection_t*)timer->m_user, current_time);
+        }
+
+        // Close all connections that have been marked for closing
+        connection_t* conn;
+        while (pop_connection(&m_close_connections, conn))
+        {
+            // With io_uring the requests that are still in flight have to complete
+            // first, shutting down the socket makes sure they do.
+            if (m_use_uring && conn->m_uring_ops != 0)
+            {
+                conn->m_status = status_set(conn->m_status, STATUS_CLOSE_SHUTDOWN);
+                ::shutdown(conn->m_handle, SHUT_RDWR);
+                continue;
+            }
+            close_connection(conn, closed_connections, failed_connections);
+        }
+
+        // Connections that have been secured are 'new'
+        while (pop_address(&m_secured, remote_addr))
+        {
+            push_address(&new_connections, remote_addr);
+        }
+
+        // Connections that send_msg() said would block can take messages again
+        while (pop_address(&m_drained, remote_addr))
+        {
+            push_address(&drained_connections, remote_addr);
+        }
+
+        // for all open sockets add their addresses to 'open_connections'
+        // Every X seconds build a pex message and send it to the next open connection
+    }
+
+    void socket_tcp_t::connect_to(address_t* remote_addr, tick_t current_time, addresses_t& failed_connections)
+    {
+        // Already connected, messages that are held on the address go to the connection
+        // on the shard that owns it.
+        connection_t* conn = natomic::load_acquire(&remote_addr->m_conn);
+        if (conn != NULL)
+        {
+            if (conn->m_parent == this)
+                queue_held(conn);
+            else if (natomic::load_acquire(&remote_addr->m_held) != &s_held_closed)
+                conn->m_parent->connect(remote_addr);
+            return;
+        }
+
+        connection_t* c;
+        if (!pop_connection(&m_free_connections, c))
+        {
+            s_drop_held(remote_addr);
+            push_address(&failed_connections, remote_addr);
+            return;
+        }
+
+        s_init(c, this);
+        c->m_address        = remote_addr;
+        c->m_last_recv_time = current_time;
+        c->m_last_send_time = current_time;
+
+        // Shards handle connect() independently, the one that claims the address
+        // opens the connection and owns the reconnect delay of the address.
+        connection_t* expected = NULL;
+        if (!natomic::cas(&remote_addr->m_conn, expected, c))
+        {
+            s_init(c, this);
+            push_connection(&m_free_connections, c);
+            return;
+        }
+        c->m_status = STATUS_CONNECT_SECURE_SEND | STATUS_CONNECTING;
+        push_connection(&m_secure_connections, c);
+        queue_held(c);
+
+        // The previous connection to this address failed, the socket is created by
+        // the timer of the connection once the delay has passed.
+        if (remote_addr->m_connect_delay > 0)
+        {
+            c->m_status = STATUS_CONNECT_SECURE_SEND | STATUS_CONNECTING | STATUS_CONNECT_WAIT;
+            m_timers.schedule(&c->m_timer, current_time + millisecondsToTicks(remote_addr->m_connect_delay));
+            return;
+        }
+        connect_socket(c, current_time);
+    }
+
+    void socket_tcp_t::connect_socket(connection_t* conn, tick_t current_time)
+    {
+        address_t* remote_addr = conn->m_address;
+        conn->m_last_recv_time = current_time;
+        conn->m_last_send_time = current_time;
+
+        char    remote_str_chars[128];
+        runes_t remote_str = make_runes(remote_str_chars, remote_str_chars + sizeof(remote_str_chars) - 1);
+        remote_addr->m_netip.to_string(remote_str, true);
+        bool const created = s_create_socket(make_crunes(remote_str), remote_addr->m_netip.get_port(), CS_OPTION_NOBLOCK, conn) == 0;
+
+        // This connection needs to be secured first, the socket becomes writable
+        // when the non-blocking connect has completed.
+        conn->m_status = STATUS_CONNECT_SECURE_SEND | STATUS_CONNECTING;
+        if (created && register_connection(conn, POLL_READ | POLL_WRITE))
+        {
+            arm_timer(conn);
+            return;
+        }
+
+        // Failed to connect to remote, it is reported as failed when it is closed
+        schedule_close(conn);
+    }
+
+    // Messages that were held on the address of @conn before it was claimed go first
+    void socket_tcp_t::queue_held(connection_t* conn)
+    {
+        message_node_t* held = s_take_held(conn->m_address);
+        while (held != NULL)
+        {
+            message_node_t* next = held->m_next;
+            message_t*      msg  = node_to_msg(held);
+            if (!queue_msg(conn, msg))
+                m_message_pool.free_local(msg);
+            held = next;
+        }
+    }
+
+    void socket_tcp_t::on_connect_failed(address_t* addr)
+    {
+        // Exponential backoff
+        u32 delay = addr->m_connect_delay * 2;
+        if (delay < m_config.m_reconnect_min_ms)
+            delay = m_config.m_reconnect_min_ms;
+        if (delay > m_config.m_reconnect_max_ms)
+            delay = m_config.m_reconnect_max_ms;
+        addr->m_connect_delay = delay;
+    }
+
+    void socket_tcp_t::connect(address_t* a)
+    {
+        s_open_held(a);
+        natomic::lock(&m_requests_lock);
+        push_address(&m_to_connect, a);
+        natomic::unlock(&m_requests_lock);
+        m_wakeup.signal();
+    }
+
+    void socket_tcp_t::disconnect(address_t* a)
+    {
+        natomic::lock(&m_requests_lock);
+        push_address(&m_to_disconnect, a);
+        natomic::unlock(&m_requests_lock);
+        m_wakeup.signal();
+    }
+
+    void socket_tcp_t::wakeup() { m_wakeup.signal(); }
+
+    bool socket_tcp_t::alloc_msg(message_t*& msg)
+    {
+        msg = m_message_pool.alloc(m_config.m_max_message_size);
+        return msg != NULL;
+    }
+
+    bool socket_tcp_t::alloc_msg(message_t*& msg, u32 size)
+    {
+        msg = m_message_pool.alloc(size);
+        return msg != NULL;
+    }
+
+    void socket_tcp_t::commit_msg(message_t*& msg)
+    {
+        // Move the message to the size class that fits the actual size
+        msg = m_message_pool.shrink(msg);
+    }
 
     void socket_tcp_t::free_msg(message_t* msg)
     {
-        // free the message back to the message allocator
+        // Messages always go back to the pool they came from
+        message_pool_t::release(msg);
+    }
+
+    bool socket_tcp_t::append_msg(message_t* msg, byte const* data, u32 size) { return m_message_pool.append(msg, data, size); }
+
+    bool socket_tcp_t::attach_msg(message_t* msg, byte* data, u32 size, message_release_fn release, void* user) { return m_message_pool.attach(msg, data, size, release, user); }
+
+    esend_result socket_tcp_t::send_msg(message_t* msg, address_t* to) { return send_msg(msg, to, SEND_LANE_NORMAL); }
+
+    esend_result socket_tcp_t::send_msg(message_t* msg, address_t* to, esend_lane lane)
+    {
+        // The lane travels with the message, also through the forward queue
+        set_msg_lane(msg, lane);
+
+        // Between connect() and the claim of the address by a shard the message is held
+        // on the address, when it has been claimed in the meantime it goes to the connection.
+        connection_t* conn = natomic::load_acquire(&to->m_conn);
+        if (conn == NULL)
+        {
+            if (s_hold_msg(to, msg, m_config.m_pending_max_size))
+                return SEND_QUEUED;
+            conn = natomic::load_acquire(&to->m_conn);
+            if (conn == NULL)
+                return SEND_FAILED;
+        }
+
+        // Backpressure, the caller should hold on to the message until process() reports
+        // the connection as drained. Messages that are still in the forward queue are not
+        // counted, from another thread the watermark is a soft limit.
+        if (m_config.m_send_high_watermark > 0 && conn->m_message_queue.bytes() >= m_config.m_send_high_watermark)
+        {
+            natomic::store_release(&conn->m_send_blocked, 1);
+            // The owner might have drained the queue before it could see the flag
+            if (conn->m_message_queue.bytes() >= m_config.m_send_high_watermark)
+                return SEND_WOULD_BLOCK;
+        }
+
+        // The connection is owned by another shard, or we might not be on the thread
+        // that calls process(). Hand the message over to the lock-free queue of the
+        // owner, it will be queued on the connection in its next process().
+        if (conn->m_parent != this || m_config.m_thread_safe_send)
+        {
+            message_node_t* msg_hdr = msg_to_node(msg);
+            msg_hdr->m_remote       = to;
+            conn->m_parent->m_forwarded_messages.push(msg_hdr);
+            conn->m_parent->m_wakeup.signal();
+            return SEND_QUEUED;
+        }
+
+        return queue_msg(conn, msg) ? SEND_QUEUED : SEND_FAILED;
     }
 
-    bool socket_tcp_t::send_msg(message_t* msg, address_t* to)
+    bool socket_tcp_t::queue_msg(connection_t* conn, message_t* msg)
     {
-        if (to->m_conn != NULL)
+        // Until the connection is secured a message waits in the pre-connect buffer, it
+        // is queued once the handshake has completed.
+        if (status_is_one_of(conn->m_status, STATUS_CONNECTING | STATUS_SECURE))
+        {
+            message_node_t* msg_hdr = msg_to_node(msg);
+            if (conn->m_pending.bytes() + get_msg_frame_size(msg_hdr) > m_config.m_pending_max_size)
+                return false;
+            conn->m_pending.push(msg_hdr);
+            return true;
+        }
+
+        if (status_is(conn->m_status, STATUS_CONNECTED))
         {
-            if (status_is(to->m_conn->m_status, STATUS_CONNECTED))
+            // Compression trades CPU on both sides for bandwidth
+            if ((conn->m_features & FEATURE_COMPRESSION) != 0)
             {
-                // queue the message up in the to-send queue of the associated connection
-                message_node_t* msg_hdr = msg_to_node(msg);
-                to->m_conn->m_message_queue.push(msg_hdr);
-                return true;
+                message_t* packed = compress_msg(msg);
+                if (packed != NULL)
+                {
+                    m_message_pool.free_local(msg);
+                    msg = packed;
+                }
+            }
+
+            // A message that could not be sealed is lost, like one that is still queued when the connection fails
+            if ((conn->m_features & FEATURE_ENCRYPTION) != 0)
+            {
+                msg = seal_msg(conn, msg);
+                if (msg == NULL)
+                {
+                    schedule_close(conn);
+                    return true;
+                }
             }
+
+            // queue the message up in the to-send queue of the associated connection
+            message_node_t* msg_hdr = msg_to_node(msg);
+            conn->m_message_queue.push(msg_hdr);
+            set_write_interest(conn, true);
+            return true;
         }
         return false;
     }
 
+    u32 socket_tcp_t::broadcast_msg(message_t* msg, addresses_t const& to)
+    {
+        // Every connection queues a reference to the one message, we hold a
+        // reference ourselves until all of them have been handed out.
+        message_pool_t::share(msg, 1);
+
+        u32 sent = 0;
+        for (u32 i = 0; i < to.m_len; ++i)
+        {
+            message_t* ref = m_message_pool.alloc_ref(msg);
+            if (ref == NULL)
+                break;
+            if (send_msg(ref, to.m_array[i]) == SEND_QUEUED)
+                sent += 1;
+            else
+                message_pool_t::release(ref);
+        }
+
+        message_pool_t::release(msg);
+        return sent;
+    }
+
     bool socket_tcp_t::recv_msg(message_t*& msg, address_t*& from)
     {
         // pop any message from the 'recv-queue' until empty
@@ -810,4 +2744,75 @@ namespace ncore
         }
     }
 
+    bool socket_tcp_t::recv_msg(u32 ring, message_t*& msg, address_t*& from)
+    {
+        message_node_t* msg_node = (ring < m_num_recv_rings) ? m_recv_rings[ring].pop() : NULL;
+        if (msg_node == NULL)
+        {
+            from = NULL;
+            msg  = NULL;
+            return false;
+        }
+        from = msg_node->m_remote;
+        msg  = node_to_msg(msg_node);
+        return true;
+    }
+
+    // The payload of a message is touched by the caller right after this, prefetching
+    // it while the rest of the batch is collected hides the cache misses.
+    u32 socket_tcp_t::recv_msgs(received_msg_t* msgs, u32 max_msgs)
+    {
+        u32             n = 0;
+        message_node_t* msg_node;
+        while (n < max_msgs && (msg_node = m_received_messages.pop()) != NULL)
+        {
+            message_t* msg = node_to_msg(msg_node);
+            s_prefetch(msg->m_data);
+            msgs[n].m_msg  = msg;
+            msgs[n].m_from = msg_node->m_remote;
+            n += 1;
+        }
+        return n;
+    }
+
+    u32 socket_tcp_t::recv_msgs(u32 ring, received_msg_t* msgs, u32 max_msgs)
+    {
+        if (ring >= m_num_recv_rings)
+            return 0;
+
+        const u32       BATCH = 64;
+        message_node_t* nodes[BATCH];
+        u32             n = 0;
+        while (n < max_msgs)
+        {
+            u32 const count = m_recv_rings[ring].pop(nodes, (max_msgs - n) < BATCH ? (max_msgs - n) : BATCH);
+            for (u32 i = 0; i < count; ++i)
+            {
+                message_t* msg = node_to_msg(nodes[i]);
+                s_prefetch(msg->m_data);
+                msgs[n].m_msg  = msg;
+                msgs[n].m_from = nodes[i]->m_remote;
+                n += 1;
+            }
+            if (count < BATCH)
+                break;
+        }
+        return n;
+    }
+
+    void socket_tcp_t::free_msgs(received_msg_t const* msgs, u32 count)
+    {
+        const u32  BATCH = 64;
+        message_t* batch[BATCH];
+        while (count > 0)
+        {
+            u32 const n = count < BATCH ? count : BATCH;
+            for (u32 i = 0; i < n; ++i)
+                batch[i] = msgs[i].m_msg;
+            message_pool_t::release(batch, n);
+            msgs += n;
+            count -= n;
+        }
+    }
+
 }  // namespace ncore
@@ -0,0 +1,198 @@
+#include "ccore/c_target.h"
+#include "cbase/c_debug.h"
+
+#include "csocket/private/c_timer_wheel.h"
+
+namespace ncore
+{
+    static inline void s_list_init(wheel_timer_t* head)
+    {
+        head->m_next = head;
+        head->m_prev = head;
+    }
+
+    static inline void s_list_push(wheel_timer_t* head, wheel_timer_t* timer)
+    {
+        timer->m_next         = head;
+        timer->m_prev         = head->m_prev;
+        head->m_prev->m_next  = timer;
+        head->m_prev          = timer;
+    }
+
+    static inline void s_list_unlink(wheel_timer_t* timer)
+    {
+        timer->m_prev->m_next = timer->m_next;
+        timer->m_next->m_prev = timer->m_prev;
+        timer->m_next         = NULL;
+        timer->m_prev         = NULL;
+    }
+
+    timer_wheel_t::timer_wheel_t()
+        : m_resolution(1)
+        , m_now(0)
+        , m_count(0)
+    {
+        init(0, 1);
+    }
+
+    void timer_wheel_t::init(tick_t now, tick_t resolution)
+    {
+        m_resolution = (resolution > 0) ? resolution : 1;
+        m_now        = (u64)now / (u64)m_resolution;
+        m_count      = 0;
+        s_list_init(&m_expired);
+        for (u32 l = 0; l < LEVELS; ++l)
+        {
+            for (u32 s = 0; s < SLOTS; ++s)
+                s_list_init(&m_slots[l][s]);
+        }
+    }
+
+    void timer_wheel_t::clear()
+    {
+        for (u32 l = 0; l < LEVELS; ++l)
+        {
+            for (u32 s = 0; s < SLOTS; ++s)
+            {
+                wheel_timer_t* head = &m_slots[l][s];
+                while (head->m_next != head)
+                    s_list_unlink(head->m_next);
+            }
+        }
+        while (m_expired.m_next != &m_expired)
+            s_list_unlink(m_expired.m_next);
+        m_count = 0;
+    }
+
+    void timer_wheel_t::link(wheel_timer_t* timer)
+    {
+        if (timer->m_expire <= m_now)
+        {
+            s_list_push(&m_expired, timer);
+            return;
+        }
+
+        // The level is the one where the distance to the expiry fits in its range
+        u64 const max_delta = ((u64)1 << (SLOT_BITS * LEVELS)) - 1;
+        u64       delta     = timer->m_expire - m_now;
+        if (delta > max_delta)
+            delta = max_delta;
+
+        u32 level = 0;
+        while (level < (LEVELS - 1) && delta >= ((u64)1 << (SLOT_BITS * (level + 1))))
+            level += 1;
+
+        u64 const expire = m_now + delta;
+        u32 const slot   = (u32)(expire >> (SLOT_BITS * level)) & (SLOTS - 1);
+        s_list_push(&m_slots[level][slot], timer);
+    }
+
+    void timer_wheel_t::schedule(wheel_timer_t* timer, tick_t expire)
+    {
+        if (is_scheduled(timer))
+            s_list_unlink(timer);
+        else
+            m_count += 1;
+
+        timer->m_expire = (expire > 0) ? ((u64)expire + (u64)m_resolution - 1) / (u64)m_resolution : 0;
+        link(timer);
+    }
+
+    void timer_wheel_t::cancel(wheel_timer_t* timer)
+    {
+        if (is_scheduled(timer))
+        {
+            s_list_unlink(timer);
+            m_count -= 1;
+        }
+    }
+
+    // Re-distribute the timers of a slot over the lower levels
+    void timer_wheel_t::cascade(u32 level, u32 slot)
+    {
+        wheel_timer_t* head = &m_slots[level][slot];
+        while (head->m_next != head)
+        {
+            wheel_timer_t* timer = head->m_next;
+            s_list_unlink(timer);
+            link(timer);
+        }
+    }
+
+    void timer_wheel_t::advance(tick_t now)
+    {
+        u64 const target = (u64)now / (u64)m_resolution;
+        if (m_count == 0)
+        {
+            if (target > m_now)
+                m_now = target;
+            return;
+        }
+
+        while (m_now < target)
+        {
+            m_now += 1;
+
+            u64 t = m_now;
+            for (u32 level = 1; level < LEVELS && (t & (SLOTS - 1)) == 0; ++level)
+            {
+                t >>= SLOT_BITS;
+                cascade(level, (u32)(t & (SLOTS - 1)));
+            }
+
+            wheel_timer_t* head = &m_slots[0][m_now & (SLOTS - 1)];
+            while (head->m_next != head)
+            {
+                wheel_timer_t* timer = head->m_next;
+                s_list_unlink(timer);
+                s_list_push(&m_expired, timer);
+            }
+        }
+    }
+
+    bool timer_wheel_t::next_deadline(tick_t& deadline) const
+    {
+        if (m_count == 0)
+            return false;
+
+        if (m_expired.m_next != &m_expired)
+        {
+            deadline = (tick_t)(m_now * (u64)m_resolution);
+            return true;
+        }
+
+        // The first occupied slot of every level, a slot of a higher level is due
+        // when the wheel cascades it.
+        u64 next = 0;
+        for (u32 level = 0; level < LEVELS; ++level)
+        {
+            u32 const shift   = SLOT_BITS * level;
+            u64 const current = m_now >> shift;
+            for (u32 i = 1; i <= SLOTS; ++i)
+            {
+                wheel_timer_t const* head = &m_slots[level][(current + i) & (SLOTS - 1)];
+                if (head->m_next != head)
+                {
+                    u64 const due = (current + i) << shift;
+                    if (next == 0 || due < next)
+                        next = due;
+                    break;
+                }
+            }
+        }
+
+        deadline = (tick_t)(next * (u64)m_resolution);
+        return true;
+    }
+
+    wheel_timer_t* timer_wheel_t::pop_expired()
+    {
+        wheel_timer_t* timer = m_expired.m_next;
+        if (timer == &m_expired)
+            return NULL;
+        s_list_unlink(timer);
+        m_count -= 1;
+        return timer;
+    }
+
+}  // namespace ncore
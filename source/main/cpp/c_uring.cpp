@@ -0,0 +1,449 @@
+#include "ccore/c_target.h"
+#include "cbase/c_allocator.h"
+#include "cbase/c_debug.h"
+#include "cbase/c_memory.h"
+
+#include "csocket/private/c_uring.h"
+
+#if defined(TARGET_LINUX) && !defined(PLATFORM_PC)
+#    include <linux/io_uring.h>  // For io_uring_params, io_uring_sqe and io_uring_cqe
+#    include <poll.h>            // For POLLIN, POLLOUT
+#    include <sys/mman.h>        // For mmap()
+#    include <sys/socket.h>      // For MSG_NOSIGNAL, SOCK_NONBLOCK
+#    include <sys/syscall.h>     // For __NR_io_uring_setup, __NR_io_uring_enter, __NR_io_uring_register
+#    include <time.h>            // For timespec
+#    include <unistd.h>          // For syscall(), close()
+#    include <errno.h>           // For errno
+#endif
+
+namespace ncore
+{
+    uring_t::uring_t()
+        : m_allocator(nullptr)
+        , m_msghdrs(nullptr)
+        , m_max_files(0)
+        , m_in_flight(0)
+        , m_stash(nullptr)
+        , m_stash_pos(0)
+        , m_stash_len(0)
+        , m_stash_cap(0)
+        , m_fd(-1)
+        , m_features(0)
+        , m_sq_ring(nullptr)
+        , m_sq_ring_size(0)
+        , m_cq_ring(nullptr)
+        , m_cq_ring_size(0)
+        , m_sqes(nullptr)
+        , m_sqes_size(0)
+        , m_sq_head(nullptr)
+        , m_sq_tail(nullptr)
+        , m_sq_array(nullptr)
+        , m_sq_mask(0)
+        , m_sq_entries(0)
+        , m_sq_local_tail(0)
+        , m_sq_submitted(0)
+        , m_cq_head(nullptr)
+        , m_cq_tail(nullptr)
+        , m_cqes(nullptr)
+        , m_cq_mask(0)
+    {
+    }
+
+#if defined(TARGET_LINUX) && !defined(PLATFORM_PC)
+
+    bool uring_t::init(alloc_t* allocator, u32 entries, u32 max_files)
+    {
+        struct io_uring_params params;
+        g_memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CLAMP;
+
+        m_fd = (s32)::syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0)
+        {
+            m_fd = -1;
+            return false;
+        }
+
+        // We need to be able to wait with a timeout without queueing a timeout request
+        m_features = params.features;
+        if ((m_features & IORING_FEAT_EXT_ARG) == 0)
+        {
+            exit();
+            return false;
+        }
+
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (m_features & IORING_FEAT_SINGLE_MMAP)
+        {
+            if (m_cq_ring_size > m_sq_ring_size)
+                m_sq_ring_size = m_cq_ring_size;
+            m_cq_ring_size = m_sq_ring_size;
+        }
+
+        m_sq_ring = ::mmap(0, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (m_sq_ring == MAP_FAILED)
+        {
+            m_sq_ring = nullptr;
+            exit();
+            return false;
+        }
+
+        if (m_features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_cq_ring = m_sq_ring;
+        }
+        else
+        {
+            m_cq_ring = ::mmap(0, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cq_ring == MAP_FAILED)
+            {
+                m_cq_ring = nullptr;
+                exit();
+                return false;
+            }
+        }
+
+        m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        m_sqes      = ::mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sqes == MAP_FAILED)
+        {
+            m_sqes = nullptr;
+            exit();
+            return false;
+        }
+
+        byte* sq        = (byte*)m_sq_ring;
+        m_sq_head       = (u32*)(sq + params.sq_off.head);
+        m_sq_tail       = (u32*)(sq + params.sq_off.tail);
+        m_sq_array      = (u32*)(sq + params.sq_off.array);
+        m_sq_mask       = *(u32*)(sq + params.sq_off.ring_mask);
+        m_sq_entries    = *(u32*)(sq + params.sq_off.ring_entries);
+        m_sq_local_tail = *m_sq_tail;
+        m_sq_submitted  = m_sq_local_tail;
+
+        byte* cq  = (byte*)m_cq_ring;
+        m_cq_head = (u32*)(cq + params.cq_off.head);
+        m_cq_tail = (u32*)(cq + params.cq_off.tail);
+        m_cqes    = (void*)(cq + params.cq_off.cqes);
+        m_cq_mask = *(u32*)(cq + params.cq_off.ring_mask);
+
+        // Register a sparse table of fixed files, slots are filled with set_file()
+        s32* fds = (s32*)allocator->allocate(sizeof(s32) * max_files, sizeof(s32));
+        for (u32 i = 0; i < max_files; ++i)
+            fds[i] = -1;
+        s32 const result = (s32)::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES, fds, max_files);
+        allocator->deallocate(fds);
+        if (result < 0)
+        {
+            exit();
+            return false;
+        }
+
+        m_allocator = allocator;
+        m_max_files = max_files;
+        m_msghdrs   = allocator->allocate(sizeof(struct msghdr) * max_files, sizeof(void*));
+        g_memset(m_msghdrs, 0, sizeof(struct msghdr) * max_files);
+        return true;
+    }
+
+    void uring_t::exit()
+    {
+        if (m_sqes != nullptr)
+            ::munmap(m_sqes, m_sqes_size);
+        if (m_cq_ring != nullptr && m_cq_ring != m_sq_ring)
+            ::munmap(m_cq_ring, m_cq_ring_size);
+        if (m_sq_ring != nullptr)
+            ::munmap(m_sq_ring, m_sq_ring_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        if (m_msghdrs != nullptr)
+            m_allocator->deallocate(m_msghdrs);
+        if (m_stash != nullptr)
+            m_allocator->deallocate(m_stash);
+
+        m_msghdrs   = nullptr;
+        m_in_flight = 0;
+        m_stash     = nullptr;
+        m_stash_pos = 0;
+        m_stash_len = 0;
+        m_stash_cap = 0;
+        m_fd      = -1;
+        m_sqes    = nullptr;
+        m_cq_ring = nullptr;
+        m_sq_ring = nullptr;
+    }
+
+    bool uring_t::set_file(u32 index, sd_t sock)
+    {
+        s32                          fd = sock;
+        struct io_uring_files_update update;
+        g_memset(&update, 0, sizeof(update));
+        update.offset = index;
+        update.fds    = (u64)(ptr_t)&fd;
+        return ::syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+    bool uring_t::clear_file(u32 index) { return set_file(index, -1); }
+
+    void* uring_t::get_sqe()
+    {
+        // When the submission ring is full, hand what we have to the kernel. A slot is
+        // only reused once the kernel has consumed it, the kernel refuses to take more
+        // (EBUSY) while its completions do not fit in the completion ring. Those are
+        // moved aside, reap() returns them before the ones still in the ring.
+        while ((m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE)) >= m_sq_entries)
+        {
+            s32 const n = enter(m_sq_local_tail - m_sq_submitted, 0, 0);
+            if (n < 0)
+                return nullptr;
+            if (n == 0)
+                stash();
+        }
+
+        u32 const            index = m_sq_local_tail & m_sq_mask;
+        struct io_uring_sqe* sqe   = (struct io_uring_sqe*)m_sqes + index;
+        g_memset(sqe, 0, sizeof(struct io_uring_sqe));
+        m_sq_array[index] = index;
+        m_sq_local_tail += 1;
+        m_in_flight += 1;
+        return sqe;
+    }
+
+    void uring_t::stash()
+    {
+        u32       head = *m_cq_head;
+        u32 const tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            return;
+
+        if (m_stash_len + (tail - head) > m_stash_cap)
+        {
+            u32 cap = m_stash_cap == 0 ? 2 * m_sq_entries : m_stash_cap;
+            while (cap < m_stash_len + (tail - head))
+                cap *= 2;
+            uring_cqe_t* stash = (uring_cqe_t*)m_allocator->allocate(sizeof(uring_cqe_t) * cap, sizeof(u64));
+            if (m_stash != nullptr)
+            {
+                g_memcpy(stash, m_stash, sizeof(uring_cqe_t) * m_stash_len);
+                m_allocator->deallocate(m_stash);
+            }
+            m_stash     = stash;
+            m_stash_cap = cap;
+        }
+
+        while (head != tail)
+        {
+            struct io_uring_cqe const* cqe = (struct io_uring_cqe const*)m_cqes + (head & m_cq_mask);
+            uring_cqe_t&               out = m_stash[m_stash_len++];
+            out.m_user                     = cqe->user_data;
+            out.m_result                   = cqe->res;
+            out.m_flags                    = cqe->flags;
+            if (!has_more(cqe->flags))
+                m_in_flight -= 1;
+            head += 1;
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    void uring_t::accept(u32 index, bool multishot, u64 user)
+    {
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_ACCEPT;
+        sqe->flags               = IOSQE_FIXED_FILE;
+        sqe->fd                  = (s32)index;
+        sqe->accept_flags        = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->ioprio              = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+        sqe->user_data           = user;
+    }
+
+    void uring_t::poll_read(u32 index, u64 user)
+    {
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_POLL_ADD;
+        sqe->flags               = IOSQE_FIXED_FILE;
+        sqe->fd                  = (s32)index;
+        sqe->poll32_events       = POLLIN;
+        sqe->user_data           = user;
+    }
+
+    void uring_t::poll_write(u32 index, u64 user)
+    {
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_POLL_ADD;
+        sqe->flags               = IOSQE_FIXED_FILE;
+        sqe->fd                  = (s32)index;
+        sqe->poll32_events       = POLLOUT;
+        sqe->user_data           = user;
+    }
+
+    void uring_t::recv(u32 index, byte* data, u32 size, u64 user)
+    {
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_RECV;
+        sqe->flags               = IOSQE_FIXED_FILE;
+        sqe->fd                  = (s32)index;
+        sqe->addr                = (u64)(ptr_t)data;
+        sqe->len                 = size;
+        sqe->user_data           = user;
+    }
+
+    void uring_t::send(u32 index, byte const* data, u32 size, u64 user)
+    {
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_SEND;
+        sqe->flags               = IOSQE_FIXED_FILE;
+        sqe->fd                  = (s32)index;
+        sqe->addr                = (u64)(ptr_t)data;
+        sqe->len                 = size;
+        sqe->msg_flags           = MSG_NOSIGNAL;
+        sqe->user_data           = user;
+    }
+
+    void uring_t::sendv(u32 index, io_vec_t const* iov, u32 count, u64 user)
+    {
+        struct msghdr* msg = (struct msghdr*)m_msghdrs + index;
+        msg->msg_iov       = (struct iovec*)iov;
+        msg->msg_iovlen    = count;
+
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_SENDMSG;
+        sqe->flags               = IOSQE_FIXED_FILE;
+        sqe->fd                  = (s32)index;
+        sqe->addr                = (u64)(ptr_t)msg;
+        sqe->len                 = 1;
+        sqe->msg_flags           = MSG_NOSIGNAL;
+        sqe->user_data           = user;
+    }
+
+    void uring_t::cancel(u64 target, u64 user)
+    {
+        struct io_uring_sqe* sqe = (struct io_uring_sqe*)get_sqe();
+        if (sqe == nullptr)
+            return;
+        sqe->opcode              = IORING_OP_ASYNC_CANCEL;
+        sqe->addr                = target;
+        sqe->user_data           = user;
+    }
+
+    s32 uring_t::enter(u32 to_submit, u32 min_complete, s32 timeout_ms)
+    {
+        u32                           flags = 0;
+        struct __kernel_timespec      ts;
+        struct io_uring_getevents_arg arg;
+        g_memset(&arg, 0, sizeof(arg));
+
+        // Publish the queued requests to the kernel
+        __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+        // Completions that overflowed the completion ring are only moved back
+        // into it by a call that gets events, also when it does not wait.
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (min_complete > 0)
+        {
+            if (timeout_ms >= 0)
+            {
+                ts.tv_sec  = timeout_ms / 1000;
+                ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+                arg.ts     = (u64)(ptr_t)&ts;
+            }
+        }
+
+        s32 const n = (s32)::syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, &arg, sizeof(arg));
+        if (n < 0)
+        {
+            // A timeout or an interrupt is not an error, and EBUSY means the
+            // completion ring needs to be reaped first.
+            if (errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN)
+                return 0;
+            return -1;
+        }
+        m_sq_submitted += (u32)n;
+        return n;
+    }
+
+    s32 uring_t::submit(s32 timeout_ms) { return enter(m_sq_local_tail - m_sq_submitted, timeout_ms == 0 ? 0 : 1, timeout_ms); }
+
+    u32 uring_t::reap(uring_cqe_t* cqes, u32 max_cqes)
+    {
+        // Completions that were moved aside by get_sqe() came first
+        u32 n = 0;
+        while (m_stash_pos < m_stash_len && n < max_cqes)
+            cqes[n++] = m_stash[m_stash_pos++];
+        if (m_stash_pos == m_stash_len)
+        {
+            m_stash_pos = 0;
+            m_stash_len = 0;
+        }
+
+        u32       head = *m_cq_head;
+        u32 const tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail && n < max_cqes)
+        {
+            struct io_uring_cqe const* cqe = (struct io_uring_cqe const*)m_cqes + (head & m_cq_mask);
+            cqes[n].m_user                 = cqe->user_data;
+            cqes[n].m_result               = cqe->res;
+            cqes[n].m_flags                = cqe->flags;
+            if (!has_more(cqe->flags))
+                m_in_flight -= 1;
+            head += 1;
+            n += 1;
+        }
+
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    bool uring_t::drain(s32 timeout_ms)
+    {
+        uring_cqe_t cqes[32];
+        while (m_in_flight > 0)
+        {
+            if (enter(m_sq_local_tail - m_sq_submitted, 1, timeout_ms) < 0)
+                return false;
+            if (reap(cqes, 32) == 0 && timeout_ms >= 0)
+                return false;
+        }
+        m_stash_pos = 0;
+        m_stash_len = 0;
+        return true;
+    }
+
+    bool uring_t::has_more(u32 flags) { return (flags & IORING_CQE_F_MORE) != 0; }
+
+#else
+
+    bool uring_t::init(alloc_t* allocator, u32 entries, u32 max_files) { return false; }
+    void uring_t::exit() {}
+    bool uring_t::set_file(u32 index, sd_t sock) { return false; }
+    bool uring_t::clear_file(u32 index) { return false; }
+    void uring_t::accept(u32 index, bool multishot, u64 user) {}
+    void uring_t::poll_read(u32 index, u64 user) {}
+    void uring_t::poll_write(u32 index, u64 user) {}
+    void uring_t::recv(u32 index, byte* data, u32 size, u64 user) {}
+    void uring_t::send(u32 index, byte const* data, u32 size, u64 user) {}
+    void uring_t::sendv(u32 index, io_vec_t const* iov, u32 count, u64 user) {}
+    void uring_t::cancel(u64 target, u64 user) {}
+    s32  uring_t::submit(s32 timeout_ms) { return -1; }
+    u32  uring_t::reap(uring_cqe_t* cqes, u32 max_cqes) { return 0; }
+    bool uring_t::drain(s32 timeout_ms) { return true; }
+    bool uring_t::has_more(u32 flags) { return false; }
+    void* uring_t::get_sqe() { return nullptr; }
+    void uring_t::stash() {}
+    s32  uring_t::enter(u32 to_submit, u32 min_complete, s32 timeout_ms) { return -1; }
+
+#endif
+
+}  // namespace ncore
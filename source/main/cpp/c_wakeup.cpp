@@ -0,0 +1,117 @@
+#include "ccore/c_target.h"
+#include "cbase/c_debug.h"
+
+#include "csocket/private/c_atomic.h"
+#include "csocket/private/c_wakeup.h"
+
+#if defined(TARGET_LINUX) && !defined(PLATFORM_PC)
+#    include <sys/eventfd.h>  // For eventfd()
+#    include <unistd.h>       // For read(), write() and close()
+#elif !defined(PLATFORM_PC)
+#    include <fcntl.h>   // For fcntl()
+#    include <unistd.h>  // For pipe(), read(), write() and close()
+#endif
+
+namespace ncore
+{
+    wakeup_t::wakeup_t()
+        : m_read(-1)
+        , m_write(-1)
+        , m_signaled(0)
+    {
+    }
+
+#if defined(TARGET_LINUX) && !defined(PLATFORM_PC)
+
+    bool wakeup_t::init()
+    {
+        m_read     = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_write    = m_read;
+        m_signaled = 0;
+        return m_read != -1;
+    }
+
+    void wakeup_t::exit()
+    {
+        if (m_read != -1)
+            ::close(m_read);
+        m_read  = -1;
+        m_write = -1;
+    }
+
+    void wakeup_t::signal()
+    {
+        u32 expected = 0;
+        if (m_write != -1 && natomic::cas(&m_signaled, expected, 1))
+        {
+            u64 const one = 1;
+            ssize_t   n   = ::write(m_write, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    void wakeup_t::drain()
+    {
+        u64     count;
+        ssize_t n = ::read(m_read, &count, sizeof(count));
+        (void)n;
+        natomic::store_release(&m_signaled, 0);
+    }
+
+#elif !defined(PLATFORM_PC)
+
+    bool wakeup_t::init()
+    {
+        s32 fds[2];
+        if (::pipe(fds) != 0)
+            return false;
+        for (s32 i = 0; i < 2; ++i)
+        {
+            ::fcntl(fds[i], F_SETFL, ::fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            ::fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+        m_read     = fds[0];
+        m_write    = fds[1];
+        m_signaled = 0;
+        return true;
+    }
+
+    void wakeup_t::exit()
+    {
+        if (m_read != -1)
+            ::close(m_read);
+        if (m_write != -1)
+            ::close(m_write);
+        m_read  = -1;
+        m_write = -1;
+    }
+
+    void wakeup_t::signal()
+    {
+        u32 expected = 0;
+        if (m_write != -1 && natomic::cas(&m_signaled, expected, 1))
+        {
+            byte const one = 1;
+            ssize_t    n   = ::write(m_write, &one, sizeof(one));
+            (void)n;
+        }
+    }
+
+    void wakeup_t::drain()
+    {
+        byte buffer[64];
+        while (::read(m_read, buffer, sizeof(buffer)) > 0) {}
+        natomic::store_release(&m_signaled, 0);
+    }
+
+#else
+
+    // No wakeup handle, a blocked thread only wakes up on I/O or its timeout
+    bool wakeup_t::init() { return false; }
+    void wakeup_t::exit() {}
+    void wakeup_t::signal() {}
+    void wakeup_t::drain() {}
+
+#endif
+
+}  // namespace ncore
@@ -15,12 +15,35 @@ namespace ncore
     class address_registry_t
     {
     public:
+        // The table is sized for @max_addresses up front, it grows when more are added
         static bool create(alloc_t* alloc, u32 max_addresses, address_registry_t*& addr);
+
+        // get() can be called from any number of threads while one thread calls add()
+        // and rem(). Readers do not take a lock, but a reader that meets a group while
+        // the writer is changing it spins until that change is done. The writer waits
+        // for the readers of the old table when the table grows.
+        static bool create_concurrent(alloc_t* alloc, u32 max_addresses, address_registry_t*& addr);
+
+        // Maps a file written by save(), get() can be used right away. Only the control
+        // bytes are read on open, the entries are read from the file when they are first
+        // touched. Changes are copy-on-write and are never written back to the file. Fails
+        // when the file is not a snapshot of this version or it has been damaged.
+        static bool open_snapshot(alloc_t* alloc, char const* path, address_registry_t*& addr);
+        static bool open_snapshot_concurrent(alloc_t* alloc, char const* path, address_registry_t*& addr);
+
         static void destroy(address_registry_t* addr);
 
         virtual bool add(address_id_t const& addr_id, address_id_t const& addr_ep) = 0;
         virtual bool get(address_id_t const& addr_id, address_id_t& addr_ep)       = 0;
         virtual bool rem(address_id_t const& addr_id)                              = 0;
+
+        // Writes the table to @path, on a concurrent registry it is called by the writer.
+        // The file is replaced when it is complete, so @path can be the snapshot that this
+        // registry was opened from.
+        virtual bool save(char const* path) = 0;
+
+    protected:
+        virtual void release() = 0;
     };
 }  // namespace ncore
 
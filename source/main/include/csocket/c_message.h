@@ -10,6 +10,9 @@
 
 namespace ncore
 {
+    // Gives an external buffer back to its owner once a message does not need it anymore
+    typedef void (*message_release_fn)(void *user, byte *data, u32 size);
+
     struct message_t
     {
         inline message_t()
@@ -7,6 +7,7 @@
 
 #include "cbase/c_buffer.h"
 #include "cbase/c_runes.h"
+#include "csocket/c_message.h"
 
 namespace ncore
 {
@@ -14,10 +15,92 @@ namespace ncore
 
     struct address_t;
     struct addresses_t;
-    struct message_t;
 
     typedef data_t<32> sockid_t;
 
+    enum esend_result
+    {
+        SEND_FAILED      = 0,  // Not connected or the handshake buffer is full, the message is still owned by the caller
+        SEND_QUEUED      = 1,
+        SEND_WOULD_BLOCK = 2,  // The connection has too much queued, the message is still owned by the caller
+    };
+
+    // Every connection has a send queue per lane, a lane is only written when the
+    // lanes above it are empty. A message that is being written is always finished.
+    enum esend_lane
+    {
+        SEND_LANE_HIGH   = 0,  // Small control messages, the handshake and keepalives use this lane
+        SEND_LANE_NORMAL = 1,
+        SEND_LANE_BULK   = 2,  // Large transfers that should not hold up anything else
+    };
+
+    // A received message and the address it came from, see socket_t::recv_msgs()
+    struct received_msg_t
+    {
+        message_t* m_msg;
+        address_t* m_from;
+    };
+
+    struct socket_config_t
+    {
+        enum etransport
+        {
+            TRANSPORT_POLL  = 0,  // Readiness based (epoll, select), send()/recv() on the socket
+            TRANSPORT_URING = 1,  // Completion based io_uring (Linux), falls back to TRANSPORT_POLL
+        };
+
+        inline socket_config_t()
+            : m_transport(TRANSPORT_POLL)
+            , m_max_message_size(1024 * 1024)
+            , m_zerocopy_threshold(0)
+            , m_process_wait_ms(1)
+            , m_thread_safe_send(false)
+            , m_recv_rings(0)
+            , m_recv_ring_size(1024)
+            , m_send_high_watermark(0)
+            , m_send_low_watermark(0)
+            , m_io_quantum(64 * 1024)
+            , m_fragment_size(64 * 1024)
+            , m_compress_min_size(0)
+            , m_encrypt(false)
+            , m_ticket_cache_size(0)
+            , m_pending_max_size(64 * 1024)
+            , m_handshake_timeout_ms(5000)
+            , m_idle_timeout_ms(30000)
+            , m_keepalive_ms(10000)
+            , m_reconnect_min_ms(100)
+            , m_reconnect_max_ms(30000)
+        {
+        }
+
+        u32  m_transport;
+        u32  m_max_message_size;    // Largest message that can be allocated or received
+        u32  m_zerocopy_threshold;  // Sends of at least this many bytes use MSG_ZEROCOPY (Linux, TRANSPORT_POLL), 0 = disabled
+        s32  m_process_wait_ms;     // Longest time process() waits for I/O, -1 = until I/O, a timer or wakeup()
+        bool m_thread_safe_send;    // send_msg() and broadcast_msg() can be called from any thread
+        u32  m_recv_rings;          // Received messages are delivered to this many rings for worker threads, 0 = recv_msg() on the thread calling process()
+        u32  m_recv_ring_size;      // Number of messages a ring can hold, a power of two
+        u32  m_send_high_watermark; // Bytes queued for a connection at which send_msg() returns SEND_WOULD_BLOCK, 0 = no limit
+        u32  m_send_low_watermark;  // A connection that would block is reported as drained when its queue is down to this many bytes
+        u32  m_io_quantum;          // Bytes a connection can read and write before the next connection gets its turn, 0 = no limit
+        u32  m_fragment_size;       // Larger messages are send in fragments so that higher lanes do not have to wait, 0 = never
+
+        // Messages are compressed before they are encrypted, so with both enabled the size of a
+        // message shows how well it compressed. Do not enable both when a payload mixes secrets
+        // with data that an attacker can influence.
+        u32  m_compress_min_size;   // Messages of at least this size are compressed when both sides enabled it, 0 = disabled
+        bool m_encrypt;             // Messages are encrypted and authenticated after the handshake, peers without it are closed
+        u32  m_ticket_cache_size;   // Session tickets kept on each side so that a reconnect skips the key exchange, 0 = disabled
+        u32  m_pending_max_size;    // Bytes of messages that are held for a connection until it is secured, when full send_msg() fails
+
+        // Timeouts, in milliseconds
+        u32 m_handshake_timeout_ms;  // A connection that is not secured within this time is closed, 0 = no limit
+        u32 m_idle_timeout_ms;       // A connection that has received nothing for this long is closed, 0 = no limit
+        u32 m_keepalive_ms;          // A keepalive is send when nothing has been send for this long, 0 = disabled
+        u32 m_reconnect_min_ms;      // Delay before connecting again to an address of which the connection failed
+        u32 m_reconnect_max_ms;      // The delay doubles with every failure up to this maximum
+    };
+
     class socket_t
     {
     protected:
@@ -30,21 +113,75 @@ namespace ncore
         virtual void open(u16 port, crunes_t const& name, sockid_t const& id, u32 max_open) = 0;
         virtual void close()                                                                = 0;
 
-        virtual void process(addresses_t& open_conns, addresses_t& closed_conns, addresses_t& new_conns, addresses_t& failed_conns, addresses_t& pex_conns) = 0;
+        // @drained_conns are the connections that send_msg() returned SEND_WOULD_BLOCK
+        // for and that are below the low watermark again.
+        virtual void process(addresses_t& open_conns, addresses_t& closed_conns, addresses_t& new_conns, addresses_t& failed_conns, addresses_t& pex_conns, addresses_t& drained_conns) = 0;
 
+        // Can be called from any thread
         virtual void connect(address_t*)    = 0;
         virtual void disconnect(address_t*) = 0;
 
-        virtual bool alloc_msg(message_t*& msg) = 0;
-        virtual void commit_msg(message_t* msg) = 0;
-        virtual void free_msg(message_t* msg)   = 0;
+        // Wake up the thread that is waiting in process(), can be called from any thread
+        virtual void wakeup() = 0;
+
+        // Messages come from a pool with size classes, alloc_msg() without a size
+        // gives a message of the maximum size, commit_msg() moves a message to
+        // a smaller size class when that saves a lot of memory (@msg can change).
+        virtual bool alloc_msg(message_t*& msg)           = 0;
+        virtual bool alloc_msg(message_t*& msg, u32 size) = 0;
+        virtual void commit_msg(message_t*& msg)          = 0;
+        virtual void free_msg(message_t* msg)             = 0;
 
-        virtual bool send_msg(message_t* msg, address_t* to)     = 0;
-        virtual bool recv_msg(message_t*& msg, address_t*& from) = 0;
+        // The payload of a message can continue in segments, they are send with a
+        // gathering write and the receiver gets one message. append_msg() copies @data
+        // to the end of the message and adds segments when it is full, attach_msg()
+        // adds @data without copying. @release is called with @user on the thread that
+        // frees the message, when attach_msg() fails the buffer stays with the caller.
+        // Both fail when the message would exceed the maximum message size and cannot
+        // be used anymore once the message has been send.
+        virtual bool append_msg(message_t* msg, byte const* data, u32 size)                                 = 0;
+        virtual bool attach_msg(message_t* msg, byte* data, u32 size, message_release_fn release, void* user) = 0;
+
+        // With socket_config_t::m_thread_safe_send a message is handed to the thread
+        // calling process() and send_msg() cannot know if the connection is still
+        // there when it gets queued, the message is then simply dropped.
+        // From connect() until the connection is secured messages are held, they are send
+        // in order as soon as it is secured.
+        // Without a @lane the message is send on SEND_LANE_NORMAL.
+        virtual esend_result send_msg(message_t* msg, address_t* to)                 = 0;
+        virtual esend_result send_msg(message_t* msg, address_t* to, esend_lane lane) = 0;
+        virtual bool         recv_msg(message_t*& msg, address_t*& from)             = 0;
+
+        // With socket_config_t::m_recv_rings received messages are published to
+        // rings that are sharded by connection, the messages of a peer always end
+        // up in the same ring in the order they were received. Every ring has to
+        // be consumed by one thread, messages are freed with free_msg().
+        virtual bool recv_msg(u32 ring, message_t*& msg, address_t*& from) = 0;
+
+        // Batch versions of recv_msg() and free_msg(), recv_msgs() returns the number
+        // of messages written to @msgs. free_msgs() can be given the same array.
+        virtual u32  recv_msgs(received_msg_t* msgs, u32 max_msgs)           = 0;
+        virtual u32  recv_msgs(u32 ring, received_msg_t* msgs, u32 max_msgs) = 0;
+        virtual void free_msgs(received_msg_t const* msgs, u32 count)        = 0;
+
+        // Send one message to many, the connections share the message instead of
+        // each getting a copy, it is freed when the last one has sent it.
+        // The message is owned by the socket after this call, returns the number
+        // of addresses that the message has been queued for.
+        virtual u32 broadcast_msg(message_t* msg, addresses_t const& to) = 0;
     };
 
     socket_t* gCreateTcpBasedSocket(alloc_t*);
+    socket_t* gCreateTcpBasedSocket(alloc_t*, socket_config_t const& config);
     void      gDestroyTcpBasedSocket(socket_t*);
+
+    // Sharded mode, @num_shards sockets that each open their own listen socket on
+    // the same port (SO_REUSEPORT) and have their own connections and message queues.
+    // Every shard should be driven by its own thread calling process(), send_msg()
+    // on a shard forwards a message for a connection owned by another shard to that
+    // shard.
+    void gCreateTcpBasedSockets(alloc_t*, socket_config_t const& config, socket_t** shards, u32 num_shards);
+    void gDestroyTcpBasedSockets(socket_t** shards, u32 num_shards);
 }  // namespace ncore
 
 #endif
@@ -0,0 +1,117 @@
+#ifndef __CSOCKET_ATOMIC_H__
+#define __CSOCKET_ATOMIC_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+#ifdef _MSC_VER
+#    include <intrin.h>
+#endif
+
+namespace ncore
+{
+    // Minimal set of atomic operations used by the lock-free queues and the concurrent registry
+    namespace natomic
+    {
+#ifdef _MSC_VER
+        template <typename T>
+        inline T* load_acquire(T* volatile const* p)
+        {
+            T* v = *p;
+            _ReadWriteBarrier();
+            return v;
+        }
+        template <typename T>
+        inline void store_release(T* volatile* p, T* v)
+        {
+            _ReadWriteBarrier();
+            *p = v;
+        }
+        template <typename T>
+        inline T* exchange(T* volatile* p, T* v)
+        {
+            return (T*)_InterlockedExchangePointer((void* volatile*)p, v);
+        }
+        template <typename T>
+        inline bool cas(T* volatile* p, T*& expected, T* desired)
+        {
+            T* const prev = (T*)_InterlockedCompareExchangePointer((void* volatile*)p, desired, expected);
+            if (prev == expected)
+                return true;
+            expected = prev;
+            return false;
+        }
+        inline u32 load_acquire(u32 volatile const* p)
+        {
+            u32 v = *p;
+            _ReadWriteBarrier();
+            return v;
+        }
+        inline void store_release(u32 volatile* p, u32 v)
+        {
+            _ReadWriteBarrier();
+            *p = v;
+        }
+        inline u32 fetch_add(u32 volatile* p, u32 v) { return (u32)_InterlockedExchangeAdd((long volatile*)p, (long)v); }
+        inline bool cas(u32 volatile* p, u32& expected, u32 desired)
+        {
+            u32 const prev = (u32)_InterlockedCompareExchange((long volatile*)p, (long)desired, (long)expected);
+            if (prev == expected)
+                return true;
+            expected = prev;
+            return false;
+        }
+        inline void fence_acquire() { _ReadWriteBarrier(); }
+        inline void fence_release() { _ReadWriteBarrier(); }
+        inline void fence()
+        {
+            long volatile barrier = 0;
+            _InterlockedOr(&barrier, 0);
+        }
+#else
+        template <typename T>
+        inline T* load_acquire(T* volatile const* p)
+        {
+            return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+        }
+        template <typename T>
+        inline void store_release(T* volatile* p, T* v)
+        {
+            __atomic_store_n(p, v, __ATOMIC_RELEASE);
+        }
+        template <typename T>
+        inline T* exchange(T* volatile* p, T* v)
+        {
+            return __atomic_exchange_n(p, v, __ATOMIC_ACQ_REL);
+        }
+        template <typename T>
+        inline bool cas(T* volatile* p, T*& expected, T* desired)
+        {
+            return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+        inline u32  load_acquire(u32 volatile const* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+        inline void store_release(u32 volatile* p, u32 v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+        inline u32  fetch_add(u32 volatile* p, u32 v) { return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL); }
+        inline bool cas(u32 volatile* p, u32& expected, u32 desired) { return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+        inline void fence_acquire() { __atomic_thread_fence(__ATOMIC_ACQUIRE); }
+        inline void fence_release() { __atomic_thread_fence(__ATOMIC_RELEASE); }
+        inline void fence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+#endif
+
+        // Spin lock for very short critical sections
+        inline void lock(u32 volatile* l)
+        {
+            u32 expected = 0;
+            while (!cas(l, expected, 1))
+            {
+                while (load_acquire(l) != 0) {}
+                expected = 0;
+            }
+        }
+        inline void unlock(u32 volatile* l) { store_release(l, 0); }
+    }  // namespace natomic
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_ATOMIC_H__
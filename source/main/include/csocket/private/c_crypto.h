@@ -0,0 +1,61 @@
+#ifndef __CSOCKET_CRYPTO_H__
+#define __CSOCKET_CRYPTO_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+namespace ncore
+{
+    // ChaCha20-Poly1305 (RFC 8439) and X25519 (RFC 7748), the primitives of the
+    // encrypted transport. ChaCha20 encrypts 4 blocks at a time with SSE2 when it
+    // is available.
+    namespace ncrypto
+    {
+        enum
+        {
+            KEY_SIZE   = 32,
+            NONCE_SIZE = 12,
+            TAG_SIZE   = 16,
+        };
+
+        // XOR @size bytes of @data with the key stream that starts at block @counter
+        void chacha20(byte const* key, byte const* nonce, u32 counter, byte* data, u32 size);
+
+        // Derives a key from @key and 16 bytes of @input (XChaCha20 draft)
+        void hchacha20(byte* out, byte const* key, byte const* input);
+
+        class poly1305_t
+        {
+        public:
+            void init(byte const* key);
+            void update(byte const* data, u32 size);
+            void final(byte* tag);
+
+        private:
+            void blocks(byte const* data, u32 size, u32 hibit);
+
+            u32  m_r[5];
+            u32  m_h[5];
+            u32  m_pad[4];
+            u32  m_leftover;
+            byte m_buffer[16];
+        };
+
+        // Encrypts @data in place and writes the tag, open() checks the tag before it
+        // decrypts and returns false when it does not match.
+        void seal(byte const* key, byte const* nonce, byte const* aad, u32 aad_size, byte* data, u32 size, byte* tag);
+        bool open(byte const* key, byte const* nonce, byte const* aad, u32 aad_size, byte* data, u32 size, byte const* tag);
+
+        // Diffie-Hellman on Curve25519, x25519() returns false when the shared secret is
+        // zero because @point has a small order.
+        void x25519_public(byte* public_key, byte const* secret_key);
+        bool x25519(byte* shared, byte const* secret_key, byte const* point);
+
+        // Bytes from the random generator of the OS
+        bool random_bytes(byte* data, u32 size);
+    }  // namespace ncrypto
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_CRYPTO_H__
@@ -0,0 +1,20 @@
+#ifndef __CSOCKET_IOVEC_H__
+#define __CSOCKET_IOVEC_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+namespace ncore
+{
+    // Has the same layout as 'struct iovec' so that an array of these can be
+    // handed to writev/sendmsg as is (on Windows it is converted to WSABUF).
+    struct io_vec_t
+    {
+        void*  m_base;
+        uint_t m_size;
+    };
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_IOVEC_H__
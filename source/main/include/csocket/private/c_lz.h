@@ -0,0 +1,37 @@
+#ifndef __CSOCKET_LZ_H__
+#define __CSOCKET_LZ_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+namespace ncore
+{
+    // Fast LZ77 codec for message payloads, the block format is the one of LZ4:
+    //
+    //   sequence = token | literal length+ | literals | offset (u16) | match length+
+    //
+    // The token holds 4 bits of literal length and 4 bits of match length (minus 4),
+    // a length of 15 continues in bytes of 255. The last sequence only has literals.
+    //
+    // The compressor uses a hash table that is given by the user so that it does
+    // not have to allocate, it never has to be cleared since every match is
+    // verified against the input.
+    namespace nlz
+    {
+        enum
+        {
+            HASH_LOG  = 12,
+            HASH_SIZE = 1 << HASH_LOG,  // number of u32 entries in the hash table
+        };
+
+        // Returns the compressed size or 0 when the result does not fit in @dst_max bytes
+        u32 compress(byte const* src, u32 src_size, byte* dst, u32 dst_max, u32* hash_table);
+
+        // Returns false when @src is corrupt or does not decompress to exactly @dst_size bytes
+        bool decompress(byte const* src, u32 src_size, byte* dst, u32 dst_size);
+    }  // namespace nlz
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_LZ_H__
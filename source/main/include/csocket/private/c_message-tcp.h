@@ -6,93 +6,234 @@
 #endif
 
 #include "cbase/c_allocator.h"
+#include "csocket/private/c_iovec.h"
+#include "csocket/private/c_message.h"
 
 namespace ncore
 {
     typedef s32 sd_t;  // socket descriptor type
 
-    struct message_t;
-    struct message_node_t;
-    struct message_queue_t;
+    // A message is send as one frame, or as fragments when it is larger than the
+    // fragment size. A fragment has a header of its own that is kept here, in the
+    // first fragment it is followed by the size of the whole message.
+    struct message_frame_t
+    {
+        message_node_t* m_node;
+        u32             m_offset;    // where the body starts in the payload of the message
+        u32             m_size;      // header + body
+        u16             m_hdr_size;  // 0 when the message is send as one frame, the header is in the message
+        u16             m_last;      // the message has been send when this frame has
+        byte            m_hdr[12];
+    };
 
     class message_socket_writer
     {
-        message_queue_t* m_send_queue;
-        message_node_t*  m_current_msg;
-        byte*            m_data;
-        u32              m_bytes_written;
-        u32              m_bytes_to_write;
-        sd_t             m_socket;
-
     public:
-        void init(sd_t sock, message_queue_t* send_queue)
+        enum econfig
         {
-            m_socket        = sock;
-            m_send_queue    = send_queue;
-            m_bytes_written = 0;
+            MAX_IOV              = 64,   // ranges gathered by next_writev()
+            ZEROCOPY_MAX_PENDING = 64,   // zero-copy sends that can wait for their completion
+            ZEROCOPY_HDR_SLOTS   = 128,  // fragment headers that pending zero-copy sends can reference
+        };
+
+        void init(sd_t sock, message_lanes_t* send_queue, message_pool_t* pool)
+        {
+            m_socket         = sock;
+            m_send_queue     = send_queue;
+            m_pool           = pool;
+            m_frame.m_node   = nullptr;
+            m_frame_written  = 0;
+            m_num_frames     = 0;
+            m_fragment_size  = 0;
+            m_zc_enabled     = false;
+            m_zc_threshold   = 0;
+            m_zc_seq         = 0;
+            m_zc_done        = 0;
+            m_zc_mask        = 0;
+            m_zc_hdr_head    = 0;
+            m_zc_hdr_tail    = 0;
+            m_zc_queue.init();
+            for (u32 i = 0; i < MSG_LANES; ++i)
+                m_lane_offset[i] = 0;
         }
 
+        // Free all queued messages, also the ones waiting for a zero-copy completion
+        void reset();
+
+        // Messages larger than @size are send in fragments of @size bytes, the fragments
+        // of a message in a higher lane are interleaved with the ones of a lower lane.
+        void enable_fragments(u32 size) { m_fragment_size = size; }
+
+        // Sends of at least @threshold bytes use MSG_ZEROCOPY, the kernel then does
+        // not copy the payload. The messages of such a send are only freed after
+        // the kernel reports through the error queue that it is done with them.
+        // The socket should have SO_ZEROCOPY enabled.
+        void enable_zerocopy(u32 threshold)
+        {
+            m_zc_enabled   = true;
+            m_zc_threshold = threshold;
+        }
+
+        // The error queue only has to be read when zero-copy sends have been enabled
+        bool zerocopy_enabled() const { return m_zc_enabled; }
+
+        // Read the zero-copy completions from the error queue of the socket and
+        // free the messages that are done.
         //
-        // Supply a pointer to a message in @msg, when this becomes
-        // nullptr it means that the message has been fully written to
-        // the socket. That is ofcourse if no '-1' has been returned.
+        // return:
+        //   -1 -> the error queue holds a real error
+        //    0 -> there were no completions
+        //    1 -> completions have been processed
+        s32 reap_zerocopy();
+
+        //
+        // Write as many queued messages as possible, as many as fit (up to IOV_MAX)
+        // are gathered into a single sendmsg. Messages that have been fully written
+        // are removed from the queue and freed.
+        // A frame is always written completely, a message in a higher lane can
+        // only go first at a frame boundary.
+        // The bytes written are taken from @deficit, writing stops when it is used up.
+        // The last sendmsg can take it below zero, the caller should carry that over.
         //
         // return:
         //   -1 -> an error occured, better close this socket
-        //    0 -> socket cannot be written to anymore
-        //    1 -> still need to write data
-        s32 write(message_t*& msg);
+        //    0 -> socket cannot be written to anymore, there is still data to write
+        //    1 -> the send queue is empty
+        //    2 -> @deficit is used up, there is still data to write
+        s32 write(s32& deficit);
+
+        // Transports that do not write to the socket themselves (e.g. io_uring)
+        // use the following two functions instead of write().
+        //
+        // next_writev: gather the ranges of bytes that need to be send next (at most
+        //              MAX_IOV), no more messages are added once @max_size is reached.
+        //              Returns the number of ranges, 0 when there is nothing to send.
+        //              The ranges are owned by the writer and stay valid until commit_write().
+        // commit_write: @n bytes of those ranges have been send, returns the number of
+        //               messages this completed.
+        u32 next_writev(io_vec_t const*& iov, u32 max_size);
+        u32 commit_write(u32 n);
+
+    private:
+        void make_frame(message_node_t* node, u32 offset, message_frame_t& frame) const;
+        u32  gather(io_vec_t* iov, message_frame_t* frames, u32 max_iov, u32 max_size, u32& size, u32& num_frames, bool& fragments);
+        u32  commit(u32 n, u32 send_id, message_frame_t const* frames, u32 num_frames);
+        bool keep_headers(io_vec_t* iov, u32 count, message_frame_t const* frames, u32 num_frames);
+        void complete_zerocopy(u32 lo, u32 hi);
+
+        message_lanes_t* m_send_queue;
+        message_pool_t*  m_pool;
+        message_frame_t  m_frame;                   // frame that is being written
+        u32              m_frame_written;           // bytes of that frame
+        u32              m_fragment_size;           // 0 = messages are never fragmented
+        u32              m_lane_offset[MSG_LANES];  // payload of the front message of a lane that has been send as fragments
+        sd_t             m_socket;
+        bool             m_zc_enabled;    // the threshold drops to 0 when the kernel copies anyway, completions still come
+        u32              m_zc_threshold;  // 0 = no zero-copy sends
+        u32              m_zc_seq;        // number of zero-copy sends
+        u32              m_zc_done;       // zero-copy sends that have completed (in order)
+        u64              m_zc_mask;       // zero-copy sends after m_zc_done that completed out of order
+        message_queue_t  m_zc_queue;      // sent messages waiting for their zero-copy completion
+        u32              m_zc_hdr_head;   // slots of m_zc_hdrs taken by zero-copy sends, a ring
+        u32              m_zc_hdr_tail;   // slots before this one are free again
+        u32              m_zc_hdr_end[ZEROCOPY_MAX_PENDING];  // m_zc_hdr_head after each pending zero-copy send
+        byte             m_zc_hdrs[ZEROCOPY_HDR_SLOTS][16];
+        io_vec_t         m_iov[MAX_IOV];
+        message_frame_t  m_frames[MAX_IOV];  // frames of m_iov, a higher lane can get a message before the commit
+        u32              m_num_frames;
     };
 
     class message_socket_reader
     {
-        message_t*      m_msg;
-        message_node_t* m_hdr;
-        byte*           m_data;
-        u32             m_data_size;
-        u32             m_bytes_read;
-        u32             m_bytes_to_read;
-        sd_t            m_socket;
-        enum EState
+    public:
+        enum econfig
         {
-            STATE_READ_SIZE = 0,
-            STATE_READ_BODY = 1
+            RECV_BUFFER_SIZE = 16 * 1024,             // size of the receive buffer of a connection
+            LARGE_FRAME_SIZE = RECV_BUFFER_SIZE / 4,  // bodies of at least this size are received directly into the message
         };
-        u32 m_state;
 
-    public:
         message_socket_reader()
-            : m_msg(nullptr)
-            , m_hdr(nullptr)
-            , m_data(nullptr)
+            : m_pool(nullptr)
+            , m_msg(nullptr)
+            , m_msg_lane(MSG_LANES)
+            , m_msg_end(false)
+            , m_buffer(nullptr)
+            , m_begin(0)
+            , m_end(0)
             , m_bytes_read(0)
             , m_bytes_to_read(0)
             , m_socket(0)
-            , m_state(STATE_READ_SIZE)
         {
         }
 
-        void init(sd_t sock)
+        // @buffer should be RECV_BUFFER_SIZE bytes
+        void init(sd_t sock, message_pool_t* pool, byte* buffer)
         {
             m_socket        = sock;
+            m_pool          = pool;
             m_msg           = nullptr;
-            m_hdr           = nullptr;
-            m_data          = nullptr;
-            m_bytes_to_read = 0;
+            m_msg_lane      = MSG_LANES;
+            m_msg_end       = false;
+            m_buffer        = buffer;
+            m_begin         = 0;
+            m_end           = 0;
             m_bytes_read    = 0;
-            m_state         = STATE_READ_SIZE;
+            m_bytes_to_read = 0;
+            for (u32 i = 0; i < MSG_LANES; ++i)
+            {
+                m_partial[i]      = nullptr;
+                m_partial_size[i] = 0;
+            }
         }
 
+        // Give back the messages that are partially received
+        void reset();
+
         //
-        // supply a pointer to a message in @msg, when this
-        // becomes nullptr @rcvd will contain a pointer to the
-        // message that is now complete.
+        // Receives as much as the socket has into the receive buffer and parses
+        // the frames out of it, only the payload is copied into a message that
+        // is allocated from the pool with exactly the size class it needs.
+        // Large frames are received directly into their message.
+        // Fragments are copied into the message that they are a part of, it is
+        // returned when its last fragment has been received.
+        // The bytes received are taken from @deficit, receiving stops when it is used
+        // up, also in the middle of a message. Messages that are already in the
+        // receive buffer are still returned, their bytes have been taken.
         //
         // return:
         //   -1 -> an error occured, better close this socket
-        //    0 -> socket has no more data
-        //    1 -> socket still has data to read
-        s32 read(message_t*& msg, message_t*& rcvd);
+        //    0 -> socket has no more data (would block)
+        //    1 -> a message was received (@rcvd), socket may still have data to read
+        //    2 -> @deficit is used up, socket may still have data to read
+        s32 read(message_t*& rcvd, s32& deficit);
+
+        // Transports that do not read from the socket themselves (e.g. io_uring)
+        // use the following functions instead of read().
+        //
+        // next_read: get the range of bytes that should be received next.
+        // commit_read: @n bytes have been received in that range.
+        // next_msg: returns 1 and a message (@rcvd) when one is complete, 0 when
+        //           more data is needed and -1 when a frame is invalid.
+        void next_read(byte*& data, u32& size);
+        void commit_read(u32 n);
+        s32  next_msg(message_t*& rcvd);
+
+    private:
+        s32 parse(message_t*& rcvd);
+        s32 complete(u32 lane, message_t*& rcvd);
+
+        message_pool_t* m_pool;
+        message_t*      m_msg;                 // message of a large frame that is received directly
+        u32             m_msg_lane;            // lane when that frame is a fragment, MSG_LANES otherwise
+        bool            m_msg_end;             // that frame is the last fragment
+        message_t*      m_partial[MSG_LANES];  // message that is being reassembled from fragments
+        u32             m_partial_size[MSG_LANES];
+        byte*           m_buffer;
+        u32             m_begin;  // start of the data in the buffer that is not parsed yet
+        u32             m_end;    // end of the received data in the buffer
+        u32             m_bytes_read;
+        u32             m_bytes_to_read;
+        sd_t            m_socket;
     };
 
 }  // namespace ncore
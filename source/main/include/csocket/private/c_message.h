@@ -7,10 +7,25 @@
 
 #include "cbase/c_allocator.h"
 #include "csocket/c_message.h"
+#include "csocket/private/c_atomic.h"
 
 namespace ncore
 {
     struct address_t;
+    class message_pool_t;
+
+    // A message can continue in a chain of segments after its own payload. The
+    // descriptor of a segment lives in a message of the pool, the data either
+    // follows the descriptor or is an external buffer owned by the user.
+    struct message_segment_t
+    {
+        message_segment_t *m_next;
+        byte              *m_data;
+        u32                m_size;
+        u32                m_max;      // room for appending, 0 for an external buffer
+        message_release_fn m_release;  // gives an external buffer back to its owner
+        void              *m_user;
+    };
 
     struct message_node_t
     {
@@ -18,6 +33,13 @@ namespace ncore
             : m_remote(NULL)
             , m_next(this)
             , m_prev(this)
+            , m_pool(NULL)
+            , m_class(0)
+            , m_send_id(0)
+            , m_refs(0)
+            , m_shared(NULL)
+            , m_segments(NULL)
+            , m_segments_size(0)
         {
         }
 
@@ -30,10 +52,9 @@ namespace ncore
 
         void push_back(message_node_t *msg)
         {
-            m_next->m_prev = msg;
-            m_prev->m_next = msg;
             msg->m_next    = m_next;
-            msg->m_prev    = m_prev;
+            msg->m_prev    = this;
+            m_next->m_prev = msg;
             m_next         = msg;
         }
 
@@ -56,6 +77,13 @@ namespace ncore
         address_t      *m_remote;
         message_node_t *m_next;
         message_node_t *m_prev;
+        message_pool_t *m_pool;   // pool that owns the memory of this message
+        u32             m_class;    // size class in that pool
+        u32             m_send_id;  // last zero-copy send (+1) that holds a reference to the payload
+        u32 volatile    m_refs;     // number of references to a shared message, 0 = not shared
+        message_node_t    *m_shared;         // when this is a reference, the shared message it refers to
+        message_segment_t *m_segments;       // payload that continues after the payload of the message
+        u32                m_segments_size;  // total size of the segments
     };
 
     struct message_header_t
@@ -64,54 +92,68 @@ namespace ncore
         u32 m_msg_flags;
     };
 
-    inline message_t *alloc_msg(alloc_t *allocator, u32 size)
+    // Flags in the frame header
+    enum e_msg_flags
     {
-        u32 size_align = 4;
-        u32 total_size = sizeof(message_node_t) + sizeof(message_header_t) + sizeof(message_t) + sizeof(void *) + ((size + (size_align - 1)) & ~(size_align - 1));
-
-        void *mem = allocator->allocate(total_size, sizeof(void *));
-
-        void           *mem_hdr = mem;
-        message_node_t *hdr     = new (mem_hdr) message_node_t();
-        void           *mem_msg = (void *)((byte *)mem + sizeof(message_node_t) + sizeof(message_header_t));
-        message_t      *msg     = new (mem_msg) message_t();
+        MSG_FLAG_KEEPALIVE    = 0x1,   // Frame without payload that only keeps the connection alive
+        MSG_FLAG_FRAGMENT     = 0x2,   // Frame is a part of a larger message, the first one starts with its size (u32)
+        MSG_FLAG_FRAGMENT_END = 0x4,   // Frame is the last part of a larger message
+        MSG_FLAG_COMPRESSED   = 0x8,   // Payload is the original size (u32) followed by the LZ compressed message
+        MSG_FLAG_LANE_MASK    = 0x30,  // Send lane (esend_lane) the message is queued in, fragments are reassembled per lane
+        MSG_FLAG_LANE_SHIFT   = 4,
+        MSG_FLAG_TICKET       = 0x40,  // Payload is a session ticket for a later reconnect, it is not delivered
+    };
 
-        return msg;
-    }
+    enum
+    {
+        MSG_LANES = 3,  // Number of send lanes, see message_lanes_t
+    };
 
-    inline message_t *header_to_msg(message_header_t *hdr)
+    // Memory layout of a message: node | message | header | payload
+    //
+    // The header is directly followed by the payload, together they form
+    // the frame that is send over the wire.
+    inline message_t *node_to_msg(message_node_t *node)
     {
-        message_t *msg = (message_t *)((byte *)hdr + sizeof(message_header_t));
+        message_t *msg = (message_t *)((byte *)node + sizeof(message_node_t));
         return msg;
     }
 
-    inline message_t *node_to_msg(message_node_t *node)
+    inline message_node_t *msg_to_node(message_t *msg)
     {
-        message_t *msg = (message_t *)((byte *)node + sizeof(message_node_t) + sizeof(message_header_t));
-        return msg;
+        message_node_t *node = (message_node_t *)((byte *)msg - sizeof(message_node_t));
+        return node;
     }
 
     inline message_header_t *msg_to_header(message_t *msg)
     {
-        message_header_t *hdr = (message_header_t *)((byte *)msg - sizeof(message_header_t));
+        message_header_t *hdr = (message_header_t *)((byte *)msg + sizeof(message_t));
         return hdr;
     }
 
-    inline message_node_t *msg_to_node(message_t *msg)
+    inline message_t *header_to_msg(message_header_t *hdr)
     {
-        message_node_t *node = (message_node_t *)((byte *)msg - sizeof(message_header_t) - sizeof(message_node_t));
-        return node;
+        message_t *msg = (message_t *)((byte *)hdr - sizeof(message_t));
+        return msg;
     }
 
+    // The descriptor of a segment is at the start of the payload of its message
+    inline message_t *segment_to_msg(message_segment_t *seg) { return header_to_msg((message_header_t *)((byte *)seg - sizeof(message_header_t))); }
+
+    // Header and the contiguous part of the payload, the segments of the message
+    // follow it on the wire.
     inline void get_msg_payload(message_node_t *node, byte *&payload, u32 &payload_size)
     {
         if (node != NULL)
         {
-            message_t *msg   = node_to_msg(node);
-            payload          = (byte *)((byte *)msg - sizeof(message_header_t));
-            u32 *payload_hdr = (u32 *)payload;
-            payload_size     = msg->m_size + sizeof(message_header_t);
-            payload_hdr[0]   = msg->m_size;
+            // A reference sends the payload of the shared message, its header
+            // is written once when it is shared.
+            message_node_t *payload_node = (node->m_shared != NULL) ? node->m_shared : node;
+            message_t      *msg          = node_to_msg(payload_node);
+            payload                      = (byte *)msg_to_header(msg);
+            payload_size                 = msg->m_size + sizeof(message_header_t);
+            if (payload_node == node)
+                msg_to_header(msg)->m_msg_size = msg->m_size + node->m_segments_size;
         }
         else
         {
@@ -120,29 +162,49 @@ namespace ncore
         }
     }
 
+    // Size of the frame that is send for a message
+    inline u32 get_msg_frame_size(message_node_t *node)
+    {
+        message_node_t *payload_node = (node->m_shared != NULL) ? node->m_shared : node;
+        return node_to_msg(payload_node)->m_size + payload_node->m_segments_size + sizeof(message_header_t);
+    }
+
+    // The send lane is taken from the message itself, a reference from a broadcast
+    // has its own header for this.
+    inline u32 get_msg_lane(message_node_t *node)
+    {
+        u32 const lane = (msg_to_header(node_to_msg(node))->m_msg_flags & MSG_FLAG_LANE_MASK) >> MSG_FLAG_LANE_SHIFT;
+        return (lane < MSG_LANES) ? lane : (MSG_LANES - 1);
+    }
+
+    inline void set_msg_lane(message_t *msg, u32 lane)
+    {
+        message_header_t *hdr = msg_to_header(msg);
+        hdr->m_msg_flags      = (hdr->m_msg_flags & ~(u32)MSG_FLAG_LANE_MASK) | ((lane << MSG_FLAG_LANE_SHIFT) & MSG_FLAG_LANE_MASK);
+    }
+
     struct message_queue_t
     {
         u32            m_size;
+        u32 volatile   m_bytes;  // frame bytes in the queue, only changed by the owner but can be read by any thread
         message_node_t m_head;
 
         void init()
         {
-            m_size = 0;
+            m_size  = 0;
+            m_bytes = 0;
             m_head.clear();
         }
 
         bool empty() const { return m_size == 0; }
+        u32  bytes() const { return natomic::load_acquire(&m_bytes); }
 
-        void push(message_t *msg)
-        {
-            message_node_t *hdr = msg_to_node(msg);
-            m_size += 1;
-            m_head.push_back(hdr);
-        }
+        void push(message_t *msg) { push(msg_to_node(msg)); }
 
         void push(message_node_t *msg)
         {
             m_size += 1;
+            natomic::store_release(&m_bytes, m_bytes + get_msg_frame_size(msg));
             m_head.push_back(msg);
         }
 
@@ -153,14 +215,314 @@ namespace ncore
             return m_head.peek_front();
         }
 
+        // Walk the queue from the front to the back
+        message_node_t *next(message_node_t *node)
+        {
+            message_node_t *n = node->m_prev;
+            return (n == &m_head) ? NULL : n;
+        }
+
         message_node_t *pop()
         {
             if (m_size == 0)
                 return NULL;
             m_size -= 1;
-            return m_head.pop_front();
+            message_node_t *msg = m_head.pop_front();
+            natomic::store_release(&m_bytes, m_bytes - get_msg_frame_size(msg));
+            return msg;
         }
     };
+
+    // Send queue of a connection, every lane is a FIFO and lane 0 has the highest
+    // priority. The front is the oldest message of the highest lane that is not
+    // empty, walking the queue visits the lanes from high to low.
+    struct message_lanes_t
+    {
+        u32            m_size;
+        u32 volatile   m_bytes;  // frame bytes in all lanes, only changed by the owner but can be read by any thread
+        message_node_t m_heads[MSG_LANES];
+
+        void init()
+        {
+            m_size  = 0;
+            m_bytes = 0;
+            for (u32 i = 0; i < MSG_LANES; ++i)
+                m_heads[i].clear();
+        }
+
+        bool empty() const { return m_size == 0; }
+        u32  bytes() const { return natomic::load_acquire(&m_bytes); }
+
+        void push(message_node_t *msg)
+        {
+            m_size += 1;
+            natomic::store_release(&m_bytes, m_bytes + get_msg_frame_size(msg));
+            m_heads[get_msg_lane(msg)].push_back(msg);
+        }
+
+        message_node_t *peek() { return front(0); }
+
+        // Walk the queue from the front to the back
+        message_node_t *next(message_node_t *node)
+        {
+            u32 const       lane = get_msg_lane(node);
+            message_node_t *n    = node->m_prev;
+            return (n == &m_heads[lane]) ? front(lane + 1) : n;
+        }
+
+        // Any message in the queue can be removed, not only the front
+        void remove(message_node_t *msg)
+        {
+            msg->m_prev->m_next = msg->m_next;
+            msg->m_next->m_prev = msg->m_prev;
+            m_size -= 1;
+            natomic::store_release(&m_bytes, m_bytes - get_msg_frame_size(msg));
+        }
+
+        message_node_t *pop()
+        {
+            message_node_t *msg = peek();
+            if (msg != NULL)
+                remove(msg);
+            return msg;
+        }
+
+    private:
+        message_node_t *front(u32 lane)
+        {
+            for (; lane < MSG_LANES; ++lane)
+            {
+                if (m_heads[lane].m_prev != &m_heads[lane])
+                    return m_heads[lane].m_prev;
+            }
+            return NULL;
+        }
+    };
+
+    // Lock-free intrusive multi-producer / single-consumer queue (Vyukov).
+    // Any thread can push, only the thread that owns the queue can pop.
+    // The link re-uses message_node_t::m_next, a message is only ever
+    // part of one queue.
+    struct message_mpsc_queue_t
+    {
+        message_node_t *volatile m_head;  // producers
+        message_node_t          *m_tail;  // consumer
+        message_node_t           m_stub;
+
+        void init()
+        {
+            m_stub.m_next = NULL;
+            m_head        = &m_stub;
+            m_tail        = &m_stub;
+        }
+
+        void push(message_node_t *node)
+        {
+            node->m_next         = NULL;
+            message_node_t *prev = natomic::exchange(&m_head, node);
+            natomic::store_release(&prev->m_next, node);
+        }
+
+        message_node_t *pop()
+        {
+            message_node_t *tail = m_tail;
+            message_node_t *next = natomic::load_acquire(&tail->m_next);
+            if (tail == &m_stub)
+            {
+                if (next == NULL)
+                    return NULL;
+                m_tail = next;
+                tail   = next;
+                next   = natomic::load_acquire(&next->m_next);
+            }
+
+            if (next != NULL)
+            {
+                m_tail = next;
+                return tail;
+            }
+
+            // A producer is in the middle of a push, try again later
+            if (tail != natomic::load_acquire(&m_head))
+                return NULL;
+
+            push(&m_stub);
+            next = natomic::load_acquire(&tail->m_next);
+            if (next != NULL)
+            {
+                m_tail = next;
+                return tail;
+            }
+            return NULL;
+        }
+    };
+
+    // Bounded lock-free single-producer / single-consumer ring of messages.
+    // The producer and consumer indices live on their own cache line so that
+    // the two threads do not invalidate each other on every push and pop.
+    struct message_spsc_ring_t
+    {
+        enum
+        {
+            CACHE_LINE = 64
+        };
+
+        message_node_t **m_slots;
+        u32              m_mask;
+        byte             m_pad0[CACHE_LINE - sizeof(void *) - sizeof(u32)];
+        u32 volatile     m_tail;  // producer
+        byte             m_pad1[CACHE_LINE - sizeof(u32)];
+        u32 volatile     m_head;  // consumer
+        byte             m_pad2[CACHE_LINE - sizeof(u32)];
+
+        // @capacity has to be a power of two
+        void init(alloc_t *allocator, u32 capacity)
+        {
+            m_slots = g_allocate_array<message_node_t *>(allocator, capacity);
+            m_mask  = capacity - 1;
+            m_tail  = 0;
+            m_head  = 0;
+        }
+
+        void exit(alloc_t *allocator)
+        {
+            g_deallocate_array(allocator, m_slots);
+            m_slots = NULL;
+        }
+
+        bool full() const { return (m_tail - natomic::load_acquire(&m_head)) > m_mask; }
+
+        bool push(message_node_t *node)
+        {
+            u32 const tail = m_tail;
+            if ((tail - natomic::load_acquire(&m_head)) > m_mask)
+                return false;
+            m_slots[tail & m_mask] = node;
+            natomic::store_release(&m_tail, tail + 1);
+            return true;
+        }
+
+        message_node_t *pop()
+        {
+            u32 const head = m_head;
+            if (head == natomic::load_acquire(&m_tail))
+                return NULL;
+            message_node_t *node = m_slots[head & m_mask];
+            natomic::store_release(&m_head, head + 1);
+            return node;
+        }
+
+        // Pop up to @max messages with a single synchronization with the producer
+        u32 pop(message_node_t **nodes, u32 max)
+        {
+            u32 const head = m_head;
+            u32       n    = natomic::load_acquire(&m_tail) - head;
+            if (n > max)
+                n = max;
+            for (u32 i = 0; i < n; ++i)
+                nodes[i] = m_slots[(head + i) & m_mask];
+            natomic::store_release(&m_head, head + n);
+            return n;
+        }
+    };
+
+    // Message allocator, messages are carved out of slabs and kept in free
+    // lists per size class (powers of two starting at 64 bytes of payload).
+    // Once warmed up allocating and freeing a message does not touch the
+    // general allocator anymore.
+    //
+    // The thread that owns the pool (the one calling socket_t::process) uses
+    // alloc_local()/free_local(), these work on a cache without any locking
+    // and only visit the shared free lists in batches. Any other thread uses
+    // alloc()/release(), they go to the shared free lists under a spin lock.
+    // A message always returns to the pool it was allocated from, also when
+    // it is freed by the thread of another pool (e.g. a shard).
+    //
+    // A message can be shared by many queues through references, a reference
+    // is a small message that points to the shared one. Freeing a shared message
+    // or a reference drops a reference, the shared message is freed with the last.
+    struct message_magazine_t;
+
+    class message_pool_t
+    {
+    public:
+        enum econfig
+        {
+            MIN_SIZE_SHIFT = 6,            // smallest size class, 64 bytes of payload
+            MAX_CLASSES    = 24,           // largest size class, 512 MB of payload
+            SLAB_SIZE      = 64 * 1024,    // smaller size classes are carved out of slabs of this size
+            CACHE_MAX      = 64,           // maximum number of messages per size class in the local cache
+            CACHE_BATCH    = CACHE_MAX / 2, // messages moved between the local cache and the shared free list
+            MAGAZINE_MAX   = 16,            // maximum number of messages per size class in the magazine of a thread
+            MAGAZINE_BATCH = MAGAZINE_MAX / 2,
+            SEGMENT_SIZE   = 1024           // smallest room of a segment that append() adds
+        };
+
+        message_pool_t();
+
+        bool init(alloc_t *allocator, u32 max_size);
+        void exit();
+
+        u32 max_size() const { return m_max_size; }
+
+        // Thread-safe, every thread has a magazine of free messages of the pool it used
+        // last in front of the shared free lists
+        message_t  *alloc(u32 size);
+        message_t  *shrink(message_t *msg);
+        message_t  *alloc_ref(message_t *shared);
+        static void release(message_t *msg);
+        static void release(message_t *const *msgs, u32 count);
+        static void share(message_t *msg, u32 refs);
+
+        // Grow the payload of @msg beyond its own capacity, append() copies @data
+        // and adds segments from this pool when the message or its last segment is
+        // full, attach() adds @data without copying. The segments are released
+        // together with the message, for an external buffer by calling @release on
+        // the thread that frees the message. Fails when the total size would exceed
+        // the maximum message size, a message cannot change once it is send.
+        bool append(message_t *msg, byte const *data, u32 size);
+        bool attach(message_t *msg, byte *data, u32 size, message_release_fn release, void *user);
+
+        // Owner thread only
+        message_t *alloc_local(u32 size);
+        void       free_local(message_t *msg);
+
+    private:
+        friend struct message_magazine_t;
+
+        struct slab_t
+        {
+            slab_t *m_next;
+        };
+
+        struct size_class_t
+        {
+            u32             m_capacity;    // payload capacity of a message
+            u32             m_block_size;  // memory used by a message including node, message_t and header
+            message_node_t *m_cache;       // owner thread
+            u32             m_cache_count;
+            message_node_t *m_free;        // protected by m_lock
+            u32             m_free_count;
+        };
+
+        u32                 size_to_class(u32 size) const;
+        bool                in_magazine(u32 cls) const { return m_classes[cls].m_block_size <= SLAB_SIZE / MAGAZINE_MAX; }
+        message_magazine_t *bind_magazine();
+        void                unbind_magazine(message_magazine_t *mag);
+        bool                put_magazine(message_node_t *node);
+        void                grow(u32 cls);
+        void                push_free(u32 cls, message_node_t *head, message_node_t *tail, u32 count);
+        message_segment_t  *alloc_segment(u32 size);
+        static void         release_segments(message_node_t *node);
+
+        alloc_t            *m_allocator;
+        u32 volatile        m_lock;
+        u32                 m_max_size;
+        u32                 m_num_classes;
+        slab_t             *m_slabs;
+        message_magazine_t *m_magazines;  // magazines of the threads that are bound to this pool, protected by m_lock
+        size_class_t        m_classes[MAX_CLASSES];
+    };
 }  // namespace ncore
 
 #endif  ///< __CSOCKET_MESSAGE_PRIVATE_H__
@@ -0,0 +1,76 @@
+#ifndef __CSOCKET_POLLER_H__
+#define __CSOCKET_POLLER_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+#include "cbase/c_allocator.h"
+
+namespace ncore
+{
+    typedef s32 sd_t;  // socket descriptor type
+
+    enum e_poll_event
+    {
+        POLL_READ   = 0x1,
+        POLL_WRITE  = 0x2,
+        POLL_ERROR  = 0x4,
+        POLL_HANGUP = 0x8,
+    };
+
+    struct poll_event_t
+    {
+        void* m_user;
+        u32   m_events;
+    };
+
+    // Readiness engine used by socket_tcp_t::process.
+    //
+    // On Linux this is epoll with persistent, edge-triggered registrations, the
+    // cost of wait() only depends on the number of sockets that are ready.
+    // Other platforms fall back to select(), there the registrations are kept
+    // in an array and the fd_set's are rebuilt on every wait(). select() never
+    // reports POLL_ERROR, errors show up when reading or writing.
+    //
+    // Since registrations can be edge-triggered the user has to drain a socket
+    // (read/write until it would block) before waiting for it again.
+    class poller_t
+    {
+    public:
+        poller_t();
+
+        bool init(alloc_t* allocator, u32 max_sockets);
+        void exit();
+
+        bool add(sd_t sock, void* user, u32 events);
+        bool mod(sd_t sock, void* user, u32 events);
+        bool rem(sd_t sock);
+
+        // Wait at most @timeout_ms (-1 = infinite) for any of the registered
+        // sockets to become ready.
+        //
+        // return:
+        //   -1 -> an error occured
+        //    n -> number of events written to @events
+        s32 wait(poll_event_t* events, u32 max_events, s32 timeout_ms);
+
+    private:
+        struct entry_t
+        {
+            sd_t  m_sock;
+            u32   m_events;
+            void* m_user;
+        };
+
+        alloc_t* m_allocator;
+        u32      m_max;
+        u32      m_len;
+        s32      m_epoll;
+        void*    m_epoll_events;  // epoll_event[m_max] (epoll only)
+        entry_t* m_entries;       // registered sockets (select only)
+    };
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_POLLER_H__
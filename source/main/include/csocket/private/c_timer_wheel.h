@@ -0,0 +1,83 @@
+#ifndef __CSOCKET_TIMER_WHEEL_H__
+#define __CSOCKET_TIMER_WHEEL_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+#include "ctime/c_time.h"
+
+namespace ncore
+{
+    // Intrusive timer, embed it in the object that needs a timeout
+    struct wheel_timer_t
+    {
+        inline wheel_timer_t()
+            : m_next(NULL)
+            , m_prev(NULL)
+            , m_expire(0)
+            , m_user(NULL)
+            , m_type(0)
+        {
+        }
+
+        wheel_timer_t* m_next;
+        wheel_timer_t* m_prev;
+        u64            m_expire;  // in units of the wheel resolution
+        void*          m_user;
+        u32            m_type;
+    };
+
+    // Hierarchical timer wheel, 4 levels of 64 slots. With a resolution of 1 ms
+    // the first level covers 64 ms, the last one about 4.6 hours, timers further
+    // out than that are parked in the last level until they come in range.
+    //
+    // Scheduling and cancelling a timer is O(1), advancing the wheel only visits
+    // the timers that expire and once every 64 steps the timers of one slot of
+    // a higher level (cascade).
+    class timer_wheel_t
+    {
+    public:
+        enum econfig
+        {
+            SLOT_BITS = 6,
+            SLOTS     = 1 << SLOT_BITS,
+            LEVELS    = 4,
+        };
+
+        timer_wheel_t();
+
+        void init(tick_t now, tick_t resolution);
+
+        // Unlink all timers, they are no longer scheduled afterwards
+        void clear();
+
+        // (Re)schedule @timer to expire at @expire, a time in the past expires on the next advance()
+        void        schedule(wheel_timer_t* timer, tick_t expire);
+        void        cancel(wheel_timer_t* timer);
+        static bool is_scheduled(wheel_timer_t const* timer) { return timer->m_next != NULL; }
+
+        // Move the wheel forward to @now, the timers that expire are collected and
+        // should be taken out with pop_expired().
+        void           advance(tick_t now);
+        wheel_timer_t* pop_expired();
+
+        // When advance() has to be called next, this is the earliest expiry or the
+        // cascade before it, whichever comes first. Returns false when there are
+        // no timers.
+        bool next_deadline(tick_t& deadline) const;
+
+    private:
+        void link(wheel_timer_t* timer);
+        void cascade(u32 level, u32 slot);
+
+        tick_t        m_resolution;
+        u64           m_now;
+        u32           m_count;
+        wheel_timer_t m_expired;
+        wheel_timer_t m_slots[LEVELS][SLOTS];
+    };
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_TIMER_WHEEL_H__
@@ -0,0 +1,115 @@
+#ifndef __CSOCKET_URING_H__
+#define __CSOCKET_URING_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+#include "cbase/c_allocator.h"
+#include "csocket/private/c_iovec.h"
+
+namespace ncore
+{
+    typedef s32 sd_t;  // socket descriptor type
+
+    struct uring_cqe_t
+    {
+        u64 m_user;
+        s32 m_result;
+        u32 m_flags;
+    };
+
+    // Minimal io_uring wrapper (Linux only, no dependency on liburing).
+    //
+    // All sockets are addressed through a table of fixed files, requests are
+    // queued in the submission ring and handed to the kernel with a single
+    // system call in submit(). On platforms or kernels without io_uring init()
+    // returns false and the user should fall back to poller_t.
+    class uring_t
+    {
+    public:
+        uring_t();
+
+        bool init(alloc_t* allocator, u32 entries, u32 max_files);
+        void exit();
+
+        bool set_file(u32 index, sd_t sock);
+        bool clear_file(u32 index);
+
+        // Queue a request on the fixed file at @index, @user is returned
+        // in the completion.
+        void accept(u32 index, bool multishot, u64 user);
+        void poll_read(u32 index, u64 user);
+        void poll_write(u32 index, u64 user);
+        void recv(u32 index, byte* data, u32 size, u64 user);
+        void send(u32 index, byte const* data, u32 size, u64 user);
+
+        // Gathering send, only one can be in flight per fixed file since the
+        // message header for it is kept per file. @iov has to stay valid until
+        // the request has been submitted.
+        void sendv(u32 index, io_vec_t const* iov, u32 count, u64 user);
+
+        // Cancel the request that was queued with @target, the cancel itself
+        // completes with @user.
+        void cancel(u64 target, u64 user);
+
+        // Submit all queued requests and wait at most @timeout_ms (-1 = infinite)
+        // for at least one completion.
+        //
+        // return:
+        //   -1 -> an error occured
+        //    n -> number of requests submitted
+        s32 submit(s32 timeout_ms);
+
+        // Copy out at most @max_cqes completions, returns the number copied.
+        u32 reap(uring_cqe_t* cqes, u32 max_cqes);
+
+        // Submit all queued requests and wait until every request has completed, the
+        // completions are dropped. The kernel can use the memory of a request until
+        // then, so this has to come before that memory and the ring are freed.
+        // Returns false when a wait of @timeout_ms (-1 = infinite) gave nothing.
+        bool drain(s32 timeout_ms);
+
+        // A multishot request is still active when its completion has this flag
+        static bool has_more(u32 flags);
+
+    private:
+        void* get_sqe();
+        void  stash();
+        s32   enter(u32 to_submit, u32 min_complete, s32 timeout_ms);
+
+        alloc_t*     m_allocator;
+        void*        m_msghdrs;  // msghdr[max_files] used by sendv()
+        u32          m_max_files;
+        u32          m_in_flight;  // requests that have not given their last completion yet
+        uring_cqe_t* m_stash;  // completions that were taken out of the ring to be able to submit
+        u32          m_stash_pos;
+        u32          m_stash_len;
+        u32          m_stash_cap;
+
+        s32   m_fd;
+        u32   m_features;
+        void* m_sq_ring;
+        u32   m_sq_ring_size;
+        void* m_cq_ring;
+        u32   m_cq_ring_size;
+        void* m_sqes;
+        u32   m_sqes_size;
+
+        u32* m_sq_head;
+        u32* m_sq_tail;
+        u32* m_sq_array;
+        u32  m_sq_mask;
+        u32  m_sq_entries;
+        u32  m_sq_local_tail;
+        u32  m_sq_submitted;
+
+        u32*  m_cq_head;
+        u32*  m_cq_tail;
+        void* m_cqes;
+        u32   m_cq_mask;
+    };
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_URING_H__
@@ -0,0 +1,44 @@
+#ifndef __CSOCKET_WAKEUP_H__
+#define __CSOCKET_WAKEUP_H__
+#include "ccore/c_target.h"
+#ifdef USE_PRAGMA_ONCE
+#    pragma once
+#endif
+
+namespace ncore
+{
+    typedef s32 sd_t;  // socket descriptor type
+
+    // Wakes up a thread that is blocked waiting for I/O.
+    //
+    // The handle (an eventfd on Linux, a pipe on other POSIX platforms) is
+    // registered for reading together with the sockets, signal() makes it
+    // readable. Signals are coalesced, only the first signal() after a drain()
+    // writes to the handle.
+    class wakeup_t
+    {
+    public:
+        wakeup_t();
+
+        bool init();
+        void exit();
+
+        bool valid() const { return m_read != -1; }
+        sd_t handle() const { return m_read; }
+
+        // Can be called from any thread
+        void signal();
+
+        // Called by the waiting thread when the handle has become readable,
+        // work that was queued before a signal() has to be picked up after this.
+        void drain();
+
+    private:
+        sd_t         m_read;
+        sd_t         m_write;
+        u32 volatile m_signaled;
+    };
+
+}  // namespace ncore
+
+#endif  ///< __CSOCKET_WAKEUP_H__
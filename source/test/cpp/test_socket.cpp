@@ -1,10 +1,101 @@
 #include "ccore/c_target.h"
+#include "cbase/c_memory.h"
+#include "csocket/c_address.h"
+#include "csocket/c_message.h"
 #include "csocket/c_socket.h"
+#include "csocket/private/c_atomic.h"
+#include "csocket/private/c_crypto.h"
+#include "csocket/private/c_lz.h"
+#include "csocket/private/c_message.h"
+#include "csocket/private/c_timer_wheel.h"
 
 #include "cunittest/cunittest.h"
 
+#include <cstdio>
+#include <thread>
+
 using namespace ncore;
 
+static s32 s_released = 0;
+static void s_release_buffer(void*, byte*, u32) { s_released += 1; }
+
+// Test vectors are written in hex, returns the number of bytes
+static u32 s_from_hex(char const* hex, byte* out)
+{
+	u32 n = 0;
+	while (hex[0] != 0 && hex[1] != 0)
+	{
+		byte v = 0;
+		for (s32 i = 0; i < 2; ++i)
+		{
+			char const c = hex[i];
+			v            = (byte)(v << 4) | (byte)((c <= '9') ? (c - '0') : (c - 'a' + 10));
+		}
+		out[n++] = v;
+		hex += 2;
+	}
+	return n;
+}
+
+static bool s_equal(byte const* a, byte const* b, u32 size)
+{
+	for (u32 i = 0; i < size; ++i)
+	{
+		if (a[i] != b[i])
+			return false;
+	}
+	return true;
+}
+
+// Reads the addresses that are always there and the ones the writer adds and removes
+// until it is told to stop, counts the lookups that returned a wrong answer
+struct registry_reader_t
+{
+	address_registry_t* m_registry;
+	u32 volatile        m_stop;
+	u32 volatile        m_errors;
+};
+
+static void s_address(address_id_t& id, address_id_t& ep, s32 i, byte stable)
+{
+	id[0] = stable;
+	id[8] = (byte)i;
+	id[9] = (byte)(i >> 8);
+	ep[0] = (byte)(i * 3);
+	ep[1] = stable;
+}
+
+static void s_registry_reader(registry_reader_t* reader)
+{
+	address_id_t id, ep, found;
+	for (s32 n = 0; natomic::load_acquire(&reader->m_stop) == 0; ++n)
+	{
+		s_address(id, ep, n & 255, 1);
+		if (!reader->m_registry->get(id, found) || found.compare(ep) != 0)
+			natomic::fetch_add(&reader->m_errors, 1);
+
+		s_address(id, ep, n & 8191, 0);
+		if (reader->m_registry->get(id, found) && found.compare(ep) != 0)
+			natomic::fetch_add(&reader->m_errors, 1);
+	}
+}
+
+// Advances the wheel to @now and counts the timers that expired, @last is the last one
+static s32 s_advance(timer_wheel_t& wheel, tick_t now, wheel_timer_t*& last)
+{
+	wheel.advance(now);
+	s32 count = 0;
+	last      = NULL;
+	while (wheel_timer_t* timer = wheel.pop_expired())
+	{
+		last = timer;
+		count += 1;
+	}
+	return count;
+}
+
+static char const* s_sunscreen = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+
 UNITTEST_SUITE_BEGIN(address_t)
 {
 	UNITTEST_FIXTURE(main)
@@ -23,6 +114,651 @@ UNITTEST_SUITE_BEGIN(address_t)
 			s->close();
 			gDestroyTcpBasedSocket(s);
 		}
+
+		UNITTEST_TEST(alloc_commit_free_msg)
+		{
+			socket_t* s = gCreateTcpBasedSocket(Allocator);
+			crunes_t sname = make_crunes("Jurgen/CNSHAW1334/10.0.22.76:3824/virtuosgames.com");
+			sockid_t sid;
+			s->open(3824, sname, sid, 32);
+
+			message_t* msg = NULL;
+			CHECK_TRUE(s->alloc_msg(msg));
+			CHECK_EQUAL(1024 * 1024, msg->m_max);
+			msg->m_size = 16;
+			s->commit_msg(msg);
+			CHECK_EQUAL(16, msg->m_size);
+			CHECK_TRUE(msg->m_max < 1024);
+			s->free_msg(msg);
+
+			s->close();
+			gDestroyTcpBasedSocket(s);
+		}
+
+		UNITTEST_TEST(append_attach_msg)
+		{
+			socket_t* s = gCreateTcpBasedSocket(Allocator);
+			crunes_t sname = make_crunes("Jurgen/CNSHAW1334/10.0.22.76:3825/virtuosgames.com");
+			sockid_t sid;
+			s->open(3825, sname, sid, 32);
+
+			byte data[256];
+			for (u32 i = 0; i < sizeof(data); ++i)
+				data[i] = (byte)i;
+
+			message_t* msg = NULL;
+			CHECK_TRUE(s->alloc_msg(msg, 16));
+			CHECK_TRUE(s->append_msg(msg, data, sizeof(data)));
+			CHECK_EQUAL(msg->m_max, msg->m_size);
+			CHECK_EQUAL(0, msg->m_data[0]);
+			CHECK_EQUAL(1, msg->m_data[1]);
+
+			s_released = 0;
+			CHECK_TRUE(s->attach_msg(msg, data, sizeof(data), s_release_buffer, NULL));
+			CHECK_FALSE(s->attach_msg(msg, data, 1024 * 1024, s_release_buffer, NULL));
+			s->free_msg(msg);
+			CHECK_EQUAL(1, s_released);
+
+			s->close();
+			gDestroyTcpBasedSocket(s);
+		}
+
+		UNITTEST_TEST(lz_round_trip)
+		{
+			u32 const src_size = 8192;
+			u32*      hash     = (u32*)Allocator->allocate(sizeof(u32) * nlz::HASH_SIZE, sizeof(u32));
+			byte*     src      = (byte*)Allocator->allocate(src_size, sizeof(u32));
+			byte*     dst      = (byte*)Allocator->allocate(src_size, sizeof(u32));
+			byte*     out      = (byte*)Allocator->allocate(src_size, sizeof(u32));
+
+			// Repeated records with a counter in them, as a message payload often is
+			for (u32 i = 0; i < src_size; ++i)
+				src[i] = (byte)((i % 64) < 8 ? (i / 64) : ('a' + (i % 13)));
+
+			u32 const size = nlz::compress(src, src_size, dst, src_size, hash);
+			CHECK_TRUE(size > 0 && size < src_size / 4);
+			CHECK_TRUE(nlz::decompress(dst, size, out, src_size));
+			for (u32 i = 0; i < src_size; ++i)
+			{
+				if (out[i] != src[i])
+				{
+					CHECK_EQUAL(src[i], out[i]);
+					break;
+				}
+			}
+
+			// Input that does not compress does not fit in a buffer of its own size
+			u32 x = 2463534242u;
+			for (u32 i = 0; i < src_size; ++i)
+			{
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+				src[i] = (byte)x;
+			}
+			CHECK_EQUAL(0, nlz::compress(src, src_size, dst, src_size, hash));
+
+			// Short input is only literals
+			u32 const short_size = nlz::compress(src, 5, dst, src_size, hash);
+			CHECK_TRUE(nlz::decompress(dst, short_size, out, 5));
+			CHECK_EQUAL(src[4], out[4]);
+
+			Allocator->deallocate(out);
+			Allocator->deallocate(dst);
+			Allocator->deallocate(src);
+			Allocator->deallocate(hash);
+		}
+
+		UNITTEST_TEST(lz_corrupt)
+		{
+			u32 const src_size = 4096;
+			u32*      hash     = (u32*)Allocator->allocate(sizeof(u32) * nlz::HASH_SIZE, sizeof(u32));
+			byte*     src      = (byte*)Allocator->allocate(src_size, sizeof(u32));
+			byte*     dst      = (byte*)Allocator->allocate(src_size, sizeof(u32));
+			byte*     out      = (byte*)Allocator->allocate(src_size, sizeof(u32));
+
+			for (u32 i = 0; i < src_size; ++i)
+				src[i] = (byte)('a' + (i % 7));
+			u32 const size = nlz::compress(src, src_size, dst, src_size, hash);
+			CHECK_TRUE(nlz::decompress(dst, size, out, src_size));
+
+			// Truncated, or a size that does not match
+			CHECK_FALSE(nlz::decompress(dst, size - 1, out, src_size));
+			CHECK_FALSE(nlz::decompress(dst, size, out, src_size - 1));
+			CHECK_FALSE(nlz::decompress(dst, 0, out, src_size));
+
+			// A match that points before the start of the output
+			byte bad[] = {0x10, 'a', 0x10, 0x00, 0x00};
+			CHECK_FALSE(nlz::decompress(bad, sizeof(bad), out, src_size));
+
+			// A literal length that runs past the end of the input
+			byte overrun[] = {0xF0, 0xFF, 0xFF, 0x10};
+			CHECK_FALSE(nlz::decompress(overrun, sizeof(overrun), out, src_size));
+
+			// Random garbage never reads or writes out of bounds
+			for (u32 i = 0; i < size; ++i)
+				dst[i] = (byte)((i * 2246822519u) >> 11);
+			nlz::decompress(dst, size, out, src_size);
+
+			Allocator->deallocate(out);
+			Allocator->deallocate(dst);
+			Allocator->deallocate(src);
+			Allocator->deallocate(hash);
+		}
+
+		UNITTEST_TEST(chacha20_rfc8439)
+		{
+			// RFC 8439 2.4.2
+			byte key[32], nonce[12], expected[114], data[114];
+			s_from_hex("000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f", key);
+			s_from_hex("000000000000004a00000000", nonce);
+			s_from_hex("6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0bf91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+			           "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab77937365af90bbf74a35be6b40b8eedf2785e42874d",
+			           expected);
+			g_memcpy(data, s_sunscreen, sizeof(data));
+			ncrypto::chacha20(key, nonce, 1, data, sizeof(data));
+			CHECK_TRUE(s_equal(expected, data, sizeof(data)));
+
+			// draft-irtf-cfrg-xchacha 2.2.1
+			byte input[16], subkey[32];
+			s_from_hex("000000090000004a0000000031415927", input);
+			s_from_hex("82413b4227b27bfed30e42508a877d73a0f9e4d58a74a853c12ec41326d3ecdc", expected);
+			ncrypto::hchacha20(subkey, key, input);
+			CHECK_TRUE(s_equal(expected, subkey, sizeof(subkey)));
+		}
+
+		UNITTEST_TEST(poly1305_rfc8439)
+		{
+			// RFC 8439 2.5.2
+			byte key[32], expected[16], tag[16];
+			s_from_hex("85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b", key);
+			s_from_hex("a8061dc1305136c6c22b8baf0c0127a9", expected);
+			char const*         text = "Cryptographic Forum Research Group";
+			ncrypto::poly1305_t mac;
+			mac.init(key);
+			mac.update((byte const*)text, 34);
+			mac.final(tag);
+			CHECK_TRUE(s_equal(expected, tag, sizeof(tag)));
+		}
+
+		UNITTEST_TEST(aead_rfc8439)
+		{
+			// RFC 8439 2.8.2
+			byte key[32], nonce[12], aad[12], expected[114], expected_tag[16], data[114], tag[16];
+			s_from_hex("808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f", key);
+			s_from_hex("070000004041424344454647", nonce);
+			s_from_hex("50515253c0c1c2c3c4c5c6c7", aad);
+			s_from_hex("d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d63dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+			           "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc3ff4def08e4b7a9de576d26586cec64b6116",
+			           expected);
+			s_from_hex("1ae10b594f09e26a7e902ecbd0600691", expected_tag);
+			g_memcpy(data, s_sunscreen, sizeof(data));
+			ncrypto::seal(key, nonce, aad, sizeof(aad), data, sizeof(data), tag);
+			CHECK_TRUE(s_equal(expected, data, sizeof(data)));
+			CHECK_TRUE(s_equal(expected_tag, tag, sizeof(tag)));
+
+			CHECK_TRUE(ncrypto::open(key, nonce, aad, sizeof(aad), data, sizeof(data), tag));
+			CHECK_TRUE(s_equal((byte const*)s_sunscreen, data, sizeof(data)));
+
+			// A changed byte fails the tag and leaves the data as it was
+			ncrypto::seal(key, nonce, aad, sizeof(aad), data, sizeof(data), tag);
+			data[5] ^= 1;
+			CHECK_FALSE(ncrypto::open(key, nonce, aad, sizeof(aad), data, sizeof(data), tag));
+			data[5] ^= 1;
+			CHECK_TRUE(s_equal(expected, data, sizeof(data)));
+		}
+
+		UNITTEST_TEST(x25519_rfc7748)
+		{
+			// RFC 7748 5.2
+			byte scalar[32], point[32], expected[32], shared[32];
+			s_from_hex("a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4", scalar);
+			s_from_hex("e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c", point);
+			s_from_hex("c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552", expected);
+			CHECK_TRUE(ncrypto::x25519(shared, scalar, point));
+			CHECK_TRUE(s_equal(expected, shared, sizeof(shared)));
+
+			// RFC 7748 6.1
+			byte alice[32], alice_public[32], bob[32], bob_public[32], key[32];
+			s_from_hex("77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a", alice);
+			s_from_hex("5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb", bob);
+			ncrypto::x25519_public(alice_public, alice);
+			ncrypto::x25519_public(bob_public, bob);
+			s_from_hex("8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a", expected);
+			CHECK_TRUE(s_equal(expected, alice_public, sizeof(alice_public)));
+			s_from_hex("de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f", expected);
+			CHECK_TRUE(s_equal(expected, bob_public, sizeof(bob_public)));
+
+			s_from_hex("4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742", expected);
+			CHECK_TRUE(ncrypto::x25519(shared, alice, bob_public));
+			CHECK_TRUE(s_equal(expected, shared, sizeof(shared)));
+			CHECK_TRUE(ncrypto::x25519(key, bob, alice_public));
+			CHECK_TRUE(s_equal(expected, key, sizeof(key)));
+
+			// A point of small order gives a zero secret
+			g_memset(point, 0, sizeof(point));
+			CHECK_FALSE(ncrypto::x25519(shared, alice, point));
+		}
+
+		UNITTEST_TEST(address_registry)
+		{
+			address_registry_t* registry = NULL;
+			CHECK_TRUE(address_registry_t::create(Allocator, 16, registry));
+
+			// Many more than it was created for, the table grows on the way
+			address_id_t id, ep;
+			for (s32 i = 0; i < 4000; ++i)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				ep[0] = (byte)(i * 7);
+				CHECK_TRUE(registry->add(id, ep));
+				CHECK_FALSE(registry->add(id, ep));
+			}
+			for (s32 i = 0; i < 4000; i += 2)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				CHECK_TRUE(registry->rem(id));
+				CHECK_FALSE(registry->rem(id));
+			}
+			for (s32 i = 0; i < 4000; ++i)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				address_id_t found;
+				CHECK_EQUAL((i & 1) != 0, registry->get(id, found));
+				if ((i & 1) != 0)
+					CHECK_EQUAL((byte)(i * 7), found[0]);
+			}
+
+			address_registry_t::destroy(registry);
+		}
+
+		UNITTEST_TEST(address_registry_concurrent)
+		{
+			address_registry_t* registry = NULL;
+			CHECK_TRUE(address_registry_t::create_concurrent(Allocator, 16, registry));
+
+			address_id_t id, ep, found;
+			for (s32 i = 0; i < 1000; ++i)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				ep[0] = (byte)(i * 3);
+				CHECK_TRUE(registry->add(id, ep));
+			}
+			for (s32 i = 0; i < 1000; ++i)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				CHECK_TRUE(registry->get(id, found));
+				CHECK_EQUAL((byte)(i * 3), found[0]);
+			}
+			CHECK_TRUE(registry->rem(id));
+			CHECK_FALSE(registry->get(id, found));
+
+			address_registry_t::destroy(registry);
+		}
+
+		UNITTEST_TEST(address_registry_concurrent_readers)
+		{
+			address_registry_t* registry = NULL;
+			CHECK_TRUE(address_registry_t::create_concurrent(Allocator, 16, registry));
+
+			address_id_t id, ep, found;
+			for (s32 i = 0; i < 256; ++i)
+			{
+				s_address(id, ep, i, 1);
+				CHECK_TRUE(registry->add(id, ep));
+			}
+
+			// The table grows several times while the readers are in it, each time the
+			// old table is freed once the readers have left it
+			registry_reader_t reader = {registry, 0, 0};
+			std::thread       readers[4];
+			for (s32 t = 0; t < 4; ++t)
+				readers[t] = std::thread(s_registry_reader, &reader);
+
+			for (s32 round = 0; round < 4; ++round)
+			{
+				for (s32 i = 0; i < 8192; ++i)
+				{
+					s_address(id, ep, i, 0);
+					CHECK_TRUE(registry->add(id, ep));
+				}
+				for (s32 i = 0; i < 8192; ++i)
+				{
+					s_address(id, ep, i, 0);
+					CHECK_TRUE(registry->rem(id));
+				}
+			}
+
+			natomic::store_release(&reader.m_stop, 1);
+			for (s32 t = 0; t < 4; ++t)
+				readers[t].join();
+			CHECK_EQUAL(0, (s32)reader.m_errors);
+
+			for (s32 i = 0; i < 256; ++i)
+			{
+				s_address(id, ep, i, 1);
+				CHECK_TRUE(registry->get(id, found));
+				CHECK_TRUE(found.compare(ep) == 0);
+			}
+			address_registry_t::destroy(registry);
+		}
+
+		UNITTEST_TEST(address_registry_snapshot)
+		{
+			address_registry_t* registry = NULL;
+			CHECK_TRUE(address_registry_t::create(Allocator, 16, registry));
+
+			address_id_t id, ep, found;
+			for (s32 i = 0; i < 1000; ++i)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				ep[0] = (byte)(i * 3);
+				CHECK_TRUE(registry->add(id, ep));
+			}
+			CHECK_TRUE(registry->save("address_registry.snapshot"));
+			address_registry_t::destroy(registry);
+
+			CHECK_TRUE(address_registry_t::open_snapshot(Allocator, "address_registry.snapshot", registry));
+			for (s32 i = 0; i < 1000; ++i)
+			{
+				id[8] = (byte)i;
+				id[9] = (byte)(i >> 8);
+				CHECK_TRUE(registry->get(id, found));
+				CHECK_EQUAL((byte)(i * 3), found[0]);
+			}
+			CHECK_TRUE(registry->rem(id));
+			CHECK_FALSE(registry->get(id, found));
+			address_registry_t::destroy(registry);
+
+			// The change was not written to the file
+			CHECK_TRUE(address_registry_t::open_snapshot_concurrent(Allocator, "address_registry.snapshot", registry));
+			CHECK_TRUE(registry->get(id, found));
+			address_registry_t::destroy(registry);
+			::remove("address_registry.snapshot");
+		}
+
+		UNITTEST_TEST(address_registry_snapshot_save_in_place)
+		{
+			address_registry_t* registry = NULL;
+			CHECK_TRUE(address_registry_t::create(Allocator, 16, registry));
+
+			address_id_t id, ep, found;
+			for (s32 i = 0; i < 1000; ++i)
+			{
+				s_address(id, ep, i, 0);
+				CHECK_TRUE(registry->add(id, ep));
+			}
+			CHECK_TRUE(registry->save("address_registry.snapshot"));
+			address_registry_t::destroy(registry);
+
+			// The file is replaced while this registry still has the old one mapped
+			CHECK_TRUE(address_registry_t::open_snapshot(Allocator, "address_registry.snapshot", registry));
+			for (s32 i = 0; i < 100; ++i)
+			{
+				s_address(id, ep, i, 1);
+				CHECK_TRUE(registry->add(id, ep));
+			}
+			CHECK_TRUE(registry->save("address_registry.snapshot"));
+			for (s32 i = 0; i < 1000; ++i)
+			{
+				s_address(id, ep, i, 0);
+				CHECK_TRUE(registry->get(id, found));
+				CHECK_TRUE(found.compare(ep) == 0);
+			}
+			address_registry_t::destroy(registry);
+
+			CHECK_TRUE(address_registry_t::open_snapshot_concurrent(Allocator, "address_registry.snapshot", registry));
+			for (s32 i = 0; i < 100; ++i)
+			{
+				s_address(id, ep, i, 1);
+				CHECK_TRUE(registry->get(id, found));
+				CHECK_TRUE(found.compare(ep) == 0);
+			}
+			address_registry_t::destroy(registry);
+
+			// A header that does not agree with the control bytes is not accepted
+			FILE* file = ::fopen("address_registry.snapshot", "r+b");
+			CHECK_TRUE(file != NULL);
+			u32 const count = 0;
+			::fseek(file, 5 * sizeof(u32), SEEK_SET);
+			::fwrite(&count, sizeof(count), 1, file);
+			::fclose(file);
+			CHECK_FALSE(address_registry_t::open_snapshot(Allocator, "address_registry.snapshot", registry));
+			::remove("address_registry.snapshot");
+		}
+
+		UNITTEST_TEST(timer_wheel_schedule_cancel)
+		{
+			timer_wheel_t wheel;
+			wheel.init(0, 1);
+
+			wheel_timer_t a, b, c;
+			wheel.schedule(&a, 10);
+			wheel.schedule(&b, 20);
+			wheel.schedule(&c, 5);
+			CHECK_TRUE(timer_wheel_t::is_scheduled(&b));
+			wheel.cancel(&b);
+			CHECK_FALSE(timer_wheel_t::is_scheduled(&b));
+			wheel.cancel(&b);
+
+			tick_t deadline = 0;
+			CHECK_TRUE(wheel.next_deadline(deadline));
+			CHECK_EQUAL(5, (s32)deadline);
+
+			wheel_timer_t* last = NULL;
+			CHECK_EQUAL(0, s_advance(wheel, 4, last));
+			CHECK_EQUAL(1, s_advance(wheel, 9, last));
+			CHECK_TRUE(last == &c);
+			CHECK_EQUAL(1, s_advance(wheel, 10, last));
+			CHECK_TRUE(last == &a);
+			CHECK_EQUAL(0, s_advance(wheel, 30, last));
+			CHECK_FALSE(wheel.next_deadline(deadline));
+			CHECK_FALSE(timer_wheel_t::is_scheduled(&a));
+		}
+
+		UNITTEST_TEST(timer_wheel_reschedule)
+		{
+			timer_wheel_t wheel;
+			wheel.init(100, 1);
+
+			// Further out, and then closer in again
+			wheel_timer_t a;
+			wheel.schedule(&a, 110);
+			wheel.schedule(&a, 150);
+			wheel_timer_t* last = NULL;
+			CHECK_EQUAL(0, s_advance(wheel, 120, last));
+			wheel.schedule(&a, 130);
+			CHECK_EQUAL(0, s_advance(wheel, 129, last));
+			CHECK_EQUAL(1, s_advance(wheel, 130, last));
+			CHECK_TRUE(last == &a);
+			CHECK_EQUAL(0, s_advance(wheel, 200, last));
+
+			// A time in the past expires on the next advance
+			wheel.schedule(&a, 50);
+			CHECK_EQUAL(1, s_advance(wheel, 200, last));
+			CHECK_TRUE(last == &a);
+
+			// Rescheduling a timer that already expired but was not taken out yet
+			wheel.schedule(&a, 201);
+			wheel.advance(201);
+			wheel.schedule(&a, 210);
+			CHECK_EQUAL(0, s_advance(wheel, 209, last));
+			CHECK_EQUAL(1, s_advance(wheel, 210, last));
+		}
+
+		UNITTEST_TEST(timer_wheel_level_boundary)
+		{
+			timer_wheel_t wheel;
+			wheel.init(60, 1);
+
+			// Around the end of the first level, in the second level and in the third
+			// level, each timer has to expire exactly on time when the wheel is stepped
+			tick_t const   expire[] = {63, 64, 65, 70, 127, 128, 200, 60 + 64 * 64, 64 * 64 * 3 + 1};
+			s32 const      count    = sizeof(expire) / sizeof(expire[0]);
+			wheel_timer_t  timers[count];
+			for (s32 i = 0; i < count; ++i)
+				wheel.schedule(&timers[i], expire[i]);
+
+			s32 expired = 0;
+			for (tick_t now = 61; now <= 64 * 64 * 3 + 1; ++now)
+			{
+				wheel.advance(now);
+				while (wheel_timer_t* timer = wheel.pop_expired())
+				{
+					s32 const i = (s32)(timer - timers);
+					CHECK_EQUAL((s32)expire[i], (s32)now);
+					expired += 1;
+				}
+			}
+			CHECK_EQUAL(count, expired);
+		}
+
+		UNITTEST_TEST(timer_wheel_advance_many_ticks)
+		{
+			timer_wheel_t wheel;
+			wheel.init(0, 1);
+
+			wheel_timer_t a, b, c, d;
+			wheel.schedule(&a, 1);
+			wheel.schedule(&b, 100);
+			wheel.schedule(&c, 5000);
+			wheel.schedule(&d, 300000);
+
+			wheel_timer_t* last = NULL;
+			CHECK_EQUAL(3, s_advance(wheel, 299999, last));
+			CHECK_EQUAL(1, s_advance(wheel, 1000000, last));
+			CHECK_TRUE(last == &d);
+
+			// Further out than the last level, parked until it comes in range
+			tick_t const far = 1000000 + ((tick_t)1 << 24) + 100;
+			wheel.schedule(&a, far);
+			CHECK_EQUAL(0, s_advance(wheel, far - 1, last));
+			CHECK_EQUAL(1, s_advance(wheel, far, last));
+			CHECK_TRUE(last == &a);
+
+			// With a coarser resolution an expiry is rounded up
+			wheel.init(0, 10);
+			wheel.schedule(&b, 15);
+			CHECK_EQUAL(0, s_advance(wheel, 19, last));
+			CHECK_EQUAL(1, s_advance(wheel, 20, last));
+		}
+
+		UNITTEST_TEST(message_pool_size_classes)
+		{
+			message_pool_t pool;
+			CHECK_TRUE(pool.init(Allocator, 64 * 1024));
+			CHECK_EQUAL(64 * 1024, pool.max_size());
+
+			u32 const sizes[]    = {0, 1, 64, 65, 1000, 1024, 1025, 64 * 1024};
+			u32 const capacity[] = {64, 64, 64, 128, 1024, 1024, 2048, 64 * 1024};
+			for (u32 i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+			{
+				message_t* msg = pool.alloc(sizes[i]);
+				CHECK_TRUE(msg != NULL);
+				CHECK_EQUAL(capacity[i], msg->m_max);
+				CHECK_EQUAL(0, msg->m_size);
+				message_pool_t::release(msg);
+
+				msg = pool.alloc_local(sizes[i]);
+				CHECK_TRUE(msg != NULL);
+				CHECK_EQUAL(capacity[i], msg->m_max);
+				pool.free_local(msg);
+			}
+			CHECK_TRUE(pool.alloc(64 * 1024 + 1) == NULL);
+			CHECK_TRUE(pool.alloc_local(64 * 1024 + 1) == NULL);
+			pool.exit();
+		}
+
+		UNITTEST_TEST(message_pool_shrink)
+		{
+			message_pool_t pool;
+			CHECK_TRUE(pool.init(Allocator, 64 * 1024));
+
+			// A message much smaller than its size class moves to the class that fits
+			message_t* msg = pool.alloc(4096);
+			for (u32 i = 0; i < 100; ++i)
+				msg->m_data[i] = (byte)i;
+			msg->m_size          = 100;
+			message_t* const big = msg;
+			msg                  = pool.shrink(msg);
+			CHECK_TRUE(msg != big);
+			CHECK_EQUAL(128, msg->m_max);
+			CHECK_EQUAL(100, msg->m_size);
+			CHECK_EQUAL(0, msg->m_data[0]);
+			CHECK_EQUAL(99, msg->m_data[99]);
+
+			// The segments move along with the payload
+			byte data[256];
+			for (u32 i = 0; i < sizeof(data); ++i)
+				data[i] = (byte)i;
+			s_released = 0;
+			CHECK_TRUE(pool.attach(msg, data, sizeof(data), s_release_buffer, NULL));
+			message_t* const small = msg;
+			CHECK_TRUE(pool.shrink(msg) == small);
+			message_pool_t::release(msg);
+			CHECK_EQUAL(1, s_released);
+
+			// Not worth moving when it is less than 4 times smaller
+			msg         = pool.alloc(4096);
+			msg->m_size = 1500;
+			CHECK_TRUE(pool.shrink(msg) == msg);
+			message_pool_t::release(msg);
+
+			msg         = pool.alloc(4096);
+			msg->m_size = 1000;
+			CHECK_TRUE(pool.attach(msg, data, sizeof(data), s_release_buffer, NULL));
+			message_t* const moved = pool.shrink(msg);
+			CHECK_TRUE(moved != msg);
+			CHECK_EQUAL(1024, moved->m_max);
+			CHECK_EQUAL(256, msg_to_node(moved)->m_segments_size);
+			message_pool_t::release(moved);
+			CHECK_EQUAL(2, s_released);
+			pool.exit();
+		}
+
+		UNITTEST_TEST(message_pool_batch_release)
+		{
+			message_pool_t pool;
+			CHECK_TRUE(pool.init(Allocator, 64 * 1024));
+
+			// Messages of different size classes, the release of the external buffer
+			// tells when a message really went back to the pool
+			byte       data[16];
+			message_t* msgs[40];
+			for (u32 i = 0; i < 40; ++i)
+			{
+				msgs[i] = pool.alloc((i % 4) * 300);
+				CHECK_TRUE(msgs[i] != NULL);
+				CHECK_TRUE(pool.attach(msgs[i], data, sizeof(data), s_release_buffer, NULL));
+			}
+
+			// A shared message stays until its last reference is released
+			message_pool_t::share(msgs[3], 2);
+			s_released = 0;
+			message_pool_t::release(msgs, 40);
+			CHECK_EQUAL(39, s_released);
+			message_pool_t::release(msgs[3]);
+			CHECK_EQUAL(40, s_released);
+
+			// Released on another thread, they go back to the pool they came from
+			for (u32 i = 0; i < 40; ++i)
+				msgs[i] = pool.alloc(100);
+			std::thread releaser([&msgs]() { message_pool_t::release(msgs, 40); });
+			releaser.join();
+			for (u32 i = 0; i < 40; ++i)
+			{
+				msgs[i] = pool.alloc(100);
+				CHECK_TRUE(msgs[i] != NULL);
+			}
+			message_pool_t::release(msgs, 40);
+			pool.exit();
+		}
 	}
 }
 UNITTEST_SUITE_END